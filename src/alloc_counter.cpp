@@ -0,0 +1,51 @@
+#include "alloc_counter.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+#ifdef COUNT_ALLOCATIONS
+
+static thread_local uint64_t allocations = 0;
+
+uint64_t thread_allocations()
+{
+    return allocations;
+};
+
+static void *counted_alloc(size_t size, size_t alignment)
+{
+    allocations++;
+    if (size == 0)
+        size = 1;
+    void *p = alignment > alignof(max_align_t) ? aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+                                               : malloc(size);
+    if (p == nullptr)
+        throw bad_alloc();
+    return p;
+};
+
+void *operator new(size_t size) { return counted_alloc(size, 0); }
+void *operator new[](size_t size) { return counted_alloc(size, 0); }
+void *operator new(size_t size, align_val_t alignment) { return counted_alloc(size, size_t(alignment)); }
+void *operator new[](size_t size, align_val_t alignment) { return counted_alloc(size, size_t(alignment)); }
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, align_val_t) noexcept { free(p); }
+void operator delete[](void *p, align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, align_val_t) noexcept { free(p); }
+void operator delete[](void *p, size_t, align_val_t) noexcept { free(p); }
+
+#else
+
+uint64_t thread_allocations()
+{
+    return 0;
+};
+
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+    Heap allocations made by the calling thread so far. Counting is only
+    compiled in with COUNT_ALLOCATIONS (Debug builds), which replaces the
+    global operator new; otherwise this is always 0 and costs nothing.
+*/
+uint64_t thread_allocations();
@@ -0,0 +1,47 @@
+#include "atomic_file.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+bool write_file_atomically(const string &path, const vector<uint8_t> &data)
+{
+    string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        cerr << "Cannot create " << temporary << ": " << strerror(errno) << endl;
+        return false;
+    }
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            cerr << "Cannot write " << temporary << ": " << strerror(errno) << endl;
+            close(fd);
+            unlink(temporary.c_str());
+            return false;
+        }
+        written += n;
+    }
+
+    // rename() swaps the file atomically; the data has to be on disk before it does
+    bool synced = fsync(fd) == 0;
+    bool closed = close(fd) == 0;
+    if (!synced || !closed || rename(temporary.c_str(), path.c_str()) == -1)
+    {
+        cerr << "Cannot replace " << path << ": " << strerror(errno) << endl;
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+};
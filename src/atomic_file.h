@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Writes data next to path and renames it into place, so that a server
+// mapping the old file keeps a consistent view and new ones see the new
+// file. A failure leaves the old file as it was.
+bool write_file_atomically(const string &path, const vector<uint8_t> &data);
@@ -0,0 +1,97 @@
+#include "batch.h"
+
+#include <cerrno>
+#include <cstdio>
+
+using namespace std;
+
+int DatagramBatch::bucket(size_t n)
+{
+    int b = 0;
+    while (n > 1 && b < batch_histogram_buckets - 1)
+    {
+        n >>= 1;
+        b++;
+    }
+    return b;
+};
+
+void DatagramBatch::resize(size_t capacity, size_t size)
+{
+    datagram_size = size;
+    count = 0;
+    buffers.assign(capacity * datagram_size, 0);
+    iovecs.assign(capacity, iovec{});
+    addresses.assign(capacity, sockaddr_in{});
+    headers.assign(capacity, mmsghdr{});
+};
+
+int DatagramBatch::receive(int fd, BatchStats &stats)
+{
+    // Every slot is rearmed because the kernel overwrites msg_namelen and msg_len
+    for (size_t i = 0; i < headers.size(); i++)
+    {
+        iovecs[i].iov_base = data(i);
+        iovecs[i].iov_len = datagram_size - 1; // room for a null terminator
+        headers[i].msg_hdr = msghdr{};
+        headers[i].msg_hdr.msg_name = &addresses[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_len = 0;
+    }
+
+    int received = recvmmsg(fd, headers.data(), headers.size(), MSG_DONTWAIT, nullptr);
+    count = received > 0 ? received : 0;
+    if (received > 0)
+    {
+        stats.recv_calls++;
+        stats.received += received;
+        stats.recv_histogram[bucket(received)]++;
+    }
+    return received;
+};
+
+char *DatagramBatch::reserve(const sockaddr_in &to)
+{
+    if (full())
+        return nullptr;
+    addresses[count] = to;
+    return data(count);
+};
+
+void DatagramBatch::commit(size_t length)
+{
+    iovecs[count].iov_base = data(count);
+    iovecs[count].iov_len = length;
+    headers[count].msg_hdr = msghdr{};
+    headers[count].msg_hdr.msg_name = &addresses[count];
+    headers[count].msg_hdr.msg_namelen = sizeof(addresses[count]);
+    headers[count].msg_hdr.msg_iov = &iovecs[count];
+    headers[count].msg_hdr.msg_iovlen = 1;
+    count++;
+};
+
+void DatagramBatch::flush(int fd, BatchStats &stats)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        int sent = sendmmsg(fd, headers.data() + done, count - done, MSG_DONTWAIT);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            // UDP gives no delivery guarantee anyway; whatever the socket
+            // will not take right now is dropped rather than stalling the loop
+            perror("Failed to send responses");
+            stats.dropped += count - done;
+            break;
+        }
+        stats.send_calls++;
+        stats.sent += sent;
+        stats.send_histogram[bucket(sent)]++;
+        done += sent;
+    }
+    count = 0;
+};
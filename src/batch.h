@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+const int default_batch_size = 32;
+const int max_batch_size = 1024;
+
+// Histogram buckets are powers of two: 1, 2-3, 4-7, ..., 512-1023, 1024
+const int batch_histogram_buckets = 11;
+
+struct BatchStats
+{
+    uint64_t recv_calls = 0;
+    uint64_t received = 0;
+    uint64_t send_calls = 0;
+    uint64_t sent = 0;
+    uint64_t dropped = 0; // replies the socket would not take
+    uint64_t recv_histogram[batch_histogram_buckets] = {};
+    uint64_t send_histogram[batch_histogram_buckets] = {};
+};
+
+/*
+    A set of datagram slots for recvmmsg/sendmmsg. The buffers, iovecs and
+    addresses are allocated once and reused for every batch.
+
+    Receiving: receive() fills up to capacity() slots in one syscall.
+    Sending: reserve() hands out the next free slot, commit() fixes its
+    length, and flush() pushes every committed slot out in one syscall.
+*/
+class DatagramBatch
+{
+    size_t datagram_size = 0;
+    size_t count = 0;
+    vector<char> buffers;
+    vector<iovec> iovecs;
+    vector<sockaddr_in> addresses;
+    vector<mmsghdr> headers;
+
+    static int bucket(size_t n);
+
+public:
+    void resize(size_t capacity, size_t datagram_size);
+    size_t capacity() const { return headers.size(); }
+    size_t size() const { return count; }
+    bool full() const { return count == headers.size(); }
+
+    int receive(int fd, BatchStats &stats);
+    char *data(size_t i) { return buffers.data() + i * datagram_size; }
+    size_t length(size_t i) const { return headers[i].msg_len; }
+    sockaddr_in &address(size_t i) { return addresses[i]; }
+
+    char *reserve(const sockaddr_in &to);
+    void commit(size_t length);
+    void flush(int fd, BatchStats &stats);
+};
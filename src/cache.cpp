@@ -0,0 +1,402 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+AnswerCache::AnswerCache(size_t max_bytes) : max_bytes(max_bytes) {};
+
+CacheKey::CacheKey(const NameView &qname, uint16_t qtype, uint16_t qclass)
+{
+    // Names are case-insensitive, so fold them before they become part of the key
+    length = qname.copy_to(data, true);
+    finish(qtype, qclass);
+};
+
+CacheKey::CacheKey(const uint8_t *qname, uint16_t qtype, uint16_t qclass)
+{
+    length = 0;
+    while (qname[length] != 0)
+    {
+        uint8_t len = qname[length];
+        data[length] = len;
+        for (size_t i = 1; i <= len; i++)
+            data[length + i] = tolower(qname[length + i]);
+        length += len + 1;
+    }
+    data[length++] = 0;
+    finish(qtype, qclass);
+};
+
+void CacheKey::finish(uint16_t qtype, uint16_t qclass)
+{
+    data[length++] = qtype >> 8;
+    data[length++] = qtype & 0xFF;
+    data[length++] = qclass >> 8;
+    data[length++] = qclass & 0xFF;
+};
+
+size_t AnswerCache::entry_size(const Entry &entry)
+{
+    // Rough footprint of an entry: the slot itself, its key, its index
+    // bucket and the answers.
+    return sizeof(Entry) + entry.key.capacity() + 2 * sizeof(uint32_t) +
+           entry.answers.records.capacity() * sizeof(DNSAnswer) + entry.answers.data.capacity();
+};
+
+size_t AnswerCache::find_bucket(string_view key, size_t hash) const
+{
+    // The bucket holding key, or the empty bucket where it would go
+    size_t mask = index.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        uint32_t slot = index[i];
+        if (slot == 0 || (slots[slot - 1].hash == hash && slots[slot - 1].key == key))
+            return i;
+    }
+};
+
+void AnswerCache::index_insert(size_t slot)
+{
+    if ((stats_.entries + 1) * 2 > index.size())
+    {
+        // Grow and rehash; this is the only time the index allocates
+        vector<uint32_t> old = std::move(index);
+        index.assign(old.empty() ? 1024 : old.size() * 2, 0);
+        for (uint32_t s : old)
+            if (s != 0)
+                index[find_bucket(slots[s - 1].key, slots[s - 1].hash)] = s;
+    }
+    index[find_bucket(slots[slot].key, slots[slot].hash)] = slot + 1;
+};
+
+void AnswerCache::index_erase(size_t slot)
+{
+    // Linear probing with backward-shift deletion, so no tombstones pile up
+    size_t mask = index.size() - 1;
+    size_t hole = find_bucket(slots[slot].key, slots[slot].hash);
+    for (size_t j = (hole + 1) & mask; index[j] != 0; j = (j + 1) & mask)
+    {
+        size_t home = slots[index[j] - 1].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            index[hole] = index[j];
+            hole = j;
+        }
+    }
+    index[hole] = 0;
+};
+
+CacheResult AnswerCache::lookup(const CacheKey &key, RecordSet &answers)
+{
+    CacheResult result;
+    if (!enabled())
+        return result;
+
+    string_view view = key.view();
+    size_t hash = std::hash<string_view>()(view);
+    uint32_t slot = index.empty() ? 0 : index[find_bucket(view, hash)];
+    auto now = clock::now();
+    if (slot != 0 && now >= slots[slot - 1].expires + stale_ttl)
+    {
+        remove(slot - 1);
+        stats_.expirations++;
+        slot = 0;
+    }
+    if (slot == 0)
+    {
+        slot = fetch_lower(view, hash, result);
+        if (slot == 0)
+        {
+            stats_.misses++;
+            return result;
+        }
+    }
+
+    Entry &entry = slots[slot - 1];
+
+    // Count the TTLs down by the time the answers have been sitting here.
+    // Stale ones go out with a short TTL of their own, so that clients come
+    // back for the fresh answer soon.
+    result.found = true;
+    result.rcode = entry.rcode;
+    result.stale = now >= entry.expires;
+    result.negative = entry.rcode != 0 || entry.answers.records[0].section != ANSWER_SECTION;
+    uint32_t elapsed = chrono::duration_cast<chrono::seconds>(now - entry.inserted).count();
+    size_t first = answers.size();
+    answers.append(entry.answers);
+    for (size_t i = first; i < answers.size(); i++)
+    {
+        DNSAnswer &answer = answers.records[i];
+        answer.ttl = result.stale ? stale_answer_ttl : answer.ttl > elapsed ? answer.ttl - elapsed : 0;
+    }
+    entry.hits++;
+    if (now >= entry.refresh_after && (result.stale || popular(entry, now)))
+    {
+        if (take_refresh(now))
+        {
+            result.refresh = true;
+            entry.refresh_after = now + chrono::seconds(stale_refresh_interval);
+        }
+        else
+            stats_.refreshes_deferred++;
+    }
+
+    entry.referenced = true;
+    stats_.hits++;
+    stats_.negative_hits += result.negative;
+    stats_.stale_hits += result.stale;
+    stats_.shared_hits += result.shared;
+    stats_.snapshot_hits += result.snapshot;
+    return result;
+};
+
+uint32_t AnswerCache::fetch_lower(string_view key, size_t hash, CacheResult &result)
+{
+    // The slot number + 1 of what the shared cache or the snapshot had, or 0
+    if (shared == nullptr && snapshot == nullptr)
+        return 0;
+    SharedEntry found;
+    uint64_t lower_hash = SharedCache::hash(key);
+    lower_answers.clear();
+    if (shared != nullptr && shared->lookup(key, lower_hash, *lower_view, lower_answers, found, stale_ttl))
+        result.shared = true;
+    else if (snapshot != nullptr && snapshot->lookup(key, lower_hash, *lower_view, lower_answers, found, stale_ttl))
+        result.snapshot = true;
+    if (lower_answers.empty())
+        return 0;
+
+    // Making room for the entry can evict the entry itself; that is a miss
+    size_t slot = store(key, hash, lower_answers, found.rcode, found.inserted, found.expires);
+    if (!slots[slot].used)
+    {
+        result.shared = result.snapshot = false;
+        return 0;
+    }
+    if (result.snapshot && shared != nullptr)
+        shared->insert(key, lower_hash, slots[slot].answers, found);
+    return slot + 1;
+};
+
+void AnswerCache::attach_shared(SharedCache *cache)
+{
+    shared = cache != nullptr && cache->enabled() ? cache : nullptr;
+    if (shared != nullptr && !lower_view)
+        lower_view = make_unique<MessageView>();
+};
+
+void AnswerCache::attach_snapshot(const CacheSnapshot *from)
+{
+    snapshot = from != nullptr && from->enabled() ? from : nullptr;
+    if (snapshot != nullptr && !lower_view)
+        lower_view = make_unique<MessageView>();
+};
+
+void AnswerCache::save(vector<uint8_t> &out) const
+{
+    // Times go into the file as Unix time, which outlives this process's steady clock
+    auto now = clock::now();
+    int64_t wall = to_unix_seconds(now);
+    vector<uint8_t> scratch;
+    for (auto &entry : slots)
+    {
+        if (!entry.used || now >= entry.expires + stale_ttl)
+            continue;
+        append_snapshot_entry(out, scratch, entry.key, entry.answers, entry.rcode,
+                              wall + chrono::duration_cast<chrono::seconds>(entry.inserted - now).count(),
+                              wall + chrono::duration_cast<chrono::seconds>(entry.expires - now).count());
+    }
+};
+
+bool AnswerCache::take_refresh(clock::time_point now)
+{
+    if (refresh_rate == 0)
+        return true;
+
+    // A token bucket holding a second's worth, refilled continuously
+    int64_t full = int64_t(refresh_rate) * 1000;
+    int64_t elapsed_ms = chrono::duration_cast<chrono::milliseconds>(now - refresh_refilled).count();
+    refresh_balance = min(full, refresh_balance + elapsed_ms * refresh_rate);
+    refresh_refilled = now;
+    if (refresh_balance < 1000)
+        return false;
+    refresh_balance -= 1000;
+    return true;
+};
+
+bool AnswerCache::popular(const Entry &entry, clock::time_point now)
+{
+    // Hits a minute over the time it has been cached; the first second
+    // counts as a whole one, so that an early hit or two is not a rate
+    int64_t age_ms = max<int64_t>(1000, chrono::duration_cast<chrono::milliseconds>(now - entry.inserted).count());
+    return uint64_t(entry.hits) * 60000 >= uint64_t(prefetch_min_rate) * age_ms;
+};
+
+// How long an answer may be cached, 0 if it may not
+static uint32_t cache_ttl(const RecordSet &answers, uint16_t rcode)
+{
+    bool positive = rcode == 0 && any_of(answers.records.begin(), answers.records.end(),
+                                         [](const DNSAnswer &answer) { return answer.section == ANSWER_SECTION; });
+
+    // A positive answer lives as long as its shortest-lived record
+    if (positive)
+    {
+        uint32_t ttl = max_cache_ttl;
+        for (auto &answer : answers.records)
+            ttl = min(ttl, answer.ttl);
+        return ttl;
+    }
+
+    // A negative one as long as its SOA says, the lesser of the SOA
+    // record's TTL and its MINIMUM field (RFC 2308 5)
+    if (rcode != 0 && rcode != RCODE_NXDOMAIN)
+        return 0;
+    for (auto &answer : answers.records)
+    {
+        if (answer.section != AUTHORITY_SECTION || answer.type != TYPE_SOA || answer.rdlength < 20)
+            continue;
+        uint32_t minimum = read32(answers.rdata(answer) + answer.rdlength - 4);
+        return min({answer.ttl, minimum, max_negative_ttl});
+    }
+    return 0;
+};
+
+void AnswerCache::insert(const CacheKey &key, const RecordSet &answers, uint16_t rcode)
+{
+    if (!enabled() || answers.empty())
+        return;
+
+    uint32_t ttl = cache_ttl(answers, rcode);
+    if (ttl == 0)
+        return; // zero TTL means "use for this transaction only"
+
+    string_view view = key.view();
+    auto now = clock::now();
+    size_t slot = store(view, std::hash<string_view>()(view), answers, rcode, now, now + chrono::seconds(ttl));
+    if (shared != nullptr && slots[slot].used)
+    {
+        const Entry &entry = slots[slot];
+        shared->insert(view, SharedCache::hash(view), entry.answers, SharedEntry{rcode, entry.inserted, entry.expires});
+    }
+};
+
+size_t AnswerCache::store(string_view view, size_t hash, const RecordSet &answers, uint16_t rcode,
+                          clock::time_point inserted, clock::time_point expires)
+{
+    size_t slot;
+    uint32_t existing = index.empty() ? 0 : index[find_bucket(view, hash)];
+    if (existing != 0)
+    {
+        slot = existing - 1;
+        stats_.bytes -= slots[slot].bytes;
+    }
+    else
+    {
+        if (!free_slots.empty())
+        {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        else
+        {
+            slot = slots.size();
+            slots.emplace_back();
+        }
+        slots[slot].key.assign(view);
+        slots[slot].hash = hash;
+        index_insert(slot);
+        stats_.entries++;
+    }
+
+    Entry &entry = slots[slot];
+    entry.answers.records.assign(answers.records.begin(), answers.records.end());
+    entry.answers.data.assign(answers.data.begin(), answers.data.end());
+    uint32_t ttl = chrono::duration_cast<chrono::seconds>(expires - inserted).count();
+    // The records of a negative answer, its SOA above all, count down
+    // from the negative TTL (RFC 2308 5)
+    bool negative = rcode != 0 || entry.answers.records[0].section != ANSWER_SECTION;
+    for (auto &answer : entry.answers.records)
+        answer.ttl = min(answer.ttl, negative ? ttl : max_cache_ttl);
+    entry.rcode = rcode;
+    entry.inserted = inserted;
+    entry.expires = expires;
+    // Prefetching starts prefetch_percent of the TTL before it runs out
+    entry.refresh_after = entry.expires - chrono::milliseconds(uint64_t(ttl) * 10 * prefetch_percent);
+    entry.hits = 0;
+    entry.bytes = entry_size(entry);
+    entry.referenced = true;
+    entry.used = true;
+
+    stats_.bytes += entry.bytes;
+    stats_.insertions++;
+
+    while (stats_.bytes > max_bytes && stats_.entries > 1)
+        evict_one();
+    return slot;
+};
+
+void AnswerCache::remove(size_t slot)
+{
+    Entry &entry = slots[slot];
+    index_erase(slot);
+    stats_.bytes -= entry.bytes;
+    stats_.entries--;
+
+    // Keep the key's and answers' capacity around for whoever gets the slot next
+    entry.key.clear();
+    entry.answers.clear();
+    entry.used = false;
+    entry.referenced = false;
+    free_slots.push_back(slot);
+};
+
+void AnswerCache::evict_one()
+{
+    auto now = clock::now();
+    while (true)
+    {
+        hand = (hand + 1) % slots.size();
+        Entry &entry = slots[hand];
+        if (!entry.used)
+            continue;
+
+        if (now >= entry.expires + stale_ttl)
+        {
+            remove(hand);
+            stats_.expirations++;
+            return;
+        }
+        if (entry.referenced)
+        {
+            // Give it a second chance; it goes if it is not used again before the hand comes back
+            entry.referenced = false;
+            continue;
+        }
+
+        remove(hand);
+        stats_.evictions++;
+        return;
+    }
+};
+
+void AnswerCache::resize(size_t new_max_bytes)
+{
+    max_bytes = new_max_bytes;
+    if (!enabled())
+    {
+        slots.clear();
+        free_slots.clear();
+        index.clear();
+        stats_.entries = 0;
+        stats_.bytes = 0;
+        return;
+    }
+    while (stats_.bytes > max_bytes && stats_.entries > 1)
+        evict_one();
+};
+
+CacheStats AnswerCache::stats() const
+{
+    return stats_;
+};
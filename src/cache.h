@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "message.h"
+#include "shared_cache.h"
+#include "snapshot.h"
+#include "wire.h"
+
+using namespace std;
+
+const size_t default_cache_size = 64 * 1024 * 1024; // 64 MiB
+const uint32_t max_cache_ttl = 86400;                 // never trust an upstream TTL longer than a day
+const uint32_t max_negative_ttl = 10800;              // nor a negative answer longer than three hours (RFC 2308 5)
+const uint32_t stale_answer_ttl = 30;                 // the TTL a stale answer goes out with (RFC 8767 4)
+const uint32_t stale_refresh_interval = 30;           // seconds between refreshes of one stale entry
+const uint32_t prefetch_min_rate = 8;                 // hits a minute since it was fetched that make an entry worth prefetching
+const uint32_t default_refresh_rate = 100;            // background refreshes per second
+
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t negative_hits = 0; // of the hits, NXDOMAIN and NODATA
+    uint64_t stale_hits = 0;    // of the hits, past their TTL
+    uint64_t shared_hits = 0;   // of the hits, found in the shared cache by a local miss
+    uint64_t snapshot_hits = 0; // of the hits, found in the snapshot the server started from
+    uint64_t refreshes_deferred = 0; // refreshes that were due but over the refresh rate
+    uint64_t insertions = 0;
+    uint64_t evictions = 0;
+    uint64_t expirations = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+/*
+    (qname, qtype, qclass) laid out as the lowercased wire-format name
+    followed by the type and class octets. Built on the stack, so that a
+    lookup never has to allocate.
+*/
+struct CacheKey
+{
+    uint8_t data[max_name_length + 4];
+    size_t length;
+
+    CacheKey(const NameView &qname, uint16_t qtype, uint16_t qclass);
+    CacheKey(const uint8_t *qname, uint16_t qtype, uint16_t qclass);
+
+    string_view view() const { return string_view(reinterpret_cast<const char *>(data), length); }
+
+private:
+    void finish(uint16_t qtype, uint16_t qclass);
+};
+
+// What a lookup found
+struct CacheResult
+{
+    bool found = false;
+    uint16_t rcode = 0;   // NXDOMAIN, or 0 for an answer or NODATA
+    bool negative = false; // NXDOMAIN or NODATA
+    bool stale = false;   // past its TTL, served anyway (RFC 8767)
+    bool shared = false;  // missed here, found in the shared cache
+    bool snapshot = false; // missed here and there, found in the snapshot
+    bool refresh = false; // due to be asked for again upstream: stale, or popular and about to expire
+
+    explicit operator bool() const { return found; }
+};
+
+/*
+    An answer cache keyed by (qname, qtype, qclass).
+
+    Entries live in a fixed ring of slots that is swept by a CLOCK hand:
+    every hit sets the slot's reference bit, and when the memory budget is
+    exceeded the hand clears reference bits until it finds a slot that was
+    not used since the last sweep, which is then evicted. This approximates
+    LRU without having to move anything around on a hit.
+
+    Answers are stored as the RecordSet copy_records made of the
+    upstream reply, records of every section with their RDATA, so a hit
+    can be appended to the request directly. The TTL of every served
+    record is counted down by the time the entry has spent in the cache.
+
+    The index is an open-addressing table of slot numbers, and evicted
+    slots keep the capacity of their key and answers for the next entry,
+    so neither a hit nor a refill of a warm cache touches the heap.
+
+    Negative answers are cached too (RFC 2308): NXDOMAIN, and NOERROR
+    without an answer to the question (NODATA), each with the SOA of the
+    authority section that says for how long. That is the lesser of the
+    SOA's TTL and its MINIMUM field. A negative answer without an SOA is
+    not cached.
+
+    With a stale TTL set, entries are kept that long after they expire,
+    and a lookup that finds one serves it stale, with a TTL of 30 seconds
+    (RFC 8767). The caller is asked to refresh it upstream in the
+    background, at most every 30 seconds. If the upstream is down, clients
+    keep getting the last answer it gave instead of a timeout.
+
+    With prefetch set to a percentage, an entry that has been hit at least
+    prefetch_min_rate times a minute on average since it was fetched is
+    refreshed ahead of time, once it is into the last part of its TTL, so
+    that the names clients ask for most never expire at all. It is the
+    rate that counts, not the number of hits, or a long TTL would make any
+    name look popular. Refreshes of both kinds are
+    limited to a rate, and one that is due while the rate is used up is
+    left for a later lookup.
+
+    Attached to a SharedCache, every answer inserted is written through to
+    it as well, and a miss here looks there before it is a miss. What it
+    finds is kept here too, with the TTL it has left, so the next lookup
+    of the name stays local.
+
+    Below that, a miss looks in the snapshot the server was started from,
+    if there is one, so that a restart picks up where the last run left
+    off. What is found there is shared as well.
+*/
+class AnswerCache
+{
+    typedef chrono::steady_clock clock;
+
+    struct Entry
+    {
+        string key;
+        size_t hash = 0;
+        RecordSet answers;
+        clock::time_point inserted;
+        clock::time_point expires;
+        clock::time_point refresh_after; // the next time it is worth asking again
+        uint32_t hits = 0;               // since it was fetched
+        uint16_t rcode = 0;
+        size_t bytes = 0;
+        bool referenced = false;
+        bool used = false;
+    };
+
+    size_t max_bytes;
+    chrono::seconds stale_ttl{0};
+    uint32_t prefetch_percent = 0;
+    uint32_t refresh_rate = default_refresh_rate;
+    int64_t refresh_balance = 0; // in thousandths of a refresh
+    clock::time_point refresh_refilled;
+    vector<Entry> slots;
+    vector<size_t> free_slots;
+    vector<uint32_t> index; // slot number + 1 per bucket, 0 for an empty bucket
+    size_t hand = 0;
+    CacheStats stats_;
+    SharedCache *shared = nullptr;
+    const CacheSnapshot *snapshot = nullptr;
+    unique_ptr<MessageView> lower_view; // for reading entries back from either
+    RecordSet lower_answers;
+
+    size_t store(string_view key, size_t hash, const RecordSet &answers, uint16_t rcode, clock::time_point inserted,
+                 clock::time_point expires);
+    uint32_t fetch_lower(string_view key, size_t hash, CacheResult &result);
+
+    static size_t entry_size(const Entry &entry);
+
+    size_t find_bucket(string_view key, size_t hash) const;
+    void index_insert(size_t slot);
+    void index_erase(size_t slot);
+
+    void remove(size_t slot);
+    void evict_one();
+    bool take_refresh(clock::time_point now);
+    static bool popular(const Entry &entry, clock::time_point now);
+
+public:
+    AnswerCache(size_t max_bytes = default_cache_size);
+
+    // A hit appends its records to answers
+    CacheResult lookup(const CacheKey &key, RecordSet &answers);
+    // rcode is 0 or NXDOMAIN; answers that cannot be cached are ignored
+    void insert(const CacheKey &key, const RecordSet &answers, uint16_t rcode = 0);
+
+    void resize(size_t max_bytes);
+    // How long past their TTL entries may be served, 0 for not at all
+    void set_stale_ttl(uint32_t seconds) { stale_ttl = chrono::seconds(seconds); }
+    // Refresh popular entries in the last percent of their TTL, 0 for never
+    void set_prefetch(uint32_t percent) { prefetch_percent = min(percent, 100u); }
+    // Background refreshes per second, 0 for no limit
+    void set_refresh_rate(uint32_t rate) { refresh_rate = rate; }
+    // A second level, shared with other workers and processes
+    void attach_shared(SharedCache *cache);
+    // Where a miss looks last, until what the snapshot holds expires
+    void attach_snapshot(const CacheSnapshot *from);
+    // Appends every entry still worth serving, as append_snapshot_entry does
+    void save(vector<uint8_t> &out) const;
+    bool enabled() const { return max_bytes > 0; }
+    CacheStats stats() const;
+};
@@ -0,0 +1,167 @@
+#include "dataset.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <arpa/inet.h>
+#include <strings.h>
+
+#include "zonefile.h"
+
+using namespace std;
+
+static bool parse_resolver(const string &text, sockaddr_in &address)
+{
+    // ip:port, or just ip for port 53
+    size_t colon = text.find(':');
+    string ip = text.substr(0, colon);
+    int port = colon == string::npos ? 53 : atoi(text.c_str() + colon + 1);
+    address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    return port > 0 && port < 65536 && inet_pton(AF_INET, ip.c_str(), &address.sin_addr) == 1;
+};
+
+static bool read_config(const string &path, DatasetSource &source)
+{
+    ifstream in(path);
+    if (!in)
+    {
+        cerr << "Cannot read config " << path << endl;
+        return false;
+    }
+    string line;
+    for (int number = 1; getline(in, line); number++)
+    {
+        line = line.substr(0, line.find('#'));
+        istringstream fields(line);
+        string key, value, extra;
+        if (!(fields >> key))
+            continue;
+        if (!(fields >> value) || (fields >> extra))
+        {
+            cerr << path << ":" << number << ": expected a setting and one value" << endl;
+            return false;
+        }
+        if (key == "resolver")
+            source.resolvers.push_back(value);
+        else if (key == "zone")
+            source.zone_files.push_back(value);
+        else if (key == "zone-image")
+            source.zone_image = value;
+        else if (key == "root-hints")
+            source.root_hints = value;
+        else
+        {
+            cerr << path << ":" << number << ": unknown setting " << key << endl;
+            return false;
+        }
+    }
+    return true;
+};
+
+static bool read_root_hints(const string &path, vector<sockaddr_in> &servers)
+{
+    // Master file records, ; comments; only the A records matter
+    ifstream in(path);
+    if (!in)
+    {
+        cerr << "Cannot read root hints " << path << endl;
+        return false;
+    }
+    string line;
+    while (getline(in, line))
+    {
+        istringstream fields(line.substr(0, line.find(';')));
+        string field, previous;
+        while (fields >> field)
+        {
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            if (strcasecmp(previous.c_str(), "A") == 0 && inet_pton(AF_INET, field.c_str(), &address.sin_addr) == 1)
+                servers.push_back(address);
+            previous = field;
+        }
+    }
+    if (servers.empty())
+    {
+        cerr << path << ": no root server addresses" << endl;
+        return false;
+    }
+    return true;
+};
+
+static bool build_zones(const vector<string> &zone_files, ZoneIndex &zones)
+{
+    ZoneBuilder builder;
+    for (auto &argument : zone_files)
+    {
+        // Either origin=file or just the file, whose SOA then says what the origin is
+        size_t equals = argument.find('=');
+        string origin = equals == string::npos ? "" : argument.substr(0, equals);
+        string path = equals == string::npos ? argument : argument.substr(equals + 1);
+        if (!builder.load(path, origin))
+            return false;
+    }
+
+    vector<uint8_t> image;
+    if (!builder.build(image) || !zones.open(std::move(image)))
+    {
+        cerr << "Failed to build the zone index" << endl;
+        return false;
+    }
+    return true;
+};
+
+bool load_dataset(const DatasetSource &options, Dataset &dataset)
+{
+    DatasetSource source = options;
+    if (!source.config_path.empty() && !read_config(source.config_path, source))
+        return false;
+
+    for (auto &resolver : source.resolvers)
+    {
+        sockaddr_in address;
+        if (!parse_resolver(resolver, address))
+        {
+            cerr << "Invalid resolver address " << resolver << endl;
+            return false;
+        }
+        dataset.resolvers.push_back(address);
+    }
+    if (!source.root_hints.empty())
+    {
+        if (!dataset.resolvers.empty())
+        {
+            cerr << "resolvers and root hints cannot be combined, either forward or resolve from the root" << endl;
+            return false;
+        }
+        if (!read_root_hints(source.root_hints, dataset.root_servers))
+            return false;
+    }
+
+    if (source.zone_files.empty() && source.zone_image.empty())
+        return true;
+
+    auto start = chrono::steady_clock::now();
+    if (!source.zone_image.empty())
+    {
+        // A precompiled image is used as it is on disk, there is nothing to parse
+        if (!source.zone_files.empty())
+        {
+            cerr << "zone files and a zone image cannot be combined, compile all zones into the image" << endl;
+            return false;
+        }
+        if (!dataset.zones.map(source.zone_image))
+            return false;
+    }
+    else if (!build_zones(source.zone_files, dataset.zones))
+        return false;
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    ZoneIndex &zones = dataset.zones;
+    cout << "zones: " << zones.zone_count() << " zones, " << zones.record_count() << " records, "
+         << zones.node_count() << " names, " << zones.size() << " bytes, loaded in " << elapsed << " ms" << endl;
+    return true;
+};
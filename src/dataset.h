@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+
+#include "zone.h"
+
+using namespace std;
+
+/*
+    Where the reloadable part of the configuration comes from: the
+    --resolver, --root-hints, --zone and --zone-image options, plus the
+    same settings in a --config file, which is read again on every reload.
+    The file has one setting per line, with # comments:
+
+        resolver 9.9.9.9:53
+        zone example.com=/etc/dns/example.com.zone
+        zone-image /etc/dns/zones.img
+
+    Instead of resolvers, root-hints (or --root-hints) names a file with
+    the addresses of the root name servers, such as named.root: every A
+    record in it is one. The server then resolves names itself, from the
+    root down.
+*/
+struct DatasetSource
+{
+    vector<string> resolvers; // ip[:port]
+    vector<string> zone_files;
+    string zone_image;
+    string root_hints;
+    string config_path;
+};
+
+/*
+    Everything a reload can change, built off to the side by the main
+    thread and published to the workers in one pointer swap (see rcu.h).
+    Workers only ever read it.
+*/
+struct Dataset
+{
+    uint64_t generation = 0;
+    vector<sockaddr_in> resolvers; // empty unless forwarding
+    vector<sockaddr_in> root_servers; // from the root hints, empty unless resolving from the root; no port
+    ZoneIndex zones;
+};
+
+// Reads the zones and the config file afresh; false, with the reason on cerr, if anything is wrong
+bool load_dataset(const DatasetSource &options, Dataset &dataset);
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+const size_t classic_udp_size = 512;   // the most a UDP reply may carry without EDNS (RFC 1035 2.3.4)
+const size_t default_edns_size = 1232; // what we offer with EDNS; small enough not to fragment (DNS flag day 2020)
+const size_t max_edns_size = 4096;     // the largest --edns-size
+const size_t max_message_size = 65535; // over TCP, behind a two-octet length (RFC 1035 4.2.2)
+const int default_port = 2053;
+const char default_addr[] = "127.0.0.1";
+const size_t max_name_length = 255; // RFC 1035 2.3.4, including the length octets
+
+// Record types that get special treatment somewhere; any other type is carried as opaque RDATA
+enum RRType : uint16_t
+{
+    TYPE_A = 1,
+    TYPE_NS = 2,
+    TYPE_MD = 3,
+    TYPE_MF = 4,
+    TYPE_CNAME = 5,
+    TYPE_SOA = 6,
+    TYPE_MB = 7,
+    TYPE_MG = 8,
+    TYPE_MR = 9,
+    TYPE_PTR = 12,
+    TYPE_MINFO = 14,
+    TYPE_MX = 15,
+    TYPE_TXT = 16,
+    TYPE_RP = 17,
+    TYPE_AFSDB = 18,
+    TYPE_RT = 21,
+    TYPE_AAAA = 28,
+    TYPE_SRV = 33,
+    TYPE_DNAME = 39,
+    TYPE_OPT = 41,
+    TYPE_ANY = 255,
+};
+
+const uint16_t CLASS_IN = 1;
+
+const uint16_t RCODE_FORMERR = 1;
+const uint16_t RCODE_SERVFAIL = 2;
+const uint16_t RCODE_NXDOMAIN = 3;
+const uint16_t RCODE_NOTIMP = 4;
+const uint16_t RCODE_REFUSED = 5;
+const uint16_t RCODE_BADVERS = 16; // extended, the upper 8 bits go in the OPT record (RFC 6891 6.1.3)
+
+/*
+    A domain name in uncompressed wire format, e.g. \x07example\x03com\x00.
+    The octets are stored inline, so names can be copied around (and
+    messages reused) without ever touching the heap.
+*/
+struct WireName
+{
+    uint8_t bytes[max_name_length];
+    uint16_t length = 0;
+
+    const uint8_t *data() const { return bytes; }
+    size_t size() const { return length; }
+    void assign(const uint8_t *name, size_t size)
+    {
+        memcpy(bytes, name, size);
+        length = size;
+    }
+};
+
+struct DNSHeader
+{
+    uint16_t id;
+    uint16_t flags;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+};
+
+struct DNSQuestion
+{
+    WireName qname;
+    uint16_t qtype;
+    uint16_t qclass;
+};
+
+struct DNSAnswer
+{
+    WireName name;        // an owner name, i.e., the name of the node to which this resource record pertains.
+    uint16_t type;        // two octets containing one of the RR TYPE codes.
+    uint16_t class_;      // two octets containing one of the RR CLASS codes.
+    uint32_t ttl;         /*
+                        a 32 bit signed integer that specifies the time interval
+                        that the resource record may be cached before the source
+                        of the information should again be consulted.  Zero
+                        values are interpreted to mean that the RR can only be
+                        used for the transaction in progress, and should not be
+                        cached.  For example, SOA records are always distributed
+                        with a zero TTL to prohibit caching.  Zero values can
+                        also be used for extremely volatile data.
+                        */
+
+    uint16_t rdlength; // an unsigned 16 bit integer that specifies the length in octets of the RDATA field
+    uint32_t rdata;    /*
+                   where the RDATA, a variable length string of octets
+                   that describes the resource, starts in the data of the
+                   RecordSet holding this record. Names in it are stored
+                   uncompressed.
+                   */
+    uint8_t section;   // a Section: answer, authority or additional
+};
+
+/*
+    Resource records together with their RDATA, say everything an upstream
+    sent back for one question. The RDATA of all records sits back to back
+    in data, so a set is two vectors however many records it holds. Sets
+    are cleared and refilled rather than rebuilt, so once their vectors
+    have grown, filling them does not touch the heap.
+*/
+struct RecordSet
+{
+    vector<DNSAnswer> records;
+    vector<uint8_t> data;
+
+    void clear()
+    {
+        records.clear();
+        data.clear();
+    }
+    bool empty() const { return records.empty(); }
+    size_t size() const { return records.size(); }
+    const uint8_t *rdata(const DNSAnswer &record) const { return data.data() + record.rdata; }
+
+    DNSAnswer &add(const WireName &name, uint16_t type, uint16_t class_, uint32_t ttl, uint8_t section,
+                   const uint8_t *rdata, uint16_t rdlength)
+    {
+        records.emplace_back();
+        DNSAnswer &record = records.back();
+        record.name = name;
+        record.type = type;
+        record.class_ = class_;
+        record.ttl = ttl;
+        record.section = section;
+        record.rdlength = rdlength;
+        record.rdata = data.size();
+        data.insert(data.end(), rdata, rdata + rdlength);
+        return record;
+    }
+
+    void append(const RecordSet &other)
+    {
+        size_t first = records.size(), base = data.size();
+        records.insert(records.end(), other.records.begin(), other.records.end());
+        data.insert(data.end(), other.data.begin(), other.data.end());
+        for (size_t i = first; i < records.size(); i++)
+            records[i].rdata += base;
+    }
+};
+
+struct DNSMessage
+{
+    DNSHeader header;
+    vector<DNSQuestion> questions;
+    RecordSet answers; // of all three sections
+};
@@ -0,0 +1,142 @@
+#include "metrics.h"
+
+#include <bit>
+#include <cstring>
+#include <iomanip>
+
+#include "message.h"
+
+using namespace std;
+
+struct MetricInfo
+{
+    const char *name;
+    const char *labels; // empty, or the inside of {...}
+    const char *type;
+    const char *help;
+};
+
+// In Counter order. Entries that share a name are one metric with several
+// label sets, and have to follow each other.
+static const MetricInfo counter_info[counter_count] = {
+    {"dns_queries_total", "", "counter", "Client queries taken in, over UDP and TCP."},
+    {"dns_tcp_queries_total", "", "counter", "Client queries taken in over TCP."},
+    {"dns_malformed_queries_total", "", "counter", "Client packets dropped because they did not parse."},
+    {"dns_replies_total", "rcode=\"NOERROR\"", "counter", "Replies sent to clients, by RCODE."},
+    {"dns_replies_total", "rcode=\"NXDOMAIN\"", "counter", ""},
+    {"dns_replies_total", "rcode=\"SERVFAIL\"", "counter", ""},
+    {"dns_replies_total", "rcode=\"REFUSED\"", "counter", ""},
+    {"dns_replies_total", "rcode=\"other\"", "counter", ""},
+    {"dns_truncated_replies_total", "", "counter", "UDP replies sent with TC set."},
+    {"dns_cache_lookups_total", "result=\"hit\"", "counter", "Answer cache lookups, one per forwarded question."},
+    {"dns_cache_lookups_total", "result=\"miss\"", "counter", ""},
+    {"dns_cache_lookups_total", "result=\"stale\"", "counter", ""},
+    {"dns_cache_lookups_total", "result=\"shared\"", "counter", ""},
+    {"dns_cache_lookups_total", "result=\"snapshot\"", "counter", ""},
+    {"dns_cache_negative_hits_total", "", "counter", "Cache hits on NXDOMAIN and NODATA answers."},
+    {"dns_cache_refreshes_total", "reason=\"stale\"", "counter", "Cached answers asked for again in the background."},
+    {"dns_cache_refreshes_total", "reason=\"prefetch\"", "counter", ""},
+    {"dns_upstream_queries_total", "", "counter", "Questions sent upstream."},
+    {"dns_coalesced_queries_total", "", "counter", "Questions that joined one already in flight instead."},
+    {"dns_upstream_timeouts_total", "", "counter", "Questions answered with SERVFAIL after every retry timed out."},
+    {"dns_upstream_tcp_retries_total", "", "counter", "Questions asked again over TCP after a truncated answer."},
+    {"dns_referrals_total", "", "counter", "Referrals followed while resolving from the root."},
+    {"dns_delegation_cache_hits_total", "", "counter", "Resolution steps started at a zone cut learned earlier instead of the root."},
+    {"dns_tcp_connections_total", "result=\"accepted\"", "counter", "Client TCP connections."},
+    {"dns_tcp_connections_total", "result=\"refused\"", "counter", ""},
+    {"dns_rate_limited_total", "action=\"query_dropped\"", "counter", "Queries and replies held back by rate limiting."},
+    {"dns_rate_limited_total", "action=\"reply_dropped\"", "counter", ""},
+    {"dns_rate_limited_total", "action=\"reply_slipped\"", "counter", ""},
+    {"dns_query_log_records_total", "result=\"written\"", "counter", "Query log records, by what became of them."},
+    {"dns_query_log_records_total", "result=\"dropped\"", "counter", ""},
+    {"dns_cache_entries", "", "gauge", "Answers in the cache."},
+    {"dns_cache_bytes", "", "gauge", "Bytes the cached answers take."},
+    {"dns_pending_clients", "", "gauge", "Client queries waiting for an upstream answer."},
+    {"dns_tcp_connections_open", "", "gauge", "Open TCP connections, clients' and our own."},
+};
+
+static const MetricInfo histogram_info[histogram_count] = {
+    {"dns_receive_seconds", "", "histogram", "Time spent in one recvmmsg call that returned queries."},
+    {"dns_parse_seconds", "", "histogram", "Time to parse a client query, sampled."},
+    {"dns_cache_lookup_seconds", "", "histogram", "Time to look up a question in the cache, sampled."},
+    {"dns_upstream_rtt_seconds", "", "histogram", "Time from sending a query upstream to its answer."},
+    {"dns_send_seconds", "", "histogram", "Time spent in one sendmmsg call."},
+};
+
+void WorkerMetrics::observe(Histogram histogram, uint64_t ns)
+{
+    // Bucket i holds (2^(i-1), 2^i] times the smallest bound
+    int shift = ns <= 1 ? 0 : bit_width(ns - 1);
+    int bucket = min(max(shift - latency_min_shift, 0), latency_buckets);
+    LatencyHistogram &h = histograms_[histogram];
+    bump(h.buckets[bucket], 1);
+    bump(h.sum_ns, ns);
+};
+
+void WorkerMetrics::add_to(MetricsSnapshot &total) const
+{
+    for (int i = 0; i < counter_count; i++)
+        total.counters[i] += counters_[i].load(memory_order_relaxed);
+    for (int h = 0; h < histogram_count; h++)
+    {
+        for (int b = 0; b <= latency_buckets; b++)
+            total.buckets[h][b] += histograms_[h].buckets[b].load(memory_order_relaxed);
+        total.sum_ns[h] += histograms_[h].sum_ns.load(memory_order_relaxed);
+    }
+};
+
+Counter reply_counter(uint16_t rcode)
+{
+    switch (rcode)
+    {
+    case 0:
+        return REPLIES_NOERROR;
+    case RCODE_NXDOMAIN:
+        return REPLIES_NXDOMAIN;
+    case RCODE_SERVFAIL:
+        return REPLIES_SERVFAIL;
+    case RCODE_REFUSED:
+        return REPLIES_REFUSED;
+    default:
+        return REPLIES_OTHER;
+    }
+};
+
+static void write_header(ostream &out, const MetricInfo &info)
+{
+    out << "# HELP " << info.name << " " << info.help << "\n# TYPE " << info.name << " " << info.type << "\n";
+};
+
+void write_prometheus(ostream &out, const MetricsSnapshot &metrics, size_t workers)
+{
+    out << "# HELP dns_workers Serving threads.\n# TYPE dns_workers gauge\ndns_workers " << workers << "\n";
+
+    for (int i = 0; i < counter_count; i++)
+    {
+        const MetricInfo &info = counter_info[i];
+        if (i == 0 || strcmp(info.name, counter_info[i - 1].name) != 0)
+            write_header(out, info);
+        out << info.name;
+        if (info.labels[0] != '\0')
+            out << "{" << info.labels << "}";
+        out << " " << metrics.counters[i] << "\n";
+    }
+
+    // Buckets are cumulative, with their upper bound in seconds, exact with 10 digits
+    out << setprecision(10);
+    for (int h = 0; h < histogram_count; h++)
+    {
+        const MetricInfo &info = histogram_info[h];
+        write_header(out, info);
+        uint64_t count = 0;
+        for (int b = 0; b < latency_buckets; b++)
+        {
+            count += metrics.buckets[h][b];
+            out << info.name << "_bucket{le=\"" << double(uint64_t(1) << (b + latency_min_shift)) / 1e9 << "\"} " << count << "\n";
+        }
+        count += metrics.buckets[h][latency_buckets];
+        out << info.name << "_bucket{le=\"+Inf\"} " << count << "\n";
+        out << info.name << "_sum " << metrics.sum_ns[h] / 1e9 << "\n";
+        out << info.name << "_count " << count << "\n";
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+using namespace std;
+
+// Latency buckets are powers of two in nanoseconds, from 64 ns up to 2^33 ns
+// (8.6 s), plus one for anything slower
+const int latency_min_shift = 6;
+const int latency_buckets = 28;
+// One packet in this many has its parse and cache lookup timed; the others
+// would pay for the clock reads alone
+const uint64_t latency_sample_interval = 16;
+
+enum Counter : uint8_t
+{
+    QUERIES,
+    TCP_QUERIES,
+    MALFORMED_QUERIES,
+    REPLIES_NOERROR,
+    REPLIES_NXDOMAIN,
+    REPLIES_SERVFAIL,
+    REPLIES_REFUSED,
+    REPLIES_OTHER,
+    TRUNCATED_REPLIES,
+    CACHE_HITS,
+    CACHE_MISSES,
+    CACHE_STALE_HITS,    // served past their TTL, with --serve-stale
+    CACHE_SHARED_HITS,   // missed in the worker's cache, found in the shared one
+    CACHE_SNAPSHOT_HITS, // missed in both, found in the snapshot the server started from
+    CACHE_NEGATIVE_HITS, // NXDOMAIN and NODATA answers among the hits, stale or not
+    STALE_REFRESHES,     // stale names asked for again in the background
+    PREFETCHES,          // popular names asked for again before they expire
+    UPSTREAM_QUERIES,
+    COALESCED_QUERIES,
+    UPSTREAM_TIMEOUTS,
+    UPSTREAM_TCP_RETRIES,
+    REFERRALS,       // followed while resolving from the root
+    DELEGATION_HITS, // resolution steps that started below the root, at a cut learned earlier
+    TCP_ACCEPTED,
+    TCP_REFUSED,
+    RATE_LIMITED_QUERIES, // dropped on arrival, their client prefix was over its rate
+    RATE_LIMITED_DROPPED, // replies dropped by response rate limiting
+    RATE_LIMITED_SLIPPED, // sent truncated instead
+    QUERYLOG_WRITTEN, // added in from the query log at scrape time
+    QUERYLOG_DROPPED,
+    // Gauges, set once per loop iteration
+    CACHE_ENTRIES,
+    CACHE_BYTES,
+    PENDING_CLIENTS,
+    TCP_OPEN,
+    counter_count
+};
+
+enum Histogram : uint8_t
+{
+    RECEIVE_LATENCY,      // one recvmmsg call that returned queries
+    PARSE_LATENCY,        // one client query, sampled
+    CACHE_LOOKUP_LATENCY, // one question, sampled
+    UPSTREAM_RTT,         // query sent to answer received, per upstream answer
+    SEND_LATENCY,         // one sendmmsg call
+    histogram_count
+};
+
+struct LatencyHistogram
+{
+    atomic<uint64_t> buckets[latency_buckets + 1];
+    atomic<uint64_t> sum_ns;
+};
+
+// Every worker's metrics added up, as of one scrape
+struct MetricsSnapshot
+{
+    uint64_t counters[counter_count] = {};
+    uint64_t buckets[histogram_count][latency_buckets + 1] = {};
+    uint64_t sum_ns[histogram_count] = {};
+};
+
+/*
+    The counters and latency histograms of one worker. Only the worker
+    writes them, so an increment is a relaxed load and store of its own
+    cache lines, with no locked instruction; the struct is padded so that
+    nothing another thread writes shares a line with it. A scrape reads
+    them from the main thread with relaxed loads and adds every worker up.
+    The totals it sees may be a few increments apart from each other,
+    never torn.
+*/
+class alignas(64) WorkerMetrics
+{
+    atomic<uint64_t> counters_[counter_count] = {};
+    LatencyHistogram histograms_[histogram_count] = {};
+
+    static void bump(atomic<uint64_t> &value, uint64_t n) { value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed); }
+
+public:
+    typedef chrono::steady_clock clock;
+
+    void add(Counter counter, uint64_t n = 1) { bump(counters_[counter], n); }
+    void set(Counter gauge, uint64_t value) { counters_[gauge].store(value, memory_order_relaxed); }
+    uint64_t get(Counter counter) const { return counters_[counter].load(memory_order_relaxed); }
+
+    void observe(Histogram histogram, uint64_t ns);
+    void observe(Histogram histogram, clock::time_point start, clock::time_point end)
+    {
+        observe(histogram, chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+    }
+
+    void add_to(MetricsSnapshot &total) const;
+};
+
+// The reply counter for an RCODE
+Counter reply_counter(uint16_t rcode);
+
+// Prometheus text exposition format, version 0.0.4
+void write_prometheus(ostream &out, const MetricsSnapshot &metrics, size_t workers);
@@ -6,391 +6,1246 @@ DNS *DNS::instance = nullptr;
 
 DNS::DNS() {};
 
-void DNS::handle_client(DNSMessage &request, sockaddr_in &clientAddress)
+void DNS::handle_client(Worker &worker, const MessageView &request, const sockaddr_in &clientAddress, uint64_t connection)
 {
-    char buffer[BUF_SIZE];
-    size_t totalSize;
-    int bytesRead;
-    vector<string> question_names;
-    socklen_t clientAddressLen = sizeof(clientAddress);
-    DNSMessage message; // used to send back to clients
+    // Names in our own zones are answered on the spot, straight from the zone index
+    const EdnsInfo &edns = request.edns();
+    if (edns.version == 0 && !worker.data->zones.empty() && answer_from_zones(worker, request, clientAddress, connection))
+        return;
+
+    // Park the request until every one of its questions has an answer. The
+    // view points into the receive buffer, which the next batch reuses, so
+    // the questions are copied out (uncompressed) at this point.
+    uint64_t client_id = worker.clients.acquire();
+    PendingClient &client = *worker.clients.get(client_id);
+    client.reset();
+    client.request.header = request.header();
+    client.address = clientAddress;
+    client.connection = connection;
+    client.edns = edns;
+    client.received = worker.received_at;
+    if (connection != 0)
+        worker.connections.get(connection)->outstanding++;
+
+    for (size_t i = 0; i < request.question_count(); i++)
+    {
+        const QuestionView &view = request.question(i);
+        DNSQuestion question;
+        question.qname.length = view.name.copy_to(question.qname.bytes);
+        question.qtype = view.qtype;
+        question.qclass = view.qclass;
+        client.request.questions.push_back(question);
+    }
 
-    // Make room for new answers;
-    request.answers.clear();
+#ifdef DEBUG
+    print_DNS_message(client.request, true, false);
+#endif
+
+    // Only EDNS version 0 exists; a client asking for a later one is told which we speak
+    if (edns.version != 0)
+    {
+        client.rcode = RCODE_BADVERS;
+        complete(worker, client_id);
+        return;
+    }
+
+    resolve(worker, client_id);
+};
+
+bool DNS::answer_from_zones(Worker &worker, const MessageView &request, const sockaddr_in &clientAddress, uint64_t connection)
+{
+    // Only standard queries; anything else takes the usual path and gets NOTIMP. A
+    // request with several questions takes it too: one rcode and one AA bit
+    // cannot speak for answers that came from different places.
+    if ((request.header().flags & 0b0111100000000000) != 0 || request.question_count() != 1)
+        return false;
+
+    // The lookup results point into this name, so it stays put until the reply is written
+    const ZoneIndex &zones = worker.data->zones;
+    const QuestionView &question = request.question(0);
+    uint8_t qname[max_name_length];
+    question.name.copy_to(qname);
+    ZoneAnswer answer;
+    if (question.qclass != CLASS_IN || !zones.lookup(qname, question.qtype, answer))
+        return false; // not ours: forward it, or whatever else we would do
+
+    const EdnsInfo &edns = request.edns();
+    size_t capacity;
+    uint8_t *buffer = begin_reply(worker, clientAddress, connection, edns, capacity);
+    if (buffer == nullptr)
+        return true;
+    uint16_t flags = (request.header().flags & 0b0000000100000000) | 0b1000000000000000 | answer.rcode; // QR, RD copied
+    if (answer.authoritative)
+        flags |= 0b0000010000000000; // AA
+
+    // Room for the OPT record is kept back until the records are in
+    WireWriter writer(buffer, capacity - (edns.present ? opt_record_size : 0));
+    writer.header(DNSHeader{request.header().id, flags, 1, answer.record_count(ANSWER_SECTION),
+                            answer.record_count(AUTHORITY_SECTION), 0});
+    writer.name(qname);
+    writer.u16(question.qtype);
+    writer.u16(question.qclass);
+    size_t records_start = writer.length();
+    for (int section = ANSWER_SECTION; section <= AUTHORITY_SECTION; section++)
+        for (size_t i = 0; i < answer.counts[section]; i++)
+            zones.write(writer, answer.sections[section][i]);
+
+    // Additional records are a courtesy: those that do not fit are left out, without TC (RFC 2181 9)
+    uint16_t additional = 0;
+    for (size_t i = 0; i < answer.counts[ADDITIONAL_SECTION] && !writer.overflowed(); i++)
+    {
+        const ZoneRecordSet &set = answer.sections[ADDITIONAL_SECTION][i];
+        size_t rrset_start = writer.length();
+        zones.write(writer, set);
+        if (writer.overflowed())
+        {
+            writer.rollback(rrset_start);
+            break;
+        }
+        additional += set.rrset->count;
+    }
+    write16(buffer + 10, additional);
 
-    // Collect all the questions in the question section of the request
-    for (auto question : request.questions)
+    if (writer.overflowed())
+    {
+        // The answer itself does not fit: send the questions alone with TC set
+        writer.rollback(records_start);
+        write16(buffer + 2, flags | 0x0200);
+        write16(buffer + 6, 0);
+        write16(buffer + 8, 0);
+        if (connection == 0)
+            worker.metrics.add(TRUNCATED_REPLIES);
+    }
+    if (edns.present)
     {
-        string temp_qname = "";
-        for (size_t i = 0; i < question.qname.size(); i++)
-            temp_qname += question.qname[i];
-        question_names.push_back(temp_qname);
+        writer.set_capacity(capacity);
+        writer.opt(identity.edns_size, 0, edns.dnssec_ok);
+        write16(buffer + 10, read16(buffer + 10) + 1);
     }
+    bool limited = end_reply(worker, connection, writer.length());
+    if (worker.log_ring != nullptr)
+        log_reply(worker, buffer, clientAddress, worker.received_at,
+                  QUERYLOG_ZONE | (connection != 0 ? QUERYLOG_TCP : 0) | (limited ? QUERYLOG_RATE_LIMITED : 0));
+    return true;
+};
 
-    // Forward each DNS question to servers
-    for (auto question_name : question_names)
+void DNS::resolve(Worker &worker, uint64_t client_id)
+{
+    PendingClient &client = *worker.clients.get(client_id);
+    DNSMessage &request = client.request;
+    // Questions go out to the resolvers, or are resolved from the root down
+    bool forwarding = !worker.data->resolvers.empty() || !worker.data->root_servers.empty();
+
+    // Every question is dealt with right away. Cached ones are answered on
+    // the spot, and the misses all go upstream together, so a request with
+    // several questions takes as long as its slowest one, not all of them
+    // one after the other. handle_upstream fills in the rest as it arrives.
+    for (size_t i = 0; i < request.questions.size(); i++)
     {
-        string qname = "";
-        DNSMessage response;
-        DNSMessage forward_message;
-        DNSAnswer new_answer;
+        const DNSQuestion &question = request.questions[i];
+
+        // Hot names are answered straight from the cache, without an upstream round trip
+        CacheKey key(question.qname.data(), question.qtype, question.qclass);
+        auto lookup_start = worker.timing ? WorkerMetrics::clock::now() : WorkerMetrics::clock::time_point();
+        CacheResult hit = worker.cache.lookup(key, client.answers[i]);
+        if (worker.timing)
+            worker.metrics.observe(CACHE_LOOKUP_LATENCY, lookup_start, WorkerMetrics::clock::now());
+        worker.metrics.add(!hit ? CACHE_MISSES : hit.stale ? CACHE_STALE_HITS : hit.shared ? CACHE_SHARED_HITS : hit.snapshot ? CACHE_SNAPSHOT_HITS : CACHE_HITS);
+        if (hit)
+        {
+            if (hit.negative)
+                worker.metrics.add(CACHE_NEGATIVE_HITS);
+            if (client.rcode == 0)
+                client.rcode = hit.rcode;
+
+            // A stale answer goes out right away, and so does a popular one
+            // that is about to expire, and the name is asked for again in
+            // the background, with no client waiting on it
+            if (hit.refresh && forwarding && worker.pending.find_question(hash<string_view>()(key.view())) == nullptr &&
+                forward_question(worker, 0, 0, question, hash<string_view>()(key.view())))
+                worker.metrics.add(hit.stale ? STALE_REFRESHES : PREFETCHES);
+            continue;
+        }
+        client.cached = false;
 
-        construct_header(forward_message, request);
-        construct_question(forward_message, question_name);
+        if (!forwarding && !worker.data->zones.empty())
+        {
+            // An authoritative server does not answer for other people's names
+            client.rcode = RCODE_REFUSED;
+            continue;
+        }
 
-        // serialize the message and forward to the DNS server
-        serialize_message(forward_message, buffer, totalSize, true, false);
-        if (sendto(identity.fd, buffer, totalSize, 0, reinterpret_cast<struct sockaddr *>(&identity.forward_addr), sizeof(identity.forward_addr)) == -1)
-            perror("Failed to send response");
+        if (!forwarding)
+        {
+            construct_default_answer(client.answers[i], question.qname);
+            continue;
+        }
 
-        // receive the message from the DNS server
-        memset(buffer, 0, sizeof(buffer));
-        if ((bytesRead = recvfrom(identity.fd, buffer, sizeof(buffer), 0, reinterpret_cast<struct sockaddr *>(&identity.forward_addr), &identity.addr_len)) == -1)
-            ;
-        perror("Error receiving data");
+        // When a popular name expires, many clients miss on it at once. Only
+        // the first one's question goes upstream, the others wait for its answer.
+        uint64_t question_key = hash<string_view>()(key.view());
+        PendingQuery *in_flight = worker.pending.find_question(question_key);
+        if (in_flight != nullptr && in_flight->qtype == question.qtype && in_flight->qclass == question.qclass &&
+            NameView{in_flight->qname.data(), in_flight->qname.size(), 0}.equals(question.qname.data()))
+        {
+            worker.pending.add_waiter(*in_flight, client_id, i);
+            worker.metrics.add(COALESCED_QUERIES);
+            client.outstanding++;
+            continue;
+        }
 
-        // deserialize the message received from the DNS server
-        deserialize_message(response, buffer, bytesRead, true, true);
-        construct_answer(request, response);
+        if (forward_question(worker, client_id, i, question, question_key))
+        {
+            client.outstanding++;
+            continue;
+        }
+
+        client.rcode = RCODE_SERVFAIL; // the question could not even be sent
     }
 
-    construct_message(message, request, true, true);
-    // print_DNS_message(request, true, true);
-    // print_DNS_message(message, true, true);
+    if (client.outstanding == 0)
+    {
+        complete(worker, client_id);
+        return;
+    }
 
-    // return;
-#ifdef DEBUG
-    print_DNS_message(request, true, true);
-#endif
+    // Whatever has not come back by the deadline is answered with SERVFAIL
+    client.deadline = PendingTable::clock::now() + chrono::milliseconds(identity.deadline_ms);
+    worker.deadlines.push(client.deadline, client_id);
+};
+
+void DNS::complete(Worker &worker, uint64_t client_id)
+{
+    // The answers go out in the order of the questions, however they came in
+    PendingClient &client = *worker.clients.get(client_id);
+    for (size_t i = 0; i < client.request.questions.size(); i++)
+        client.request.answers.append(client.answers[i]);
 
-    memset(buffer, 0, sizeof(buffer));
-    totalSize = 0;
-    serialize_message(message, buffer, totalSize, true, true);
+    send_reply(worker, client);
+    uint64_t connection = client.connection;
+    worker.clients.release(client_id);
 
-    if (sendto(identity.fd, buffer, sizeof(buffer), 0, reinterpret_cast<struct sockaddr *>(&clientAddress), sizeof(clientAddress)) == -1)
-        perror("Failed to send response");
+    // A connection that was paused for having too many queries in progress may go on
+    if (TcpConnection *tcp = connection != 0 ? worker.connections.get(connection) : nullptr)
+    {
+        tcp->outstanding--;
+        mark_active(worker, *tcp, connection);
+    }
 };
 
-vector<string> DNS::split(string raw_string, string delimeter)
+void DNS::handle_deadlines(Worker &worker)
 {
-    vector<string> res;
-    size_t start = 0, end = raw_string.find(delimeter);
-    while (end != string::npos)
+    auto now = PendingTable::clock::now();
+    while (!worker.deadlines.empty() && worker.deadlines.top().deadline <= now)
     {
-        if (raw_string.substr(start, end - start).size() > 0)
-            res.push_back(raw_string.substr(start, end - start));
-        start = end + 1;
-        end = raw_string.find(delimeter, start);
+        uint64_t client_id = worker.deadlines.top().handle;
+        worker.deadlines.pop();
+
+        // Clients that got their reply in time are gone from the pool already
+        PendingClient *client = worker.clients.get(client_id);
+        if (client == nullptr)
+            continue;
+        client->rcode = RCODE_SERVFAIL;
+        complete(worker, client_id);
     }
-    res.push_back(raw_string.substr(start));
-    return res;
 };
-vector<uint8_t> DNS::encode_string(string raw_string)
+
+int DNS::next_timeout(Worker &worker)
 {
-    vector<string> strs = split(raw_string, ".");
-    vector<uint8_t> res;
-    for (auto e : strs)
+    // Sleep until the next upstream retry or client deadline, whichever comes first
+    auto now = PendingTable::clock::now();
+    int timeout = worker.pending.next_timeout(now);
+    if (!worker.connection_timers.empty())
     {
-        res.push_back(static_cast<uint8_t>(e.size()));
-        for (size_t i = 0; i < e.size(); i++)
-            res.push_back(static_cast<uint8_t>(e[i]));
+        int idle = DeadlineHeap::milliseconds_until(worker.connection_timers.top().deadline, now);
+        timeout = timeout == -1 ? idle : min(timeout, idle);
     }
-    res.push_back(0);
-    return res;
+    while (!worker.deadlines.empty() && worker.clients.get(worker.deadlines.top().handle) == nullptr)
+        worker.deadlines.pop();
+    if (worker.deadlines.empty())
+        return timeout;
+    int deadline = DeadlineHeap::milliseconds_until(worker.deadlines.top().deadline, now);
+    return timeout == -1 ? deadline : min(timeout, deadline);
 };
 
-void DNS::serialize_message(const DNSMessage &message, char *buffer, size_t &totalSize, bool includeQuestion, bool includeAnswer)
+bool DNS::forward_question(Worker &worker, uint64_t client_id, size_t question_index, const DNSQuestion &question,
+                           uint64_t question_key)
 {
-    size_t offset = 0;
+    if (worker.data->resolvers.empty())
+        return iterate_question(worker, client_id, question_index, question, question_key);
+
+    uint8_t *buffer = reinterpret_cast<uint8_t *>(worker.send_buffer);
+
+    auto now = PendingTable::clock::now();
+    Upstream *upstream = worker.upstreams.select();
+    uint16_t id;
+    if (!worker.pending.allocate_id(upstream->address, id))
+        return false; // far too many queries out at this upstream already
+    PendingQuery &query = worker.pending.insert(id, upstream->address);
+    query.client = client_id;
+    query.question = question_index;
+    query.qname = question.qname;
+    query.qtype = question.qtype;
+    query.qclass = question.qclass;
+    query.timeout_ms = identity.timeout_ms;
+    query.give_up = now + chrono::milliseconds(identity.deadline_ms);
+
+    // The upstream sees our transaction ID, not the client's
+    WireWriter writer(buffer, sizeof(worker.send_buffer));
+    writer.header(DNSHeader{query.id, 0x0100, 1, 0, 0, 1}); // RD(1), we want the upstream to recurse for us
+    writer.name(question.qname.data());
+    writer.u16(question.qtype);
+    writer.u16(question.qclass);
+    // Our payload size goes along, so that answers up to that size come back over UDP whole
+    writer.opt(identity.edns_size, 0, false);
+    query.packet.assign(buffer, buffer + writer.length());
+
+    if (!send_query(worker, query, query.targets[0], now))
+    {
+        worker.pending.erase(query);
+        return false;
+    }
+    query.attempts = 1;
+    worker.pending.track_question(query, question_key);
+    worker.metrics.add(UPSTREAM_QUERIES);
+
+    // A dead upstream gets a copy of a real query now and then, to find out whether it is back
+    Upstream *probe = worker.upstreams.probe_due(now);
+    QueryTarget *target = probe != nullptr ? worker.pending.add_target(query, probe->address) : nullptr;
+    if (target != nullptr)
+    {
+        target->probe = true;
+        send_query(worker, query, *target, now);
+    }
 
-    serialize_header(message, buffer, offset);
-    if (includeQuestion)
-        serialize_question(message, buffer, offset);
-    if (includeAnswer)
-        serialize_answer(message, buffer, offset);
-    // Set the total size
-    totalSize = offset;
+    schedule_query(worker, query, now);
+    return true;
 };
 
-void DNS::serialize_header(const DNSMessage &message, char *&buffer, size_t &offset)
+bool DNS::send_query(Worker &worker, PendingQuery &query, QueryTarget &target, PendingTable::clock::time_point now)
 {
-    memcpy(buffer + offset, &message.header, sizeof(message.header));
-    offset += sizeof(message.header);
+    if (sendto(worker.upstream_fd, query.packet.data(), query.packet.size(), 0, reinterpret_cast<struct sockaddr *>(&target.address), sizeof(target.address)) == -1)
+    {
+        perror("Failed to forward query");
+        return false;
+    }
+    target.sent = now;
+    target.sends++;
+    target.timed_out = false;
+    if (Upstream *upstream = worker.upstreams.find(target.address))
+        upstream->sent++;
+    return true;
 };
 
-void DNS::serialize_question(const DNSMessage &message, char *&buffer, size_t &offset)
+void DNS::schedule_query(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now)
 {
-    for (auto question : message.questions)
+    // Back off exponentially: 800ms, 1.6s, 3.2s, ... by default, but never
+    // past the deadline; a round cut short there is the last one
+    int timeout_ms = query.timeout_ms << (query.attempts - 1);
+    query.retry_at = min(now + chrono::milliseconds(timeout_ms), query.give_up);
+    PendingTable::clock::time_point deadline = query.retry_at;
+
+    // With --hedge, a first round that takes longer than the upstream
+    // usually needs goes to the next best upstream as well
+    if (worker.upstreams.hedge_percentile() != 0 && !query.hedged && query.attempts == 1)
     {
-        memcpy(buffer + offset, question.qname.data(), question.qname.size());
-        offset += question.qname.size();
+        Upstream *first = worker.upstreams.find(query.targets[0].address);
+        if (first != nullptr && first->hedge_delay_us != 0)
+            deadline = min(deadline, now + chrono::microseconds(first->hedge_delay_us));
+    }
+    worker.pending.schedule(query, deadline);
+};
 
-        memcpy(buffer + offset, &question.qtype, sizeof(question.qtype));
-        offset += sizeof(question.qtype);
+bool DNS::retransmit(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now)
+{
+    // A retry goes to the best upstream not tried yet, or to the first one again
+    Upstream *next = worker.upstreams.select(&query);
+    QueryTarget *target = next != nullptr ? worker.pending.add_target(query, next->address) : nullptr;
+    if (target == nullptr)
+        target = &query.targets[0];
+    if (!send_query(worker, query, *target, now))
+        return false;
+    query.attempts++;
+    schedule_query(worker, query, now);
+    return true;
+};
+
+void DNS::hedge(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now)
+{
+    query.hedged = true;
+    Upstream *second = worker.upstreams.select(&query);
+    QueryTarget *target = second != nullptr ? worker.pending.add_target(query, second->address) : nullptr;
+    if (target == nullptr)
+        return;
+    target->hedge = true;
+    if (send_query(worker, query, *target, now))
+        second->hedges++;
+};
+
+void DNS::report_upstream(Worker &worker, const Upstream &upstream, const char *event)
+{
+    cerr << "worker " << worker.id << ": upstream " << format_address(upstream.address) << " " << event << endl;
+};
+
+void DNS::handle_upstream(Worker &worker)
+{
+    uint8_t *buffer = reinterpret_cast<uint8_t *>(worker.recv_buffer);
+    sockaddr_in from;
+    socklen_t fromLen;
+    int bytesRead;
 
-        memcpy(buffer + offset, &question.qclass, sizeof(question.qclass));
-        offset += sizeof(question.qclass);
+    // Drain everything the upstream socket has for us
+    while (true)
+    {
+        fromLen = sizeof(from);
+        bytesRead = recvfrom(worker.upstream_fd, buffer, sizeof(worker.recv_buffer), MSG_DONTWAIT, reinterpret_cast<struct sockaddr *>(&from), &fromLen);
+        if (bytesRead == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Error receiving data");
+            return;
+        }
+        handle_upstream_reply(worker, buffer, bytesRead, from, false);
     }
 };
-void DNS::serialize_answer(const DNSMessage &message, char *&buffer, size_t &offset)
+
+void DNS::handle_upstream_reply(Worker &worker, const uint8_t *buffer, size_t length, const sockaddr_in &from, bool over_tcp)
 {
-    for (auto answer : message.answers)
+    if (length < sizeof(DNSHeader))
+        return;
+    auto now = PendingTable::clock::now();
+
+    // Only a reply from the address and port the query went to, carrying
+    // the ID we picked, is accepted. Anything else is late or spoofed.
+    uint16_t id = read16(buffer);
+    PendingQuery *query = worker.pending.find(id, from);
+    if (query == nullptr)
+        return;
+
+    MessageView &response = worker.response;
+    if (!response.parse(buffer, length))
+        return;
+    if (response.question_count() == 0 || !response.question(0).name.equals(query->asked().data()) ||
+        response.question(0).qtype != query->qtype || response.question(0).qclass != query->qclass)
+        return;
+
+    // Only a reply to a target that was sent to once has an unambiguous
+    // round trip time (Karn's algorithm), the others just count as signs
+    // of life. So does one over TCP, whose round trip includes the handshake.
+    QueryTarget *target = query->target(from);
+    Upstream *upstream = worker.upstreams.find(from);
+    if (upstream != nullptr)
     {
-        memcpy(buffer + offset, answer.name.data(), answer.name.size());
-        offset += answer.name.size();
+        uint32_t rtt_us = chrono::duration_cast<chrono::microseconds>(now - target->sent).count();
+        worker.metrics.observe(UPSTREAM_RTT, target->sent, now);
+        if (target->hedge)
+            upstream->hedge_wins++;
+        if (worker.upstreams.answered(*upstream, now, rtt_us, !over_tcp && target->sends == 1))
+            report_upstream(worker, *upstream, "is answering again");
+    }
 
-        memcpy(buffer + offset, &answer.type, sizeof(answer.type));
-        offset += sizeof(answer.type);
+    // An upstream that does not know EDNS answers FORMERR or NOTIMP without
+    // an OPT record of its own; it is asked again without ours (RFC 6891 7)
+    uint16_t rcode = response.header().flags & 0x000F;
+    if ((rcode == RCODE_FORMERR || rcode == RCODE_NOTIMP) && query->edns && !response.edns().present && !over_tcp)
+    {
+        query->edns = false;
+        query->packet.resize(query->packet.size() - opt_record_size);
+        write16(reinterpret_cast<uint8_t *>(query->packet.data()) + 10, 0);
+        send_query(worker, *query, *target, now);
+        return;
+    }
 
-        memcpy(buffer + offset, &answer.class_, sizeof(answer.class_));
-        offset += sizeof(answer.class_);
+    // A truncated answer is asked for again over TCP, where all of it fits.
+    // If that cannot be tried, or fails, the part that came is better than nothing.
+    if ((response.header().flags & 0x0200) && !over_tcp &&
+        (query->tcp || retry_over_tcp(worker, *query, from, buffer, length)))
+        return;
+    accept_reply(worker, *query, response, rcode);
+};
 
-        memcpy(buffer + offset, &answer.ttl, sizeof(answer.ttl));
-        offset += sizeof(answer.ttl);
+void DNS::accept_reply(Worker &worker, PendingQuery &query, const MessageView &response, uint16_t rcode)
+{
+    if (query.iterative)
+    {
+        handle_step_reply(worker, query, response, rcode, PendingTable::clock::now());
+        return;
+    }
 
-        memcpy(buffer + offset, &answer.rdlength, sizeof(answer.rdlength));
-        offset += sizeof(answer.rdlength);
+    // Every section is passed on: NXDOMAIN and friends with their SOA,
+    // CNAME chains, referrals and glue alike
+    RecordSet &answers = worker.answers;
+    answers.clear();
+    copy_records(response, answers);
+
+    // Remember what the upstream told us for as long as its TTL allows,
+    // even if every client waiting for it has had its reply already.
+    // Only complete answers are kept: positive ones, and negative ones
+    // that carry an SOA to say for how long (the cache checks).
+    bool truncated = (response.header().flags & 0x0200) || response.records_truncated();
+    if ((rcode == 0 || rcode == RCODE_NXDOMAIN) && !truncated)
+        worker.cache.insert(CacheKey(query.qname.data(), query.qtype, query.qclass), answers, rcode);
+
+    finish_query(worker, query, answers, rcode);
+};
 
-        memcpy(buffer + offset, &answer.rdata, sizeof(answer.rdata));
-        offset += sizeof(answer.rdata);
+bool DNS::retry_over_tcp(Worker &worker, PendingQuery &query, const sockaddr_in &upstream, const uint8_t *reply, size_t length)
+{
+    // The connection is opened without waiting; the query goes out once it is up
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&upstream), sizeof(upstream)) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return false;
     }
+
+    // It lives no longer than a client would wait for the answer
+    uint64_t handle = add_connection(worker, fd, upstream, true, identity.deadline_ms);
+    TcpConnection &connection = *worker.connections.get(handle);
+    connection.queue(reinterpret_cast<const uint8_t *>(query.packet.data()), query.packet.size());
+    connection.query = query.handle;
+    query.tcp = handle;
+    query.truncated.assign(reply, reply + length);
+    worker.metrics.add(UPSTREAM_TCP_RETRIES);
+    return true;
 };
 
-void DNS::deserialize_message(DNSMessage &message, char *buffer, size_t length, bool includeQuestion, bool includeAnswer)
+void DNS::finish_question(Worker &worker, uint64_t client_id, size_t question_index, const RecordSet &answers, uint16_t rcode)
 {
-    char *current = buffer;
-    deserialize_header(message, buffer, current, length);
-    if (includeQuestion)
-        deserialize_question(message, buffer, current, length);
-    if (includeAnswer)
-        deserialize_answer(message, buffer, current, length);
+    // The client may have been answered without this question at its deadline
+    PendingClient *client = worker.clients.get(client_id);
+    if (client == nullptr)
+        return;
+
+    client->answers[question_index] = answers;
+    if (client->rcode == 0)
+        client->rcode = rcode;
+    if (--client->outstanding == 0)
+        complete(worker, client_id);
 };
 
-void DNS::deserialize_header(DNSMessage &message, char *&buffer, char *&current, size_t length)
+void DNS::finish_query(Worker &worker, PendingQuery &query, const RecordSet &answers, uint16_t rcode)
 {
-    // temporary variables used to copy
-    uint16_t tmp16;
-    uint32_t tmp32;
+    // A name server's address, looked up along the way, goes back to the resolution that needs it
+    if (query.parent != 0)
+    {
+        sockaddr_in addresses[max_zone_servers];
+        size_t count = 0;
+        for (auto &record : answers.records)
+        {
+            if (record.section != ANSWER_SECTION || record.type != TYPE_A || record.rdlength != 4 || count == max_zone_servers)
+                continue;
+            addresses[count] = {};
+            addresses[count].sin_family = AF_INET;
+            memcpy(&addresses[count].sin_addr, answers.rdata(record), 4);
+            count++;
+        }
+        uint64_t parent = query.parent, lookup = query.handle;
+        WireName server = query.qname;
+        worker.pending.erase(query);
+        resume_step(worker, parent, lookup, server, addresses, count);
+        return;
+    }
 
-    // Extract the header section
-    // Extract the id
-    memcpy(&tmp16, current, sizeof(uint16_t));
-    message.header.id = ntohs(tmp16);
-    current += sizeof(uint16_t);
+    // The answer goes to the client that asked first and to every one that joined it since
+    uint64_t client_id = query.client;
+    size_t question_index = query.question;
+    uint64_t waiters = worker.pending.detach_waiters(query);
+    worker.pending.erase(query);
 
-    // Extract the QR, OPCODE, AA, TC, RD, RA, A and RCODE
-    memcpy(&tmp16, current, sizeof(uint16_t));
-    message.header.flags = ntohs(tmp16);
-    current += sizeof(uint16_t);
+    finish_question(worker, client_id, question_index, answers, rcode);
+    while (worker.pending.next_waiter(waiters, client_id, question_index))
+        finish_question(worker, client_id, question_index, answers, rcode);
+};
 
-    // Extract QDCOUNT
-    memcpy(&tmp16, current, sizeof(uint16_t));
-    message.header.qdcount = ntohs(tmp16);
-    current += sizeof(uint16_t);
+bool DNS::iterate_question(Worker &worker, uint64_t client_id, size_t question_index, const DNSQuestion &question,
+                           uint64_t question_key)
+{
+    PendingQuery &query = worker.pending.insert();
+    query.client = client_id;
+    query.question = question_index;
+    query.qname = question.qname;
+    query.qtype = question.qtype;
+    query.qclass = question.qclass;
+    query.timeout_ms = identity.timeout_ms;
+    auto now = PendingTable::clock::now();
+    query.give_up = now + chrono::milliseconds(identity.deadline_ms);
+    query.iterative = true;
+    query.step_name = question.qname;
+    query.chain.clear();
+    query.steps = 0;
+    query.depth = 0;
+
+    if (!start_step(worker, query, now))
+    {
+        worker.pending.erase(query);
+        return false;
+    }
+    worker.pending.track_question(query, question_key);
+    return true;
+};
 
-    // Extract ANCOUNT
-    memcpy(&tmp16, current, sizeof(uint16_t));
-    message.header.ancount = ntohs(tmp16);
-    current += sizeof(uint16_t);
+bool DNS::start_step(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now)
+{
+    // The closest zone cut we know of, or the root
+    static const vector<WireName> no_names;
+    static const uint8_t root = 0;
+    size_t zone_offset;
+    const Delegation *delegation = worker.delegations.closest(query.step_name.data(), now, zone_offset);
+    if (delegation == nullptr)
+        return ask_zone(worker, query, &root, worker.data->root_servers, no_names, now);
+    worker.metrics.add(DELEGATION_HITS);
+    return ask_zone(worker, query, query.step_name.data() + zone_offset, delegation->servers, delegation->unresolved, now);
+};
 
-    // Extract ARCOUNT
-    memcpy(&tmp16, current, sizeof(uint16_t));
-    message.header.arcount = ntohs(tmp16);
-    current += sizeof(uint16_t);
+bool DNS::ask_zone(Worker &worker, PendingQuery &query, const uint8_t *zone, const vector<sockaddr_in> &servers,
+                   const vector<WireName> &server_names, PendingTable::clock::time_point now)
+{
+    // zone may point into the query itself, or into the cut it is about to replace
+    WireName name;
+    name.assign(zone, name_length(zone));
+    query.zone = name;
+    query.servers.assign(servers.begin(), servers.end());
+    for (auto &server : query.servers)
+        server.sin_port = htons(identity.authority_port);
+    query.server_names.assign(server_names.begin(), server_names.end());
+    query.next_server = 0;
+    if (query.servers.empty())
+        return lookup_server(worker, query, now);
+    return send_step(worker, query, now);
+};
 
-    while (*current == 0)
-        current++; // perhaps there is a null terminator at the end of the header
+bool DNS::send_step(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now)
+{
+    // The servers take turns, and every round waits longer than the one before
+    const sockaddr_in &server = query.servers[query.next_server % query.servers.size()];
+    if (!worker.pending.retarget(query, server))
+        return false;
+    query.attempts = 1 + query.next_server / query.servers.size();
+    query.hedged = true; // hedge delays come from the resolver pool, not from name servers
+    query.edns = true;
+    query.tcp = 0;
+
+    // The servers are authoritative, not recursive: RD is left clear
+    uint8_t *buffer = reinterpret_cast<uint8_t *>(worker.send_buffer);
+    WireWriter writer(buffer, sizeof(worker.send_buffer));
+    writer.header(DNSHeader{query.id, 0, 1, 0, 0, 1});
+    writer.name(query.step_name.data());
+    writer.u16(query.qtype);
+    writer.u16(query.qclass);
+    writer.opt(identity.edns_size, 0, false);
+    query.packet.assign(buffer, buffer + writer.length());
+
+    if (!send_query(worker, query, query.targets[0], now))
+        return false;
+    worker.metrics.add(UPSTREAM_QUERIES);
+    schedule_query(worker, query, now);
+    return true;
 };
 
-void DNS::deserialize_question(DNSMessage &message, char *&buffer, char *&current, size_t length)
+bool DNS::retry_step(Worker &worker, PendingQuery &query, bool timed_out, PendingTable::clock::time_point now)
 {
-    // temporary variables used to copy
-    uint16_t tmp16;
-    uint32_t tmp32;
+    // A server that does not answer gets the question again once every
+    // other one has had it, --retries times; one that answers uselessly
+    // does not. When every server with an address has failed, the ones
+    // that came without glue are tried.
+    size_t limit = query.servers.size() * (timed_out ? identity.retries + 1 : 1);
+    if (query.next_server + 1 < limit)
+    {
+        query.next_server++;
+        return send_step(worker, query, now);
+    }
+    return lookup_server(worker, query, now);
+};
 
-    // Extract QNAME
-    for (int i = 0; i < message.header.qdcount; ++i)
+bool DNS::lookup_server(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now)
+{
+    // The address of one of the zone's name servers is resolved first, as
+    // a query of its own; the resolution goes on when it comes back
+    while (!query.server_names.empty() && query.depth < max_resolution_depth)
     {
-        DNSQuestion question;
-        while (*current != 0)
-        {
-            if ((*current & 0xC0) == 0xC0)
-            { // Check for compression
-                /*
-                (*current & 0x3F) << 8: This masks out the first two bits of the current byte
-                                        (which are not part of the offset) and shifts the remaining
-                                        6 bits to the left by 8 bits to make room for the next byte.
-
-                static_cast<uint8_t>(*(current + 1)): This adds the next byte to the offset.
-                                        The static_cast<uint8_t> ensures you're working with a
-                                        byte-sized integer.
-                 */
-                uint16_t offset = ((*current & 0x3F) << 8) | static_cast<uint8_t>(*(current + 1));
-                current = buffer + offset; // Jump to the offset in the buffer
-            }
-            else
-            {
-                uint8_t len = *current++;
-                question.qname.push_back('.');
-                while (len-- > 0)
-                {
-                    question.qname.push_back(*current++);
-                }
-            }
+        WireName server = query.server_names.back();
+        query.server_names.pop_back();
+
+        PendingQuery &lookup = worker.pending.insert();
+        lookup.client = 0;
+        lookup.question = 0;
+        lookup.qname = server;
+        lookup.qtype = TYPE_A;
+        lookup.qclass = CLASS_IN;
+        lookup.timeout_ms = identity.timeout_ms;
+        lookup.give_up = query.give_up;
+        lookup.iterative = true;
+        lookup.step_name = server;
+        lookup.chain.clear();
+        lookup.steps = 0;
+        lookup.depth = query.depth + 1;
+        lookup.parent = query.handle;
+        if (start_step(worker, lookup, now))
+        {
+            // A late reply to the step before must not move the query on meanwhile
+            query.lookup = lookup.handle;
+            worker.pending.park(query);
+            return true;
         }
-        current++; // Skip the null terminator
+        worker.pending.erase(lookup);
+    }
+    return false;
+};
 
-        // Extract TYPE
-        memcpy(&tmp16, current, sizeof(uint16_t));
-        question.qtype = ntohs(tmp16);
-        current += sizeof(uint16_t);
+void DNS::resume_step(Worker &worker, uint64_t handle, uint64_t lookup, const WireName &server, const sockaddr_in *addresses,
+                      size_t count)
+{
+    // Only a query still parked for this very lookup goes on
+    PendingQuery *query = worker.pending.get(handle);
+    if (query == nullptr || query->lookup != lookup)
+        return;
+    query->lookup = 0;
+
+    // The next resolution that needs the zone finds the address in its delegation
+    auto now = PendingTable::clock::now();
+    worker.delegations.resolved(query->zone.data(), server.data(), addresses, count);
+    query->servers.assign(addresses, addresses + count);
+    for (auto &address : query->servers)
+        address.sin_port = htons(identity.authority_port);
+    query->next_server = 0;
+    if (count > 0 ? send_step(worker, *query, now) : lookup_server(worker, *query, now))
+        return;
+    worker.answers.clear();
+    finish_query(worker, *query, worker.answers, RCODE_SERVFAIL);
+};
 
-        // Extract QCLASS
-        memcpy(&tmp16, current, sizeof(uint16_t));
-        question.qclass = ntohs(tmp16);
-        current += sizeof(uint16_t);
+void DNS::handle_step_reply(Worker &worker, PendingQuery &query, const MessageView &response, uint16_t rcode,
+                            PendingTable::clock::time_point now)
+{
+    RecordSet &answers = worker.answers;
+    answers.clear();
+    copy_records(response, answers);
+
+    WireName next;
+    bool authoritative = response.header().flags & 0x0400;
+    StepOutcome outcome = classify_response(answers, rcode, authoritative, query.step_name.data(), query.qtype,
+                                            query.zone.data(), next);
+    bool going_on = true;
+    switch (outcome)
+    {
+    case STEP_LAME:
+        going_on = retry_step(worker, query, false, now);
+        break;
 
-        message.questions.push_back(question);
+    case STEP_REFERRAL:
+    {
+        // One step down, and the cut is remembered for every name below it
+        worker.metrics.add(REFERRALS);
+        Delegation delegation;
+        uint32_t ttl = read_referral(answers, next.data(), query.zone.data(), delegation);
+        going_on = ++query.steps <= max_resolution_steps &&
+                   ask_zone(worker, query, next.data(), delegation.servers, delegation.unresolved, now);
+        worker.delegations.insert(next.data(), std::move(delegation), ttl, now);
+        break;
     }
-};
-void DNS::deserialize_answer(DNSMessage &message, char *&buffer, char *&current, size_t length)
-{
-    // temporary variables used to copy
-    uint16_t tmp16;
-    uint32_t tmp32;
-    const char *end = buffer + length;
 
-    if (current < end)
+    case STEP_CNAME:
+        // The alias goes in front of the answer, and its target is resolved from the closest cut we know
+        for (auto &record : answers.records)
+            if (record.section == ANSWER_SECTION)
+                query.chain.add(record.name, record.type, record.class_, record.ttl, ANSWER_SECTION,
+                                answers.rdata(record), record.rdlength);
+        query.step_name = next;
+        going_on = ++query.steps <= max_resolution_steps && start_step(worker, query, now);
+        break;
+
+    case STEP_ANSWER:
     {
-        DNSAnswer new_answer;
-        while (*current != 0)
+        if (!query.chain.empty())
         {
-            uint8_t len = *current++;
-            new_answer.name.push_back('.');
-            while (len-- > 0)
-            {
-                new_answer.name.push_back(*current++);
-            }
+            query.chain.append(answers);
+            answers.clear();
+            answers.append(query.chain);
         }
-        current++; // Skip the null terminator
-
-        // Extract TYPE
-        memcpy(&tmp16, current, sizeof(uint16_t));
-        new_answer.type = ntohs(tmp16);
-        current += sizeof(uint16_t);
+        bool truncated = (response.header().flags & 0x0200) || response.records_truncated();
+        if (!truncated)
+            worker.cache.insert(CacheKey(query.qname.data(), query.qtype, query.qclass), answers, rcode);
+        finish_query(worker, query, answers, rcode);
+        return;
+    }
+    }
 
-        // Extract CLASS
-        memcpy(&tmp16, current, sizeof(uint16_t));
-        new_answer.class_ = ntohs(tmp16);
-        current += sizeof(uint16_t);
+    if (going_on)
+        return;
+    answers.clear();
+    finish_query(worker, query, answers, RCODE_SERVFAIL);
+};
 
-        // Extract TTL (Time-to-live)
-        memcpy(&tmp32, current, sizeof(uint32_t));
-        new_answer.ttl = ntohl(tmp32);
-        current += sizeof(uint32_t);
+void DNS::handle_timeouts(Worker &worker)
+{
+    auto now = PendingTable::clock::now();
+    PendingQuery *query;
+    while ((query = worker.pending.next_expired(now)) != nullptr)
+    {
+        // Before the end of the round, it is the hedge timer that went off
+        if (now < query->retry_at)
+        {
+            hedge(worker, *query, now);
+            worker.pending.schedule(*query, query->retry_at);
+            continue;
+        }
 
-        // Extract RDLENGTH
-        memcpy(&tmp16, current, sizeof(uint16_t));
-        new_answer.rdlength = ntohs(tmp16);
-        current += sizeof(uint16_t);
+        // Every upstream asked in this round let it pass without an answer,
+        // for as long as it had: the last round may be cut short by the deadline
+        uint32_t timeout_us = (query->timeout_ms << (query->attempts - 1)) * 1000;
+        for (size_t i = 0; i < query->target_count; i++)
+        {
+            QueryTarget &target = query->targets[i];
+            Upstream *upstream = worker.upstreams.find(target.address);
+            if (target.timed_out || target.probe || upstream == nullptr)
+                continue;
+            target.timed_out = true;
+            uint32_t waited_us = min<int64_t>(timeout_us, chrono::duration_cast<chrono::microseconds>(now - target.sent).count());
+            if (worker.upstreams.timed_out(*upstream, now, waited_us))
+                report_upstream(worker, *upstream, "stopped answering, taken out of rotation");
+        }
 
-        // Extract RDATA
-        memcpy(&tmp32, current, sizeof(uint32_t));
-        new_answer.rdata = ntohl(tmp32);
-        current += sizeof(uint32_t);
+        if (now < query->give_up && (query->iterative ? retry_step(worker, *query, true, now)
+                                                      : query->attempts <= identity.retries && retransmit(worker, *query, now)))
+            continue;
 
-        message.answers.push_back(new_answer);
+        // Out of retries: the question is answered with SERVFAIL, for everyone waiting on it
+        worker.metrics.add(UPSTREAM_TIMEOUTS);
+        worker.answers.clear();
+        finish_query(worker, *query, worker.answers, RCODE_SERVFAIL);
     }
 };
 
-void DNS::construct_message(DNSMessage &message, DNSMessage &request, bool includeQuestion, bool includeAnswer)
+uint8_t *DNS::begin_reply(Worker &worker, const sockaddr_in &client, uint64_t connection, const EdnsInfo &edns, size_t &capacity)
 {
-    // Initialize message in struct format
-    vector<string> question_names;
-    // copy the question section
-    for (auto question : request.questions)
+    // Over TCP a reply may take up to 64K. It is written here, then queued on its connection.
+    if (connection != 0)
     {
-        string temp_qname = "";
-        for (size_t i = 1; i < question.qname.size(); i++)
-            temp_qname += question.qname[i];
-        question_names.push_back(temp_qname);
+        if (worker.connections.get(connection) == nullptr)
+            return nullptr; // the client hung up in the meantime
+        capacity = max_message_size;
+        return worker.tcp_reply;
     }
 
-    for (auto question_name : question_names)
+    // Over UDP, 512 octets unless the client offered more with EDNS, and never more than we offer
+    capacity = edns.present ? min<size_t>(edns.udp_size, identity.edns_size) : classic_udp_size;
+
+    // Replies are queued in the outbox and go out together on the next flush
+    char *buffer = worker.outbox.reserve(client);
+    if (buffer == nullptr)
     {
-        DNSQuestion new_question;
-        new_question.qname = encode_string(question_name);
-        new_question.qtype = htons(1);
-        new_question.qclass = htons(1);
-        message.questions.push_back(new_question);
+        flush_replies(worker);
+        buffer = worker.outbox.reserve(client);
     }
+    return reinterpret_cast<uint8_t *>(buffer);
+};
 
-    // copy the answer section
-    for (auto answer : request.answers)
+bool DNS::end_reply(Worker &worker, uint64_t connection, size_t length)
+{
+    // Over UDP the source address may be spoofed, and the reply has to be
+    // within its rate; over TCP it cannot be, and it goes out regardless
+    if (connection == 0)
     {
-        DNSAnswer new_answer;
-        new_answer.name = answer.name;
-        new_answer.type = htons(answer.type);
-        new_answer.class_ = htons(answer.class_);
-        new_answer.ttl = htonl(answer.ttl);
-        new_answer.rdlength = htons(4);
-        new_answer.rdata = htonl(answer.rdata);
+        uint8_t *reply = reinterpret_cast<uint8_t *>(worker.outbox.data(worker.outbox.size()));
+        bool limited = worker.limiter.limits_responses() && limit_reply(worker, reply, length);
+        if (length == 0)
+            return limited; // the slot is left as it is, for the next reply
+        worker.metrics.add(reply_counter(reply[3] & 0x0F));
+        worker.outbox.commit(length);
+        return limited;
+    }
+    worker.metrics.add(reply_counter(worker.tcp_reply[3] & 0x0F));
+    TcpConnection &tcp = *worker.connections.get(connection);
+    tcp.queue(worker.tcp_reply, length);
+    mark_active(worker, tcp, connection);
+    return false;
+};
 
-        message.answers.push_back(new_answer);
+bool DNS::limit_reply(Worker &worker, uint8_t *reply, size_t &length)
+{
+    static const uint8_t root = 0;
+    const uint8_t *qname = read16(reply + 4) > 0 ? reply + 12 : &root;
+    uint16_t qtype = read16(reply + 4) > 0 ? read16(reply + 12 + name_length(qname)) : 0;
+    const sockaddr_in &client = worker.outbox.address(worker.outbox.size());
+    RateVerdict verdict = worker.limiter.check_response(client.sin_addr.s_addr, qname, qtype, reply[3] & 0x0F, worker.now);
+    if (verdict == RATE_PASS)
+        return false;
+    if (verdict == RATE_DROP)
+    {
+        worker.metrics.add(RATE_LIMITED_DROPPED);
+        length = 0;
+        return true;
     }
 
-    // copy the header section
-    message.header.id = htons(request.header.id);
+    // Slipped: the question alone, with TC set and nothing a reflection could use
+    worker.metrics.add(RATE_LIMITED_SLIPPED);
+    reply[2] |= 0x02;
+    write16(reply + 6, 0);
+    write16(reply + 8, 0);
+    write16(reply + 10, 0);
+    length = read16(reply + 4) > 0 ? 12 + name_length(qname) + 4 : 12;
+    write16(reply + 4, read16(reply + 4) > 0 ? 1 : 0);
+    return true;
+};
+
+void DNS::send_reply(Worker &worker, PendingClient &client)
+{
+    size_t capacity;
+    uint8_t *buffer = begin_reply(worker, client.address, client.connection, client.edns, capacity);
+    if (buffer == nullptr)
+        return;
+    DNSMessage &request = client.request;
+
+#ifdef DEBUG
+    print_DNS_message(request, true, true);
+#endif
 
+    // Keep the opcode and RD, and set QR(1), AA(0), TC(0), RA(0), Z(0)
     uint16_t opcode = (request.header.flags & 0b0111100000000000) >> 11;
-    request.header.flags &= 0b0111100100000000;
-    request.header.flags |= 0b1000000000000000; // default flags: QR(1), AA(0), TC(0), RA(0), Z(0),
+    uint16_t flags = (request.header.flags & 0b0111100100000000) | 0b1000000000000000;
     if (opcode != 0)
+        flags |= 4; // NOTIMP, only standard queries are supported
+    flags |= client.rcode & 0x000F; // the upper bits of an extended RCODE go in the OPT record
+
+    // Encode the reply straight into the outbox slot; answers usually
+    // repeat the question name, and those become 2-byte pointers. Room
+    // for the OPT record is kept back until the records are in.
+    WireWriter writer(buffer, capacity - (client.edns.present ? opt_record_size : 0));
+    writer.header(DNSHeader{request.header.id, flags, uint16_t(request.questions.size()), 0, 0, 0});
+    for (auto &question : request.questions)
+    {
+        writer.name(question.qname.data());
+        writer.u16(question.qtype);
+        writer.u16(question.qclass);
+    }
+
+    // The records of all questions are gathered by section, in question order within each
+    uint8_t *header = buffer;
+    size_t records_start = writer.length();
+    if (!write_records(writer, request.answers))
+    {
+        // The answer itself does not fit: send the questions alone with TC
+        // set, and the client asks again over TCP
+        writer.rollback(records_start);
+        write16(header + 2, flags | 0x0200);
+        write16(header + 6, 0);
+        write16(header + 8, 0);
+        write16(header + 10, 0);
+        if (client.connection == 0)
+            worker.metrics.add(TRUNCATED_REPLIES);
+    }
+    if (client.edns.present)
+    {
+        writer.set_capacity(capacity);
+        writer.opt(identity.edns_size, client.rcode, client.edns.dnssec_ok);
+        write16(header + 10, read16(header + 10) + 1);
+    }
+
+    // Only the bytes actually written go on the wire. The log reads the
+    // reply where it was written, which stays put until the next one.
+    bool limited = end_reply(worker, client.connection, writer.length());
+    if (worker.log_ring != nullptr)
+        log_reply(worker, buffer, client.address, client.received,
+                  (client.cached ? QUERYLOG_CACHED : 0) | (client.connection != 0 ? QUERYLOG_TCP : 0) |
+                      (limited ? QUERYLOG_RATE_LIMITED : 0));
+};
+
+void DNS::log_reply(Worker &worker, const uint8_t *reply, const sockaddr_in &client, chrono::steady_clock::time_point received, uint8_t flags)
+{
+    // A full ring means the disk is behind: the record is dropped, the worker goes on
+    QueryLogRecord *record = worker.log_ring->claim();
+    if (record == nullptr)
+    {
+        worker.metrics.add(QUERYLOG_DROPPED);
+        return;
+    }
+
+    record->time_ns = query_log->wall_time_ns(received);
+    record->latency_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - received).count();
+    record->client_address = client.sin_addr.s_addr;
+    record->client_port = client.sin_port;
+    record->id = read16(reply);
+    record->rcode = reply[3] & 0x0F;
+    record->flags = flags | (reply[2] & 0x02 ? QUERYLOG_TRUNCATED : 0);
+
+    // The reply starts with the question as we wrote it, so its name is never compressed
+    record->qname_length = 0;
+    record->qtype = 0;
+    record->qclass = 0;
+    if (read16(reply + 4) > 0)
+    {
+        size_t length = name_length(reply + 12);
+        record->qtype = read16(reply + 12 + length);
+        record->qclass = read16(reply + 14 + length);
+        if (length > query_log_name_size)
+        {
+            // Cut after the last label that fits, so that what is kept is still a name
+            const uint8_t *name = reply + 12;
+            length = 0;
+            while (length + 1 + name[length] < query_log_name_size)
+                length += 1 + name[length];
+            record->flags |= QUERYLOG_NAME_CUT;
+        }
+        memcpy(record->qname, reply + 12, length);
+        if (record->flags & QUERYLOG_NAME_CUT)
+            record->qname[length++] = 0;
+        record->qname_length = length;
+    }
+    worker.log_ring->publish();
+};
+
+void DNS::flush_replies(Worker &worker)
+{
+    if (worker.outbox.size() == 0)
+        return;
+    auto start = WorkerMetrics::clock::now();
+    worker.outbox.flush(worker.fd, worker.batch_stats);
+    worker.metrics.observe(SEND_LATENCY, start, WorkerMetrics::clock::now());
+};
+
+void DNS::accept_connections(Worker &worker)
+{
+    while (true)
     {
-        request.header.flags |= 0b0000000000000100;
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int fd = accept4(worker.tcp_fd, reinterpret_cast<sockaddr *>(&address), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Failed to accept connection");
+            return;
+        }
+        if (worker.connections.size() >= max_tcp_connections)
+        {
+            close(fd);
+            worker.metrics.add(TCP_REFUSED);
+            continue;
+        }
+
+        // Replies are written whole, so there is nothing for Nagle to gather
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        add_connection(worker, fd, address, false, tcp_idle_timeout_ms);
+        worker.metrics.add(TCP_ACCEPTED);
+    }
+};
+
+uint64_t DNS::add_connection(Worker &worker, int fd, const sockaddr_in &address, bool upstream, int timeout_ms)
+{
+    uint64_t handle = worker.connections.acquire();
+    TcpConnection &connection = *worker.connections.get(handle);
+    connection.reset(fd, address, upstream);
+    connection.idle_deadline = TcpConnection::clock::now() + chrono::milliseconds(timeout_ms);
+    worker.connection_timers.push(connection.idle_deadline, handle);
+
+    // Ours wait to be connected before they write; a client's is read from right away.
+    // Connections are told apart from the worker's own sockets by their handle, which never fits in 32 bits.
+    connection.events = upstream ? EPOLLOUT : EPOLLIN;
+    epoll_event event = {};
+    event.events = connection.events;
+    event.data.u64 = handle;
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    return handle;
+};
+
+void DNS::handle_connection(Worker &worker, uint64_t handle, uint32_t events)
+{
+    TcpConnection *connection = worker.connections.get(handle);
+    if (connection == nullptr)
+        return;
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !connection->receive())
+        connection->eof = true;
+
+    // Nothing can be sent on a connection that has failed or was reset.
+    // An upstream may have got its answer in before that, though.
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        if (connection->upstream && connection->has_message())
+            service_connection(worker, handle);
+        close_connection(worker, handle);
+        return;
+    }
+    mark_active(worker, *connection, handle);
+};
+
+void DNS::mark_active(Worker &worker, TcpConnection &connection, uint64_t handle)
+{
+    if (connection.active)
+        return;
+    connection.active = true;
+    worker.active_connections.push_back(handle);
+};
+
+void DNS::service_connection(Worker &worker, uint64_t handle)
+{
+    TcpConnection *connection = worker.connections.get(handle);
+    if (connection == nullptr)
+        return;
+
+    size_t length;
+    const uint8_t *message;
+    if (connection->upstream)
+    {
+        // One question per connection: once it is answered, the connection has done its job
+        if ((message = connection->next_message(length)) != nullptr)
+        {
+            handle_upstream_reply(worker, message, length, connection->address, true);
+            close_connection(worker, handle);
+            return;
+        }
+    }
+    else
+    {
+        // Queries are taken in for as long as the client keeps up with the replies
+        worker.received_at = TcpConnection::clock::now();
+        while (!connection->paused() && (message = connection->next_message(length)) != nullptr)
+        {
+            MessageView &request = worker.request;
+            if (!request.parse(message, length))
+            {
+                worker.metrics.add(MALFORMED_QUERIES);
+                continue;
+            }
+            worker.metrics.add(QUERIES);
+            worker.metrics.add(TCP_QUERIES);
+            handle_client(worker, request, connection->address, handle);
+        }
+        connection->idle_deadline = TcpConnection::clock::now() + chrono::milliseconds(tcp_idle_timeout_ms);
+    }
+
+    // A client that has said all it will is closed once it has every reply
+    bool done = connection->upstream ? connection->eof
+                                     : connection->eof && connection->outstanding == 0 && !connection->has_message();
+    if (!connection->flush() || (done && connection->backlog() == 0))
+    {
+        close_connection(worker, handle);
+        return;
     }
 
-    message.header.flags = htons(request.header.flags);
-    message.header.qdcount = htons(question_names.size());
-    message.header.ancount = htons(question_names.size());
-    message.header.nscount = htons(0);
-    message.header.arcount = htons(0);
+    // Level-triggered: only ask for what can be acted on, or the loop would spin
+    uint32_t events = connection->backlog() > 0 ? uint32_t(EPOLLOUT) : uint32_t(0);
+    if (connection->upstream ? connection->backlog() == 0 : !connection->eof && !connection->paused())
+        events |= EPOLLIN;
+    if (events != connection->events)
+    {
+        epoll_event event = {};
+        event.events = events;
+        event.data.u64 = handle;
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = events;
+    }
+    connection->active = false;
 };
-void DNS::construct_header(DNSMessage &message, DNSMessage &request)
+
+void DNS::flush_connections(Worker &worker)
 {
-    message.header.id = htons(request.header.id);
-    message.header.flags = 0x0100;
-    message.header.qdcount = htons(1);
-    message.header.ancount = htons(0);
-    message.header.nscount = htons(0);
-    message.header.arcount = htons(0);
+    // Looking after one connection can make others active (or this one
+    // again), so the list may grow while it is walked
+    for (size_t i = 0; i < worker.active_connections.size(); i++)
+        service_connection(worker, worker.active_connections[i]);
+    worker.active_connections.clear();
 };
 
-void DNS::construct_question(DNSMessage &message, string question_name)
+void DNS::close_connection(Worker &worker, uint64_t handle)
 {
-    DNSQuestion new_question;
-    new_question.qname = encode_string(question_name);
-    new_question.qtype = htons(1);
-    new_question.qclass = htons(1);
-    message.questions.push_back(new_question);
+    // Clients still waiting on the upstream find the handle stale, and their replies are dropped
+    TcpConnection *connection = worker.connections.get(handle);
+    if (connection == nullptr)
+        return;
+    uint64_t query_handle = connection->upstream ? connection->query : 0;
+    close(connection->fd); // which also takes it out of the epoll set
+    worker.connections.release(handle);
+
+    // One of ours that failed, or closed without an answer, leaves the
+    // query with the truncated UDP answer it had, rather than a timeout
+    PendingQuery *query = query_handle != 0 ? worker.pending.get(query_handle) : nullptr;
+    if (query == nullptr || query->tcp != handle)
+        return;
+    query->tcp = 0;
+    MessageView &response = worker.response;
+    if (response.parse(query->truncated.data(), query->truncated.size()))
+        accept_reply(worker, *query, response, response.header().flags & 0x000F);
 };
 
-void DNS::construct_answer(DNSMessage &message, DNSMessage &response)
+void DNS::handle_idle_connections(Worker &worker)
 {
-    DNSAnswer new_answer;
+    auto now = TcpConnection::clock::now();
+    while (!worker.connection_timers.empty() && worker.connection_timers.top().deadline <= now)
+    {
+        uint64_t handle = worker.connection_timers.top().handle;
+        worker.connection_timers.pop();
+        TcpConnection *connection = worker.connections.get(handle);
+        if (connection == nullptr)
+            continue;
+
+        // Heard from since, or still waiting on the upstream: look again later
+        if (connection->idle_deadline > now || connection->outstanding > 0)
+        {
+            auto next = connection->idle_deadline > now ? connection->idle_deadline : now + chrono::milliseconds(tcp_idle_timeout_ms);
+            worker.connection_timers.push(next, handle);
+            continue;
+        }
+        close_connection(worker, handle);
+    }
+};
 
-    string qname = "";
-    for (size_t i = 0; i < response.answers[0].name.size(); i++)
-        qname += response.answers[0].name[i];
+vector<string> DNS::split(string raw_string, string delimeter)
+{
+    vector<string> res;
+    size_t start = 0, end = raw_string.find(delimeter);
+    while (end != string::npos)
+    {
+        if (raw_string.substr(start, end - start).size() > 0)
+            res.push_back(raw_string.substr(start, end - start));
+        start = end + 1;
+        end = raw_string.find(delimeter, start);
+    }
+    res.push_back(raw_string.substr(start));
+    return res;
+};
+
+string DNS::format_address(const sockaddr_in &address)
+{
+    char text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+    return string(text) + ":" + to_string(ntohs(address.sin_port));
+};
 
-    new_answer.name = encode_string(qname);
-    new_answer.type = response.answers[0].type;
-    new_answer.class_ = response.answers[0].class_;
-    new_answer.ttl = response.answers[0].ttl;
-    new_answer.rdlength = response.answers[0].rdlength;
-    new_answer.rdata = response.answers[0].rdata;
+size_t DNS::parse_size(string raw_string)
+{
+    // Accepts plain byte counts as well as K, M and G suffixes, e.g. 512M
+    size_t multiplier = 1;
+    if (!raw_string.empty())
+    {
+        switch (toupper(raw_string.back()))
+        {
+        case 'K':
+            multiplier = 1024;
+            break;
+        case 'M':
+            multiplier = 1024 * 1024;
+            break;
+        case 'G':
+            multiplier = 1024 * 1024 * 1024;
+            break;
+        }
+        if (multiplier != 1)
+            raw_string.pop_back();
+    }
+    return strtoull(raw_string.c_str(), nullptr, 10) * multiplier;
+};
 
-    message.answers.push_back(new_answer);
+void DNS::construct_default_answer(RecordSet &answers, const WireName &qname)
+{
+    // Without a resolver to forward to, every name resolves to 8.8.8.8
+    const uint8_t address[4] = {8, 8, 8, 8};
+    answers.add(qname, TYPE_A, CLASS_IN, 60, ANSWER_SECTION, address, sizeof(address));
 };
 
 void DNS::print_DNS_message(DNSMessage &message, bool includeQuestion, bool includeAnswer)
@@ -411,10 +1266,7 @@ void DNS::print_DNS_message(DNSMessage &message, bool includeQuestion, bool incl
         cout << "QUESTION SECTION: " << endl;
         for (auto question : message.questions)
         {
-            cout << "question.qname: ";
-            for (auto e : question.qname)
-                cout << e;
-            cout << endl;
+            cout << "question.qname: " << name_to_string(question.qname.data()) << endl;
             cout << "question.qtype: " << question.qtype << endl;
             cout << "question.qclass: " << question.qclass << endl
                  << endl;
@@ -423,30 +1275,32 @@ void DNS::print_DNS_message(DNSMessage &message, bool includeQuestion, bool incl
     if (includeAnswer && message.answers.size() > 0)
     {
         cout << "ANSWER SECTION: " << endl;
-        for (auto answer : message.answers)
+        for (auto &answer : message.answers.records)
         {
-            cout << "answer.name: " << endl;
-            for (auto e : answer.name)
-                cout << e;
-            cout << endl;
+            const uint8_t *rdata = message.answers.rdata(answer);
+            cout << "answer.section: " << int(answer.section) << endl;
+            cout << "answer.name: " << name_to_string(answer.name.data()) << endl;
             cout << "answer.type: " << answer.type << endl;
             cout << "answer.class_: " << answer.class_ << endl;
             cout << "answer.ttl: " << answer.ttl << endl;
             cout << "answer.rdlength: " << answer.rdlength << endl;
             cout << "answer.rdata: ";
-            // Extract individual bytes
-            uint8_t first = (answer.rdata >> 24) & 0xFF;
-            uint8_t second = (answer.rdata >> 16) & 0xFF;
-            uint8_t third = (answer.rdata >> 8) & 0xFF;
-            uint8_t fourth = answer.rdata & 0xFF;
 
-            // Print the IP address
-            printf("%d.%d.%d.%d\n", first, second, third, fourth);
+            RdataNames names;
+            if (answer.type == TYPE_A && answer.rdlength == 4)
+                printf("%d.%d.%d.%d\n", rdata[0], rdata[1], rdata[2], rdata[3]);
+            else if (rdata_names(answer.type, names))
+                cout << name_to_string(rdata + names.offset) << endl;
+            else
+            {
+                print_hex_form(reinterpret_cast<const char *>(rdata), answer.rdlength);
+                cout << endl;
+            }
         }
     }
 };
 
-void DNS::print_hex_form(char *buffer, size_t length)
+void DNS::print_hex_form(const char *buffer, size_t length)
 {
     for (size_t i = 0; i < length; i++)
         std::cout << std::hex << std::setfill('0') << std::setw(2) << (static_cast<unsigned>(buffer[i]) & 0xff) << " ";
@@ -466,6 +1320,68 @@ void DNS::print_binary_form(uint16_t flag)
     cout << endl;
 };
 
+void DNS::print_stats(Worker &worker)
+{
+    CacheStats stats = worker.cache.stats();
+    uint64_t lookups = stats.hits + stats.misses;
+    cout << "worker " << worker.id << " cache: hits " << stats.hits << ", misses " << stats.misses;
+    if (lookups > 0)
+        cout << " (" << fixed << setprecision(1) << 100.0 * stats.hits / lookups << "% hit rate)";
+    cout << ", entries " << stats.entries << ", bytes " << stats.bytes
+         << ", insertions " << stats.insertions << ", evictions " << stats.evictions
+         << ", expirations " << stats.expirations << ", negative hits " << stats.negative_hits
+         << ", stale hits " << stats.stale_hits << ", shared hits " << stats.shared_hits << ", snapshot hits " << stats.snapshot_hits << ", refreshes deferred " << stats.refreshes_deferred << endl;
+
+    // How well batching works: the average number of datagrams per syscall
+    // and the histogram of batch sizes (1, 2-3, 4-7, ...)
+    BatchStats &batch = worker.batch_stats;
+    cout << "worker " << worker.id << " batches: received " << batch.received << " in " << batch.recv_calls << " recvmmsg";
+    if (batch.recv_calls > 0)
+        cout << " (" << fixed << setprecision(1) << double(batch.received) / batch.recv_calls << " per call)";
+    cout << ", sent " << batch.sent << " in " << batch.send_calls << " sendmmsg";
+    if (batch.send_calls > 0)
+        cout << " (" << fixed << setprecision(1) << double(batch.sent) / batch.send_calls << " per call)";
+    cout << ", dropped " << batch.dropped << ", recv sizes";
+    for (int b = 0; b < batch_histogram_buckets; b++)
+        cout << " " << batch.recv_histogram[b];
+    cout << endl;
+
+#ifdef COUNT_ALLOCATIONS
+    // Steady-state heap traffic on the hot path; should settle at 0 once pools and caches are warm
+    uint64_t allocations = worker.allocations - worker.allocations_reported;
+    uint64_t packets = worker.metrics.get(QUERIES) - worker.packets_reported;
+    cout << "worker " << worker.id << " allocations: " << allocations << " for " << packets << " packets";
+    if (packets > 0)
+        cout << " (" << fixed << setprecision(2) << double(allocations) / packets << " per packet)";
+    cout << endl;
+    worker.allocations_reported = worker.allocations;
+    worker.packets_reported = worker.metrics.get(QUERIES);
+#endif
+
+    // Cache misses that joined a query already in flight instead of sending their own
+    uint64_t forwarded = worker.metrics.get(UPSTREAM_QUERIES), coalesced = worker.metrics.get(COALESCED_QUERIES);
+    cout << "worker " << worker.id << " upstream queries: sent " << forwarded << ", coalesced " << coalesced;
+    if (forwarded + coalesced > 0)
+        cout << " (" << fixed << setprecision(1) << 100.0 * coalesced / (forwarded + coalesced) << "% saved)";
+    cout << endl;
+
+    cout << "worker " << worker.id << " tcp: accepted " << worker.metrics.get(TCP_ACCEPTED) << ", refused " << worker.metrics.get(TCP_REFUSED)
+         << ", open " << worker.connections.size() << ", queries " << worker.metrics.get(TCP_QUERIES)
+         << "; udp replies truncated " << worker.metrics.get(TRUNCATED_REPLIES) << ", upstream retries over tcp "
+         << worker.metrics.get(UPSTREAM_TCP_RETRIES) << endl;
+
+    for (const Upstream &upstream : worker.upstreams.upstreams())
+    {
+        cout << "worker " << worker.id << " upstream " << format_address(upstream.address) << ": srtt "
+             << fixed << setprecision(1) << upstream.srtt_us / 1000.0 << " ms, rttvar " << upstream.rttvar_us / 1000.0 << " ms";
+        if (upstream.hedge_delay_us != 0)
+            cout << ", hedge after " << upstream.hedge_delay_us / 1000.0 << " ms";
+        cout << ", sent " << upstream.sent << ", answered " << upstream.answered << ", timeouts " << upstream.timeouts
+             << ", hedges " << upstream.hedges << " (" << upstream.hedge_wins << " won), probes " << upstream.probes
+             << (upstream.dead ? ", dead" : "") << endl;
+    }
+};
+
 DNS *DNS::getInstance()
 {
     if (instance == nullptr)
@@ -480,20 +1396,170 @@ int DNS::run(int argc, char **argv)
     cout << argc << endl;
     for (size_t i = 0; i < argc; i++)
     {
-        if (strncmp(argv[i], "--resolver", 11) == 0)
+        if (strncmp(argv[i], "--resolver", 11) == 0 && i + 1 < argc)
         {
-            identity.isResolver = true;
-            vector<string> res = split(argv[i + 1], ":");
-            identity.forward_address = string(res[0]);
-            identity.forward_port = atoi(res[1].c_str());
-            cout << "forward_address: " << identity.forward_address << endl;
-            cout << "forward_port: " << identity.forward_port << endl;
-
-            // Initialize resolver address
-            identity.forward_addr.sin_family = AF_INET;
-            identity.forward_addr.sin_port = htons(identity.forward_port);
-            inet_pton(AF_INET, identity.forward_address.c_str(), &identity.forward_addr.sin_addr);
-            identity.addr_len = sizeof(identity.forward_addr);
+            // Repeat --resolver, or list them as ip:port,ip:port, to forward to a pool
+            for (const string &resolver : split(argv[i + 1], ","))
+            {
+                vector<string> res = split(resolver, ":");
+                cout << "forward_address: " << res[0] << endl;
+                if (res.size() > 1)
+                    cout << "forward_port: " << res[1] << endl;
+                identity.sources.resolvers.push_back(resolver);
+            }
+        }
+        else if (strncmp(argv[i], "--root-hints", 13) == 0 && i + 1 < argc)
+        {
+            identity.sources.root_hints = argv[i + 1];
+            cout << "root_hints: " << identity.sources.root_hints << endl;
+        }
+        else if (strncmp(argv[i], "--authority-port", 17) == 0 && i + 1 < argc)
+        {
+            identity.authority_port = atoi(argv[i + 1]);
+            cout << "authority_port: " << identity.authority_port << endl;
+        }
+        else if (strncmp(argv[i], "--listen", 9) == 0 && i + 1 < argc)
+        {
+            // address, or address:port
+            vector<string> listen = split(argv[i + 1], ":");
+            identity.listen_address = listen[0];
+            if (listen.size() > 1)
+                identity.listen_port = atoi(listen[1].c_str());
+            cout << "listen: " << identity.listen_address << ":" << identity.listen_port << endl;
+        }
+        else if (strncmp(argv[i], "--cache-size", 13) == 0 && i + 1 < argc)
+        {
+            identity.cache_size = parse_size(argv[i + 1]);
+            cout << "cache_size: " << identity.cache_size << endl;
+        }
+        else if (strncmp(argv[i], "--serve-stale", 14) == 0 && i + 1 < argc)
+        {
+            identity.serve_stale = max(0, atoi(argv[i + 1]));
+            cout << "serve_stale: " << identity.serve_stale << endl;
+        }
+        else if (strncmp(argv[i], "--prefetch", 11) == 0 && i + 1 < argc)
+        {
+            identity.prefetch = min(max(0, atoi(argv[i + 1])), 100);
+            cout << "prefetch: " << identity.prefetch << endl;
+        }
+        else if (strncmp(argv[i], "--refresh-rate", 15) == 0 && i + 1 < argc)
+        {
+            identity.refresh_rate = max(0, atoi(argv[i + 1]));
+            cout << "refresh_rate: " << identity.refresh_rate << endl;
+        }
+        else if (strncmp(argv[i], "--shared-cache", 15) == 0 && i + 1 < argc)
+        {
+            identity.shared_cache_name = argv[i + 1];
+            cout << "shared_cache: " << identity.shared_cache_name << endl;
+        }
+        else if (strncmp(argv[i], "--shared-cache-size", 20) == 0 && i + 1 < argc)
+        {
+            identity.shared_cache_size = parse_size(argv[i + 1]);
+            cout << "shared_cache_size: " << identity.shared_cache_size << endl;
+        }
+        else if (strncmp(argv[i], "--cache-snapshot", 17) == 0 && i + 1 < argc)
+        {
+            identity.snapshot_path = argv[i + 1];
+            cout << "cache_snapshot: " << identity.snapshot_path << endl;
+        }
+        else if (strncmp(argv[i], "--snapshot-interval", 20) == 0 && i + 1 < argc)
+        {
+            identity.snapshot_interval = max(0, atoi(argv[i + 1]));
+            cout << "snapshot_interval: " << identity.snapshot_interval << endl;
+        }
+        else if (strncmp(argv[i], "--timeout", 10) == 0 && i + 1 < argc)
+        {
+            identity.timeout_ms = atoi(argv[i + 1]);
+            cout << "timeout_ms: " << identity.timeout_ms << endl;
+        }
+        else if (strncmp(argv[i], "--deadline", 11) == 0 && i + 1 < argc)
+        {
+            identity.deadline_ms = max(1, atoi(argv[i + 1]));
+            cout << "deadline_ms: " << identity.deadline_ms << endl;
+        }
+        else if (strncmp(argv[i], "--retries", 10) == 0 && i + 1 < argc)
+        {
+            identity.retries = atoi(argv[i + 1]);
+            cout << "retries: " << identity.retries << endl;
+        }
+        else if (strncmp(argv[i], "--workers", 10) == 0 && i + 1 < argc)
+        {
+            identity.workers = max(1, atoi(argv[i + 1]));
+            cout << "workers: " << identity.workers << endl;
+        }
+        else if (strncmp(argv[i], "--pin-cpus", 11) == 0)
+        {
+            identity.pin_cpus = true;
+        }
+        else if (strncmp(argv[i], "--batch", 8) == 0 && i + 1 < argc)
+        {
+            identity.batch_size = min(max(1, atoi(argv[i + 1])), max_batch_size);
+            cout << "batch_size: " << identity.batch_size << endl;
+        }
+        else if (strncmp(argv[i], "--hedge", 8) == 0 && i + 1 < argc)
+        {
+            identity.hedge_percentile = min(max(0, atoi(argv[i + 1])), 99);
+            cout << "hedge_percentile: " << identity.hedge_percentile << endl;
+        }
+        else if (strncmp(argv[i], "--edns-size", 12) == 0 && i + 1 < argc)
+        {
+            identity.edns_size = min(max(size_t(max(0, atoi(argv[i + 1]))), classic_udp_size), max_edns_size);
+            cout << "edns_size: " << identity.edns_size << endl;
+        }
+        else if (strncmp(argv[i], "--zone", 7) == 0 && i + 1 < argc)
+        {
+            identity.sources.zone_files.push_back(argv[i + 1]);
+            cout << "zone: " << argv[i + 1] << endl;
+        }
+        else if (strncmp(argv[i], "--zone-image", 13) == 0 && i + 1 < argc)
+        {
+            identity.sources.zone_image = argv[i + 1];
+            cout << "zone_image: " << identity.sources.zone_image << endl;
+        }
+        else if (strncmp(argv[i], "--config", 9) == 0 && i + 1 < argc)
+        {
+            identity.sources.config_path = argv[i + 1];
+            cout << "config: " << identity.sources.config_path << endl;
+        }
+        else if (strncmp(argv[i], "--control", 10) == 0 && i + 1 < argc)
+        {
+            identity.control_path = argv[i + 1];
+            cout << "control: " << identity.control_path << endl;
+        }
+        else if (strncmp(argv[i], "--query-log", 12) == 0 && i + 1 < argc)
+        {
+            identity.query_log_path = argv[i + 1];
+            cout << "query_log: " << identity.query_log_path << endl;
+        }
+        else if (strncmp(argv[i], "--query-log-size", 17) == 0 && i + 1 < argc)
+        {
+            identity.query_log_size = max(parse_size(argv[i + 1]), size_t(64 * 1024));
+            cout << "query_log_size: " << identity.query_log_size << endl;
+        }
+        else if (strncmp(argv[i], "--query-log-files", 18) == 0 && i + 1 < argc)
+        {
+            identity.query_log_files = max(1, atoi(argv[i + 1]));
+            cout << "query_log_files: " << identity.query_log_files << endl;
+        }
+        else if (strncmp(argv[i], "--rate-limit-queries", 21) == 0 && i + 1 < argc)
+        {
+            identity.rate_limit_queries = max(0, atoi(argv[i + 1]));
+            cout << "rate_limit_queries: " << identity.rate_limit_queries << endl;
+        }
+        else if (strncmp(argv[i], "--rate-limit-responses", 23) == 0 && i + 1 < argc)
+        {
+            identity.rate_limit_responses = max(0, atoi(argv[i + 1]));
+            cout << "rate_limit_responses: " << identity.rate_limit_responses << endl;
+        }
+        else if (strncmp(argv[i], "--rate-limit-slip", 18) == 0 && i + 1 < argc)
+        {
+            identity.rate_limit_slip = max(0, atoi(argv[i + 1]));
+            cout << "rate_limit_slip: " << identity.rate_limit_slip << endl;
+        }
+        else if (strncmp(argv[i], "--metrics-port", 15) == 0 && i + 1 < argc)
+        {
+            identity.metrics_port = atoi(argv[i + 1]);
+            cout << "metrics_port: " << identity.metrics_port << endl;
         }
     }
 
@@ -503,64 +1569,562 @@ int DNS::run(int argc, char **argv)
     // You can use print statements as follows for debugging, they'll be visible when running tests.
     cout << "Logs from your program will appear here!" << endl;
 
-    //   Uncomment this block to pass the first stage
-    struct sockaddr_in clientAddress;
+    auto initial = make_unique<Dataset>();
+    if (!load_dataset(identity.sources, *initial))
+        return 1;
+    initial->generation = 1;
+    dataset.publish(std::move(initial));
+
+    // Signals are taken by this thread alone, through a signalfd. Blocking
+    // them before any worker starts makes every worker inherit the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signal_fd == -1 || (!identity.control_path.empty() && !setup_control()) || (identity.metrics_port != 0 && !setup_metrics()))
+        return 1;
+
+    // Workers hand their query log records to a thread of its own, which does the writing
+    if (!identity.query_log_path.empty())
+    {
+        query_log = make_unique<QueryLog>(identity.query_log_path, identity.query_log_size, identity.query_log_files);
+        if (!query_log->start(identity.workers))
+            return 1;
+    }
 
-    identity.fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (identity.fd == -1)
+    // The shared cache is one segment for every worker, and for every
+    // other process that names it too
+    if (!identity.shared_cache_name.empty())
+    {
+        shared_cache = make_unique<SharedCache>();
+        if (!shared_cache->open(identity.shared_cache_name, identity.shared_cache_size))
+            return 1;
+        cout << "shared cache: " << shared_cache->capacity() << " slots" << endl;
+    }
+
+    // The last run's snapshot, if it left one, is mapped and read from as it is asked for
+    if (!identity.snapshot_path.empty())
+    {
+        snapshot = make_unique<CacheSnapshot>();
+        if (snapshot->open(identity.snapshot_path))
+            cout << "cache snapshot: " << snapshot->entries() << " entries in " << identity.snapshot_path << endl;
+    }
+
+    for (int i = 0; i < identity.workers; i++)
+    {
+        workers.push_back(make_unique<Worker>());
+        Worker &worker = *workers.back();
+        worker.id = i;
+        worker.cache.resize(identity.cache_size / identity.workers); // the budget is for the whole process
+        worker.cache.set_stale_ttl(identity.serve_stale);
+        worker.cache.set_prefetch(identity.prefetch);
+        worker.cache.set_refresh_rate(identity.refresh_rate == 0 ? 0 : max<uint32_t>(1, identity.refresh_rate / identity.workers));
+        worker.cache.attach_shared(shared_cache.get());
+        worker.cache.attach_snapshot(snapshot.get());
+        worker.inbox.resize(identity.batch_size, identity.edns_size);
+        worker.outbox.resize(identity.batch_size, identity.edns_size);
+        worker.clients.reserve(identity.batch_size * 4);
+        worker.pending.reserve(identity.batch_size * 4);
+        worker.deadlines.reserve(identity.batch_size * 4);
+        worker.upstreams.set_hedge_percentile(identity.hedge_percentile);
+        if (query_log)
+            worker.log_ring = &query_log->ring(i);
+        // Clients are spread across workers, so the rates are too. The seed
+        // keeps anyone from choosing keys that land in the same buckets.
+        worker.limiter.configure((identity.rate_limit_queries + identity.workers - 1) / identity.workers,
+                                 (identity.rate_limit_responses + identity.workers - 1) / identity.workers,
+                                 identity.rate_limit_slip, (uint64_t(random_device()()) << 32) | random_device()());
+        dataset.add_reader(worker.rcu);
+        if (!setup_worker(worker))
+            return 1;
+    }
+    for (auto &worker : workers)
+        worker->thread_ = thread(&DNS::serve, this, ref(*worker));
+
+    // kill -USR1 <pid> makes every worker print its cache counters, and
+    // kill -HUP <pid> (or "reload" on the control socket) reloads zones and
+    // resolvers. poll() skips the sockets that were not asked for (fd -1).
+    // With a snapshot to keep, poll() also wakes up when the next one is due.
+    pollfd fds[3] = {{signal_fd, POLLIN, 0}, {control_fd, POLLIN, 0}, {metrics_fd, POLLIN, 0}};
+    int signal = 0;
+    bool snapshots = !identity.snapshot_path.empty() && identity.snapshot_interval > 0;
+    auto next_snapshot = chrono::steady_clock::now() + chrono::seconds(identity.snapshot_interval);
+    while (signal != SIGINT && signal != SIGTERM)
+    {
+        int timeout = -1;
+        if (snapshots)
+        {
+            auto now = chrono::steady_clock::now();
+            if (now >= next_snapshot)
+            {
+                save_snapshot(true);
+                next_snapshot = now + chrono::seconds(identity.snapshot_interval);
+            }
+            timeout = chrono::duration_cast<chrono::milliseconds>(next_snapshot - now).count() + 1;
+        }
+        if (poll(fds, 3, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed");
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            handle_control();
+        if (fds[2].revents & POLLIN)
+            handle_metrics();
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        signalfd_siginfo info;
+        if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+            continue;
+        signal = info.ssi_signo;
+        if (signal == SIGUSR1)
+            for (auto &worker : workers)
+            {
+                worker->stats_requested = true;
+                wake(*worker);
+            }
+        else if (signal == SIGHUP)
+            reload();
+    }
+
+    for (auto &worker : workers)
+    {
+        worker->running = false;
+        wake(*worker);
+    }
+    for (auto &worker : workers)
+    {
+        worker->thread_.join();
+        print_stats(*worker);
+        close(worker->wake_fd);
+        close(worker->epoll_fd);
+        close(worker->upstream_fd);
+        close(worker->tcp_fd);
+        close(worker->fd);
+    }
+    if (!identity.snapshot_path.empty())
+        save_snapshot(false);
+    if (query_log)
+        query_log->stop();
+    close(signal_fd);
+    if (metrics_fd != -1)
+        close(metrics_fd);
+    if (control_fd != -1)
+    {
+        close(control_fd);
+        unlink(identity.control_path.c_str());
+    }
+
+    return 0;
+};
+
+void DNS::save_snapshot(bool running)
+{
+    // Each cache belongs to its worker, so while they run, each one saves
+    // its own between two rounds of its loop and the main thread waits.
+    // Once they are stopped, the caches are read from here.
+    auto start = chrono::steady_clock::now();
+    for (auto &worker : workers)
+    {
+        worker->snapshot.clear();
+        if (running)
+        {
+            worker->snapshot_requested = true;
+            wake(*worker);
+        }
+        else
+            worker->cache.save(worker->snapshot);
+    }
+    vector<const vector<uint8_t> *> parts;
+    for (auto &worker : workers)
+    {
+        while (running && !worker->snapshot_ready.exchange(false, memory_order_acquire))
+            this_thread::sleep_for(chrono::milliseconds(1));
+        parts.push_back(&worker->snapshot);
+    }
+
+    if (write_snapshot(identity.snapshot_path, parts))
+    {
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        cout << "Saved the cache to " << identity.snapshot_path << " in " << elapsed << " ms" << endl;
+    }
+    for (auto &worker : workers)
+        vector<uint8_t>().swap(worker->snapshot);
+};
+
+bool DNS::reload()
+{
+    // Built here on the main thread while the workers go on serving the
+    // current dataset; they pick up the new one at their next loop iteration
+    auto start = chrono::steady_clock::now();
+    Dataset *current = dataset.get();
+    auto next = make_unique<Dataset>();
+    if (!load_dataset(identity.sources, *next))
+    {
+        cerr << "Reload failed, still serving generation " << current->generation << endl;
+        return false;
+    }
+    next->generation = current->generation + 1;
+    uint64_t generation = next->generation;
+
+    // The old dataset (and its zone mapping) goes once no worker can be looking at it
+    unique_ptr<Dataset> old = dataset.publish(std::move(next));
+    old.reset();
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "reloaded: generation " << generation << " in " << elapsed << " ms" << endl;
+    return true;
+};
+
+bool DNS::setup_control()
+{
+    // A unix socket for local administration: one command per connection
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (control_fd == -1 || identity.control_path.size() >= sizeof(address.sun_path))
+    {
+        cerr << "Control socket creation failed: " << strerror(errno) << endl;
+        return false;
+    }
+    strcpy(address.sun_path, identity.control_path.c_str());
+    unlink(address.sun_path);
+    if (bind(control_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(control_fd, 4) != 0)
+    {
+        cerr << "Control socket bind failed: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+};
+
+void DNS::handle_control()
+{
+    int fd = accept4(control_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+    timeval timeout = {1, 0}; // a client that says nothing must not hold up the main thread
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char buffer[256];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    string command = length > 0 ? string(buffer, length) : "";
+    command = command.substr(0, command.find_first_of("\r\n"));
+
+    ostringstream reply;
+    if (command == "reload")
+    {
+        if (reload())
+            reply << "ok generation " << dataset.get()->generation << "\n";
+        else
+            reply << "error reload failed, still serving generation " << dataset.get()->generation << "\n";
+    }
+    else if (command == "status")
+    {
+        Dataset *current = dataset.get();
+        reply << "generation " << current->generation << ", resolvers " << current->resolvers.size()
+              << ", root servers " << current->root_servers.size()
+              << ", zones " << current->zones.zone_count() << ", records " << current->zones.record_count() << "\n";
+    }
+    else if (command == "metrics")
+        reply << render_metrics();
+    else
+        reply << "error unknown command, try reload, status or metrics\n";
+
+    string text = reply.str();
+    if (write(fd, text.data(), text.size()) == -1)
+        perror("Failed to answer on the control socket");
+    close(fd);
+};
+
+bool DNS::setup_metrics()
+{
+    // Loopback only: the numbers are for a local scraper, not for the world
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(identity.metrics_port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (metrics_fd == -1 || setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(metrics_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(metrics_fd, 4) != 0)
+    {
+        cerr << "Metrics listener setup failed: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+};
+
+void DNS::handle_metrics()
+{
+    // Just enough HTTP for a Prometheus scrape: one GET per connection
+    int fd = accept4(metrics_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+    timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char buffer[1024];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    string request = length > 0 ? string(buffer, length) : "";
+    bool found = request.starts_with("GET /metrics ") || request.starts_with("GET / ");
+    string body = found ? render_metrics() : "not found, try /metrics\n";
+
+    ostringstream reply;
+    reply << "HTTP/1.1 " << (found ? "200 OK" : "404 Not Found") << "\r\n"
+          << "Content-Type: text/plain; version=0.0.4\r\n"
+          << "Content-Length: " << body.size() << "\r\n"
+          << "Connection: close\r\n\r\n"
+          << body;
+    string text = reply.str();
+    for (size_t sent = 0; sent < text.size();)
+    {
+        ssize_t n = write(fd, text.data() + sent, text.size() - sent);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    close(fd);
+};
+
+string DNS::render_metrics()
+{
+    // Added up here, on the main thread; the workers never wait for a scrape
+    MetricsSnapshot total;
+    for (auto &worker : workers)
+        worker->metrics.add_to(total);
+    if (query_log)
+    {
+        total.counters[QUERYLOG_WRITTEN] += query_log->written();
+        total.counters[QUERYLOG_DROPPED] += query_log->lost();
+    }
+    ostringstream out;
+    write_prometheus(out, total, workers.size());
+    return out.str();
+};
+
+bool DNS::setup_worker(Worker &worker)
+{
+    worker.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (worker.fd == -1)
     {
         cerr << "Socket creation failed: " << strerror(errno) << "..." << endl;
-        return 1;
+        return false;
     }
 
     // Since the tester restarts your program quite often, setting REUSE_PORT
-    // ensures that we don't run into 'Address already in use' errors
+    // ensures that we don't run into 'Address already in use' errors. It also
+    // lets every worker bind a socket of its own to the same port, and the
+    // kernel then spreads incoming clients across them.
     int reuse = 1;
-    if (setsockopt(identity.fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+    if (setsockopt(worker.fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
     {
         cerr << "SO_REUSEPORT failed: " << strerror(errno) << endl;
-        return 1;
+        return false;
     }
 
-    sockaddr_in serv_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(2053),
-        .sin_addr = {htonl(INADDR_ANY)},
-    };
+    sockaddr_in serv_addr = {};
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(identity.listen_port);
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (!identity.listen_address.empty() && inet_pton(AF_INET, identity.listen_address.c_str(), &serv_addr.sin_addr) != 1)
+    {
+        cerr << "Invalid listen address " << identity.listen_address << endl;
+        return false;
+    }
 
-    if (bind(identity.fd, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) != 0)
+    if (bind(worker.fd, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) != 0)
     {
         cerr << "Bind failed: " << strerror(errno) << endl;
-        return 1;
+        return false;
     }
 
-    int bytesRead;
-    char buffer[2048];
-    socklen_t clientAddrLen = sizeof(clientAddress);
+    // Clients whose reply was truncated ask again over TCP, on the same port
+    worker.tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (worker.tcp_fd == -1 || setsockopt(worker.tcp_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0 ||
+        bind(worker.tcp_fd, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) != 0 || listen(worker.tcp_fd, SOMAXCONN) != 0)
+    {
+        cerr << "TCP listener setup failed: " << strerror(errno) << endl;
+        return false;
+    }
 
-    while (true)
+    // Bursts are read a batch at a time, so give the kernel room to queue
+    // them meanwhile. Best effort: the kernel caps this at net.core.rmem_max.
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(worker.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // Replies from the resolver come back on a socket of their own, so they
+    // can never be mistaken for client queries and vice versa
+    worker.upstream_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (worker.upstream_fd == -1)
     {
-        // Receive data
-        bytesRead = recvfrom(identity.fd, buffer, sizeof(buffer), 0, reinterpret_cast<struct sockaddr *>(&clientAddress), &clientAddrLen);
-        if (bytesRead == -1)
+        cerr << "Upstream socket creation failed: " << strerror(errno) << endl;
+        return false;
+    }
+    fcntl(worker.fd, F_SETFL, fcntl(worker.fd, F_GETFL) | O_NONBLOCK);
+    fcntl(worker.upstream_fd, F_SETFL, fcntl(worker.upstream_fd, F_GETFL) | O_NONBLOCK);
+
+    worker.wake_fd = eventfd(0, EFD_NONBLOCK);
+    worker.epoll_fd = epoll_create1(0);
+    if (worker.wake_fd == -1 || worker.epoll_fd == -1)
+    {
+        cerr << "epoll setup failed: " << strerror(errno) << endl;
+        return false;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    for (int fd : {worker.fd, worker.upstream_fd, worker.wake_fd, worker.tcp_fd})
+    {
+        event.data.fd = fd;
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+    return true;
+};
+
+void DNS::wake(Worker &worker)
+{
+    uint64_t one = 1;
+    if (write(worker.wake_fd, &one, sizeof(one)) == -1)
+        perror("Failed to wake worker");
+};
+
+void DNS::pin_to_cpu(Worker &worker)
+{
+    // Worker i goes to the i-th CPU this process is allowed to run on
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    int count = CPU_COUNT(&allowed);
+    int target = worker.id % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed) || target-- > 0)
+            continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            cerr << "worker " << worker.id << ": failed to pin to CPU " << cpu << endl;
+        return;
+    }
+};
+
+void DNS::serve(Worker &worker)
+{
+    if (identity.pin_cpus)
+        pin_to_cpu(worker);
+
+    epoll_event events[16];
+    while (worker.running)
+    {
+        // Sleep until a socket is readable or the next upstream query times
+        // out. While asleep the worker holds no dataset, so it never delays a reload.
+        dataset.offline(worker.rcu);
+        int ready = epoll_wait(worker.epoll_fd, events, 16, next_timeout(worker));
+        worker.data = dataset.quiescent(worker.rcu);
+        worker.now = chrono::steady_clock::now();
+        worker.upstreams.sync(worker.data->resolvers, worker.data->generation);
+        if (ready == -1 && errno != EINTR)
         {
-            perror("Error receiving data");
+            perror("epoll_wait failed");
             break;
         }
-        buffer[bytesRead] = '\0';
-
-        DNSMessage request;
 
-        deserialize_message(request, buffer, bytesRead, true, false);
-        
-#ifdef DEBUG
-        print_DNS_message(request, true, false);
-#endif
+        for (int e = 0; e < ready; e++)
+        {
+            if (events[e].data.u64 > UINT32_MAX)
+                handle_connection(worker, events[e].data.u64, events[e].events);
+            else if (events[e].data.fd == worker.upstream_fd)
+                handle_upstream(worker);
+            else if (events[e].data.fd == worker.fd)
+                handle_requests(worker);
+            else if (events[e].data.fd == worker.tcp_fd)
+                accept_connections(worker);
+            else
+            {
+                uint64_t count;
+                if (read(worker.wake_fd, &count, sizeof(count)) == -1)
+                    perror("Failed to read wake event");
+            }
+        }
 
-        handle_client(request, clientAddress);
+        handle_timeouts(worker);
+        handle_deadlines(worker);
+        handle_idle_connections(worker);
+        flush_connections(worker);
+        flush_replies(worker);
+        worker.allocations = thread_allocations();
+
+        // Gauges are only worth setting once per round
+        CacheStats cache = worker.cache.stats();
+        worker.metrics.set(CACHE_ENTRIES, cache.entries);
+        worker.metrics.set(CACHE_BYTES, cache.bytes);
+        worker.metrics.set(PENDING_CLIENTS, worker.clients.size());
+        worker.metrics.set(TCP_OPEN, worker.connections.size());
+
+        if (worker.stats_requested.exchange(false))
+            print_stats(worker);
+        if (worker.snapshot_requested.exchange(false))
+        {
+            worker.cache.save(worker.snapshot);
+            worker.snapshot_ready.store(true, memory_order_release);
+        }
     }
+};
 
-    close(identity.fd);
+void DNS::handle_requests(Worker &worker)
+{
+    // Receive data, up to a whole batch of datagrams per syscall, until the socket is drained
+    while (true)
+    {
+        auto start = WorkerMetrics::clock::now();
+        int received = worker.inbox.receive(worker.fd, worker.batch_stats);
+        if (received == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Error receiving data");
+            return;
+        }
+        worker.received_at = WorkerMetrics::clock::now();
+        worker.now = worker.received_at;
+        worker.metrics.observe(RECEIVE_LATENCY, start, worker.received_at);
 
-    return 0;
-};
\ No newline at end of file
+        for (int i = 0; i < received; i++)
+        {
+            // The view points straight into the inbox slot, nothing is copied.
+            // Every so often a query is timed on its way through.
+            MessageView &request = worker.request;
+            if (worker.limiter.enabled() && !worker.limiter.allow_query(worker.inbox.address(i).sin_addr.s_addr, worker.received_at))
+            {
+                worker.metrics.add(RATE_LIMITED_QUERIES);
+                continue;
+            }
+            worker.timing = worker.metrics.get(QUERIES) % latency_sample_interval == 0;
+            auto parse_start = worker.timing ? WorkerMetrics::clock::now() : WorkerMetrics::clock::time_point();
+            if (!request.parse(reinterpret_cast<uint8_t *>(worker.inbox.data(i)), worker.inbox.length(i)))
+            {
+                worker.metrics.add(MALFORMED_QUERIES);
+                continue;
+            }
+            if (worker.timing)
+                worker.metrics.observe(PARSE_LATENCY, parse_start, WorkerMetrics::clock::now());
+
+            worker.metrics.add(QUERIES);
+            handle_client(worker, request, worker.inbox.address(i), 0);
+        }
+        worker.timing = false;
+
+        // Answer the whole batch with a single sendmmsg
+        flush_replies(worker);
+
+        if (received < static_cast<int>(worker.inbox.capacity()))
+            return;
+    }
+};
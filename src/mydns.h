@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <cstring>
 #include <sys/socket.h>
@@ -6,71 +8,124 @@
 #include <unistd.h>
 #include <iomanip>
 #include <vector>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
 
 #include <sstream>
 
-using namespace std;
-
-const int BUF_SIZE = 2048;
-const int default_port = 2053;
-const char default_addr[] = "127.0.0.1";
-
-struct DNSHeader
-{
-    uint16_t id;
-    uint16_t flags;
-    uint16_t qdcount;
-    uint16_t ancount;
-    uint16_t nscount;
-    uint16_t arcount;
-};
-
-struct DNSQuestion
-{
-    vector<uint8_t> qname;
-    uint16_t qtype;
-    uint16_t qclass;
-};
+#include "message.h"
+#include "cache.h"
+#include "upstream.h"
+#include "upstream_pool.h"
+#include "batch.h"
+#include "wire.h"
+#include "pool.h"
+#include "alloc_counter.h"
+#include "zone.h"
+#include "dataset.h"
+#include "rcu.h"
+#include "tcp.h"
+#include "metrics.h"
+#include "querylog.h"
+#include "ratelimit.h"
+#include "recursion.h"
+#include "shared_cache.h"
+#include "snapshot.h"
 
-struct DNSAnswer
-{
-    vector<uint8_t> name; // an owner name, i.e., the name of the node to which this resource record pertains.
-    uint16_t type;        // two octets containing one of the RR TYPE codes.
-    uint16_t class_;      // two octets containing one of the RR CLASS codes.
-    uint32_t ttl;         /*
-                        a 32 bit signed integer that specifies the time interval
-                        that the resource record may be cached before the source
-                        of the information should again be consulted.  Zero
-                        values are interpreted to mean that the RR can only be
-                        used for the transaction in progress, and should not be
-                        cached.  For example, SOA records are always distributed
-                        with a zero TTL to prohibit caching.  Zero values can
-                        also be used for extremely volatile data.
-                        */
-
-    uint16_t rdlength; // an unsigned 16 bit integer that specifies the length in octets of the RDATA field
-    uint32_t rdata;    /*
-                   a variable length string of octets that describes the
-                   resource.  The format of this information varies
-                   according to the TYPE and CLASS of the resource record.
-                   */
-};
+using namespace std;
 
-struct DNSMessage
+struct Identity
 {
-    DNSHeader header;
-    vector<DNSQuestion> questions;
-    vector<DNSAnswer> answers;
+    int timeout_ms = default_timeout_ms;
+    int retries = default_retries;
+    int deadline_ms = default_deadline_ms;
+    size_t cache_size = default_cache_size;
+    uint32_t serve_stale = 0; // --serve-stale, seconds past expiry an answer may still be served; 0 for never
+    uint32_t prefetch = 0;    // --prefetch, percent of the TTL left when popular answers are refreshed; 0 for never
+    uint32_t refresh_rate = default_refresh_rate; // --refresh-rate, background refreshes per second, 0 for no limit
+    string shared_cache_name; // --shared-cache, the shared memory segment under every worker's cache; empty for none
+    size_t shared_cache_size = default_shared_cache_size;
+    string snapshot_path; // --cache-snapshot, where the caches are saved and read back on startup; empty for none
+    int snapshot_interval = default_snapshot_interval; // --snapshot-interval, seconds; 0 saves at shutdown only
+    int workers = 1;
+    bool pin_cpus = false;
+    int batch_size = default_batch_size;
+    string listen_address; // --listen, empty for every address
+    int listen_port = default_port;
+    int authority_port = default_authority_port; // --authority-port, where name servers are asked when resolving from the root
+    int hedge_percentile = 0; // --hedge, 0 sends every query to a single upstream at a time
+    size_t edns_size = default_edns_size; // --edns-size, the UDP payload we offer clients and upstreams
+    DatasetSource sources; // resolvers and zones, read again on every reload
+    string control_path;   // --control, a unix socket taking "reload", "status" and "metrics"
+    int metrics_port = 0;  // --metrics-port, serves /metrics over HTTP on 127.0.0.1; 0 for none
+    string query_log_path; // --query-log, empty for none
+    size_t query_log_size = default_query_log_size;
+    int query_log_files = default_query_log_files;
+    uint32_t rate_limit_queries = 0;   // --rate-limit-queries, per second per client /24, 0 for none
+    uint32_t rate_limit_responses = 0; // --rate-limit-responses, the same reply per second per client /24
+    int rate_limit_slip = default_rate_limit_slip;
 };
 
-struct Identity
+/*
+    Everything one serving thread owns. Each worker has its own
+    SO_REUSEPORT sockets on the server port, UDP and TCP, so the kernel
+    spreads clients across workers, and nothing in here is ever touched
+    by another thread.
+*/
+struct Worker
 {
-    bool isResolver = false;
-    struct sockaddr_in forward_addr;
-    string forward_address;
-    int forward_port;
-    socklen_t addr_len;
-    int fd;
+    int id;
+    int fd = -1;          // client-facing socket
+    int tcp_fd = -1;      // client-facing TCP listener, on the same port
+    int upstream_fd = -1; // queries to the resolver go out and come back on this one
+    int epoll_fd = -1;
+    int wake_fd = -1; // eventfd the main thread pokes to get the worker's attention
+    AnswerCache cache;
+    PendingTable pending;
+    UpstreamPool upstreams;
+    DelegationCache delegations; // zone cuts learned resolving from the root
+    DeadlineHeap deadlines; // of pending clients
+    Pool<PendingClient> clients;
+    Pool<TcpConnection> connections;
+    DeadlineHeap connection_timers; // idle timeouts, one entry per connection
+    vector<uint64_t> active_connections; // with replies to flush or queries to take in, this round
+    char recv_buffer[max_edns_size];
+    char send_buffer[max_edns_size];
+    uint8_t tcp_reply[max_message_size]; // a reply over TCP is written here, then queued on its connection
+    MessageView request;  // parsed in place, reused for every packet
+    MessageView response;
+    RecordSet answers; // an upstream answer, before it is copied to each client waiting for it
+    DatagramBatch inbox;  // client queries, read with one recvmmsg
+    DatagramBatch outbox; // client replies, written with one sendmmsg
+    BatchStats batch_stats;
+    WorkerMetrics metrics; // read by the main thread when scraped
+    bool timing = false;   // the query at hand is one of the sampled ones, see latency_sample_interval
+    QueryLogRing *log_ring = nullptr; // nullptr unless --query-log
+    chrono::steady_clock::time_point received_at; // when the queries at hand came in
+    chrono::steady_clock::time_point now; // a coarse clock: the top of this loop iteration, or the last batch received
+    RateLimiter limiter;
+    uint64_t allocations = 0; // heap allocations made by the worker thread, see alloc_counter.h
+    uint64_t packets_reported = 0; // queries and allocations as of the last stats report
+    uint64_t allocations_reported = 0;
+    RcuReader rcu;
+    const Dataset *data = nullptr; // zones and resolvers, as of the top of this loop iteration
+
+    atomic<bool> running{true};
+    atomic<bool> stats_requested{false};
+    atomic<bool> snapshot_requested{false};
+    atomic<bool> snapshot_ready{false};
+    vector<uint8_t> snapshot; // the cache's entries, saved by the worker for the main thread to write out
+    thread thread_;
 };
 
 class DNS
@@ -78,30 +133,85 @@ class DNS
 
     struct myaddr;
     Identity identity;
-
-    void handle_client(DNSMessage &request, sockaddr_in &clientAddress);
+    vector<unique_ptr<Worker>> workers;
+    RcuPointer<Dataset> dataset; // swapped on reload, read by every worker without locks
+    int control_fd = -1;
+    int metrics_fd = -1;
+    unique_ptr<QueryLog> query_log;
+    unique_ptr<SharedCache> shared_cache;
+    unique_ptr<CacheSnapshot> snapshot; // the one the server started from
+
+    bool setup_worker(Worker &worker);
+    void serve(Worker &worker);
+    void wake(Worker &worker);
+    void pin_to_cpu(Worker &worker);
+
+    void handle_client(Worker &worker, const MessageView &request, const sockaddr_in &clientAddress, uint64_t connection);
+    bool answer_from_zones(Worker &worker, const MessageView &request, const sockaddr_in &clientAddress, uint64_t connection);
+    void resolve(Worker &worker, uint64_t client_id);
+    bool forward_question(Worker &worker, uint64_t client_id, size_t question_index, const DNSQuestion &question,
+                          uint64_t question_key);
+    void finish_question(Worker &worker, uint64_t client_id, size_t question_index, const RecordSet &answers, uint16_t rcode);
+    void finish_query(Worker &worker, PendingQuery &query, const RecordSet &answers, uint16_t rcode);
+    bool iterate_question(Worker &worker, uint64_t client_id, size_t question_index, const DNSQuestion &question,
+                          uint64_t question_key);
+    bool start_step(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now);
+    bool ask_zone(Worker &worker, PendingQuery &query, const uint8_t *zone, const vector<sockaddr_in> &servers,
+                  const vector<WireName> &server_names, PendingTable::clock::time_point now);
+    bool send_step(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now);
+    bool retry_step(Worker &worker, PendingQuery &query, bool timed_out, PendingTable::clock::time_point now);
+    bool lookup_server(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now);
+    void resume_step(Worker &worker, uint64_t handle, uint64_t lookup, const WireName &server, const sockaddr_in *addresses,
+                     size_t count);
+    void handle_step_reply(Worker &worker, PendingQuery &query, const MessageView &response, uint16_t rcode,
+                           PendingTable::clock::time_point now);
+    void complete(Worker &worker, uint64_t client_id);
+    void handle_deadlines(Worker &worker);
+    int next_timeout(Worker &worker);
+    bool send_query(Worker &worker, PendingQuery &query, QueryTarget &target, PendingTable::clock::time_point now);
+    void schedule_query(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now);
+    bool retransmit(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now);
+    void hedge(Worker &worker, PendingQuery &query, PendingTable::clock::time_point now);
+    void report_upstream(Worker &worker, const Upstream &upstream, const char *event);
+    void handle_requests(Worker &worker);
+    void handle_upstream(Worker &worker);
+    void handle_upstream_reply(Worker &worker, const uint8_t *buffer, size_t length, const sockaddr_in &from, bool over_tcp);
+    bool retry_over_tcp(Worker &worker, PendingQuery &query, const sockaddr_in &upstream, const uint8_t *reply, size_t length);
+    void accept_reply(Worker &worker, PendingQuery &query, const MessageView &response, uint16_t rcode);
+    void handle_timeouts(Worker &worker);
+    uint8_t *begin_reply(Worker &worker, const sockaddr_in &client, uint64_t connection, const EdnsInfo &edns, size_t &capacity);
+    bool end_reply(Worker &worker, uint64_t connection, size_t length);
+    bool limit_reply(Worker &worker, uint8_t *reply, size_t &length);
+    void send_reply(Worker &worker, PendingClient &client);
+    void log_reply(Worker &worker, const uint8_t *reply, const sockaddr_in &client, chrono::steady_clock::time_point received, uint8_t flags);
+    void flush_replies(Worker &worker);
+
+    void accept_connections(Worker &worker);
+    uint64_t add_connection(Worker &worker, int fd, const sockaddr_in &address, bool upstream, int timeout_ms);
+    void handle_connection(Worker &worker, uint64_t handle, uint32_t events);
+    void service_connection(Worker &worker, uint64_t handle);
+    void flush_connections(Worker &worker);
+    void mark_active(Worker &worker, TcpConnection &connection, uint64_t handle);
+    void close_connection(Worker &worker, uint64_t handle);
+    void handle_idle_connections(Worker &worker);
 
     vector<string> split(string raw_string, string delimeter);
-    vector<uint8_t> encode_string(string raw_string);
-
-    void serialize_message(const DNSMessage &message, char *buffer, size_t &totalSize, bool includeQuestion, bool includeAnswer);
-    void serialize_header(const DNSMessage &message, char *&buffer, size_t &offset);
-    void serialize_question(const DNSMessage &message, char *&buffer, size_t &offset);
-    void serialize_answer(const DNSMessage &message, char *&buffer, size_t &offset);
-
-    void deserialize_message(DNSMessage &message, char *buffer, size_t length, bool includeQuestion, bool includeAnswer);
-    void deserialize_header(DNSMessage &message, char *&buffer, char *&current, size_t length);
-    void deserialize_question(DNSMessage &message, char *&buffer, char *&current, size_t length);
-    void deserialize_answer(DNSMessage &message, char *&buffer, char *&current, size_t length);
-
-    void construct_message(DNSMessage &message, DNSMessage &request, bool includeQuestion, bool includeAnswer);
-    void construct_header(DNSMessage &message, DNSMessage &request);
-    void construct_question(DNSMessage &message, string question_name);
-    void construct_answer(DNSMessage &message, DNSMessage &response);
+    size_t parse_size(string raw_string);
+    string format_address(const sockaddr_in &address);
+    bool reload();
+    void save_snapshot(bool running);
+    bool setup_control();
+    void handle_control();
+    bool setup_metrics();
+    void handle_metrics();
+    string render_metrics();
+
+    void construct_default_answer(RecordSet &answers, const WireName &qname);
 
     void print_DNS_message(DNSMessage &message, bool includeQuestion, bool includeAnswer);
-    void print_hex_form(char *buffer, size_t length);
+    void print_hex_form(const char *buffer, size_t length);
     void print_binary_form(uint16_t flag);
+    void print_stats(Worker &worker);
 
     DNS();
 
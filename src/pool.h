@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+/*
+    A free-list pool of T, owned by one worker. Objects are never destroyed
+    while the pool lives, so whatever they own (vectors and their capacity)
+    is reused by the next acquire: once the pool has grown to the worker's
+    high-water mark, acquire and release never touch the heap. A deque keeps
+    references stable while the pool grows.
+
+    Handles carry a generation next to the slot index. A handle to an object
+    that has been released (say, a client whose upstream reply comes in
+    after it was answered with SERVFAIL) is recognised as stale instead of
+    silently pointing at whoever reuses the slot. Handles are never 0.
+*/
+template <typename T>
+class Pool
+{
+    struct Slot
+    {
+        T object;
+        uint32_t generation = 1;
+        bool used = false;
+    };
+
+    deque<Slot> slots;
+    vector<uint32_t> free_slots;
+    size_t in_use = 0;
+
+public:
+    void reserve(size_t count)
+    {
+        while (slots.size() < count)
+        {
+            free_slots.push_back(slots.size());
+            slots.emplace_back();
+        }
+    }
+
+    // The object comes back as its last user left it; resetting it is up to the caller
+    uint64_t acquire()
+    {
+        if (free_slots.empty())
+        {
+            free_slots.push_back(slots.size());
+            slots.emplace_back();
+        }
+        uint32_t index = free_slots.back();
+        free_slots.pop_back();
+        slots[index].used = true;
+        in_use++;
+        return (static_cast<uint64_t>(slots[index].generation) << 32) | index;
+    }
+
+    T *get(uint64_t handle)
+    {
+        uint32_t index = handle & 0xFFFFFFFF;
+        if (index >= slots.size())
+            return nullptr;
+        Slot &slot = slots[index];
+        if (!slot.used || slot.generation != handle >> 32)
+            return nullptr;
+        return &slot.object;
+    }
+
+    void release(uint64_t handle)
+    {
+        uint32_t index = handle & 0xFFFFFFFF;
+        if (get(handle) == nullptr)
+            return;
+        slots[index].used = false;
+        if (++slots[index].generation == 0)
+            slots[index].generation = 1;
+        free_slots.push_back(index);
+        in_use--;
+    }
+
+    size_t size() const { return in_use; }
+    size_t capacity() const { return slots.size(); }
+};
+
+/*
+    An open-addressing hash map from 64-bit keys to pool handles, with
+    linear probing and backward-shift deletion (so there are no tombstones
+    to clean up). A value of 0 marks an empty bucket, which works because
+    pool handles are never 0. Grows when half full; apart from that it
+    does not allocate.
+*/
+class FlatMap
+{
+    struct Bucket
+    {
+        uint64_t key;
+        uint64_t value;
+    };
+
+    vector<Bucket> buckets;
+    size_t mask = 0;
+    size_t count = 0;
+
+    static size_t mix(uint64_t key)
+    {
+        // splitmix64 finalizer, so that keys differing only in a few bits spread out
+        key ^= key >> 30;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 27;
+        key *= 0x94d049bb133111ebULL;
+        key ^= key >> 31;
+        return key;
+    }
+
+    void grow()
+    {
+        vector<Bucket> old = std::move(buckets);
+        buckets.assign(old.empty() ? 64 : old.size() * 2, Bucket{0, 0});
+        mask = buckets.size() - 1;
+        count = 0;
+        for (auto &bucket : old)
+            if (bucket.value != 0)
+                insert(bucket.key, bucket.value);
+    }
+
+public:
+    void reserve(size_t entries)
+    {
+        while (buckets.size() < entries * 2)
+            grow();
+    }
+
+    // 0 if the key is not there
+    uint64_t find(uint64_t key) const
+    {
+        if (buckets.empty())
+            return 0;
+        for (size_t i = mix(key) & mask;; i = (i + 1) & mask)
+        {
+            if (buckets[i].value == 0)
+                return 0;
+            if (buckets[i].key == key)
+                return buckets[i].value;
+        }
+    }
+
+    void insert(uint64_t key, uint64_t value)
+    {
+        if ((count + 1) * 2 > buckets.size())
+            grow();
+        size_t i = mix(key) & mask;
+        while (buckets[i].value != 0 && buckets[i].key != key)
+            i = (i + 1) & mask;
+        if (buckets[i].value == 0)
+            count++;
+        buckets[i] = Bucket{key, value};
+    }
+
+    void erase(uint64_t key)
+    {
+        if (buckets.empty())
+            return;
+        size_t i = mix(key) & mask;
+        while (buckets[i].key != key || buckets[i].value == 0)
+        {
+            if (buckets[i].value == 0)
+                return;
+            i = (i + 1) & mask;
+        }
+        count--;
+
+        // Pull later members of the probe chain back into the hole
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; buckets[j].value != 0; j = (j + 1) & mask)
+        {
+            size_t home = mix(buckets[j].key) & mask;
+            if (((j - home) & mask) >= ((j - hole) & mask))
+            {
+                buckets[hole] = buckets[j];
+                hole = j;
+            }
+        }
+        buckets[hole] = Bucket{0, 0};
+    }
+
+    size_t size() const { return count; }
+};
+
+/*
+    Deadlines for pooled objects, soonest first, in a binary heap. An
+    object that is released or rescheduled leaves its old entry behind;
+    the owner recognises such entries when they come up (the handle is
+    stale, or the object's deadline has moved) and pops them.
+*/
+class DeadlineHeap
+{
+public:
+    typedef chrono::steady_clock clock;
+
+    struct Entry
+    {
+        clock::time_point deadline;
+        uint64_t handle;
+
+        bool operator>(const Entry &other) const { return deadline > other.deadline; }
+    };
+
+private:
+    vector<Entry> entries;
+
+public:
+    void reserve(size_t count) { entries.reserve(count); }
+
+    void push(clock::time_point deadline, uint64_t handle)
+    {
+        entries.push_back(Entry{deadline, handle});
+        push_heap(entries.begin(), entries.end(), greater<Entry>());
+    }
+
+    void pop()
+    {
+        pop_heap(entries.begin(), entries.end(), greater<Entry>());
+        entries.pop_back();
+    }
+
+    bool empty() const { return entries.empty(); }
+    const Entry &top() const { return entries.front(); }
+
+    // Milliseconds from now until a deadline, rounded up; what epoll_wait takes
+    static int milliseconds_until(clock::time_point deadline, clock::time_point now)
+    {
+        if (deadline <= now)
+            return 0;
+        return chrono::duration_cast<chrono::milliseconds>(deadline - now).count() + 1;
+    }
+};
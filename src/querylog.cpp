@@ -0,0 +1,156 @@
+#include "querylog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+QueryLog::QueryLog(const string &path, size_t max_size, int max_files)
+    : path_(path), max_size_(max_size), max_files_(max(1, max_files))
+{
+    wall_base_ = chrono::system_clock::now();
+    steady_base_ = chrono::steady_clock::now();
+};
+
+QueryLog::~QueryLog()
+{
+    stop();
+};
+
+bool QueryLog::start(size_t workers)
+{
+    for (size_t i = 0; i < workers; i++)
+        rings_.push_back(make_unique<QueryLogRing>());
+    if (!open_file())
+        return false;
+    running_ = true;
+    thread_ = thread(&QueryLog::run, this);
+    return true;
+};
+
+void QueryLog::stop()
+{
+    if (!running_.exchange(false))
+        return;
+    thread_.join();
+    while (drain() > 0)
+        ;
+    if (fd_ != -1)
+        close(fd_);
+    fd_ = -1;
+};
+
+bool QueryLog::open_file()
+{
+    // Appending, so that a restart carries on with the file it left
+    fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ == -1)
+    {
+        if (!failing_)
+            cerr << "Query log " << path_ << ": " << strerror(errno) << endl;
+        failing_ = true;
+        return false;
+    }
+    file_size_ = lseek(fd_, 0, SEEK_END);
+    if (file_size_ == 0)
+    {
+        QueryLogHeader header = {};
+        memcpy(header.magic, query_log_magic, sizeof(header.magic));
+        header.record_size = sizeof(QueryLogRecord);
+        if (write(fd_, &header, sizeof(header)) == sizeof(header))
+            file_size_ = sizeof(header);
+    }
+    return true;
+};
+
+void QueryLog::rotate()
+{
+    close(fd_);
+    fd_ = -1;
+    for (int i = max_files_ - 1; i > 0; i--)
+    {
+        string from = i == 1 ? path_ : path_ + "." + to_string(i - 1);
+        rename(from.c_str(), (path_ + "." + to_string(i)).c_str());
+    }
+    if (max_files_ == 1)
+        unlink(path_.c_str());
+    open_file();
+};
+
+size_t QueryLog::drain()
+{
+    // Records go to the file straight from the rings, one write per run of
+    // slots, and only then are the slots handed back to the workers. A ring
+    // is at most two runs (where it wraps around), so one busy worker cannot
+    // keep the others waiting.
+    size_t total = 0;
+    for (auto &ring : rings_)
+    {
+        for (int run = 0; run < 2; run++)
+        {
+            size_t count;
+            const QueryLogRecord *records = ring->peek(count);
+            if (count == 0)
+                break;
+            if (fd_ == -1 && !open_file())
+            {
+                lost_.fetch_add(count, memory_order_relaxed);
+                ring->release(count);
+                total += count;
+                continue;
+            }
+
+            size_t length = count * sizeof(QueryLogRecord);
+            const char *data = reinterpret_cast<const char *>(records);
+            size_t done = 0;
+            while (done < length)
+            {
+                ssize_t n = write(fd_, data + done, length - done);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                done += n;
+            }
+
+            // A disk that is full or failing costs records, never the workers'
+            // time. A record written in part is cut off again, so that the
+            // file stays a whole number of records.
+            if (done < length)
+            {
+                if (!failing_)
+                    cerr << "Query log " << path_ << ": " << strerror(errno) << ", dropping records" << endl;
+                failing_ = true;
+                if (done % sizeof(QueryLogRecord) != 0)
+                {
+                    done -= done % sizeof(QueryLogRecord);
+                    if (ftruncate(fd_, file_size_ + done) != 0)
+                        perror("Query log truncate failed");
+                }
+                lost_.fetch_add(count - done / sizeof(QueryLogRecord), memory_order_relaxed);
+            }
+            else
+                failing_ = false;
+            written_.fetch_add(done / sizeof(QueryLogRecord), memory_order_relaxed);
+            file_size_ += done;
+            ring->release(count);
+            total += count;
+
+            if (file_size_ >= max_size_)
+                rotate();
+        }
+    }
+    return total;
+};
+
+void QueryLog::run()
+{
+    while (running_.load(memory_order_relaxed))
+        if (drain() == 0)
+            this_thread::sleep_for(chrono::milliseconds(query_log_drain_ms));
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+
+using namespace std;
+
+const size_t query_log_ring_size = 16384;                 // records per worker; must be a power of two
+const size_t default_query_log_size = 64 * 1024 * 1024;  // a file is rotated once it grows past this
+const int default_query_log_files = 8;                    // the current file and the rotated ones kept
+const int query_log_drain_ms = 10;                        // how long the writer sleeps when every ring is empty
+const size_t query_log_name_size = 224;                   // qname octets kept; longer names are cut
+
+const char query_log_magic[8] = {'D', 'N', 'S', 'Q', 'L', 'O', 'G', '1'};
+
+enum QueryLogFlags : uint8_t
+{
+    QUERYLOG_CACHED = 1,    // every question was answered from the cache
+    QUERYLOG_ZONE = 2,      // answered from our own zones
+    QUERYLOG_TCP = 4,       // came in over TCP
+    QUERYLOG_TRUNCATED = 8, // the reply went out with TC set
+    QUERYLOG_NAME_CUT = 16, // qname was too long and holds only its leading labels
+    QUERYLOG_RATE_LIMITED = 32, // the reply was dropped by rate limiting, or slipped if TC is set too
+};
+
+/*
+    One answered query, as it is written to the log file: 256 octets, in
+    host byte order except for the client address and port, which are as
+    they were on the wire. qname is the first question's name in wire
+    format, as the client sent it, with no compression pointers.
+*/
+struct QueryLogRecord
+{
+    uint64_t time_ns;    // when the query came in, nanoseconds since the Unix epoch
+    uint32_t latency_us; // from then until the reply was ready to go out
+    uint32_t client_address;
+    uint16_t client_port;
+    uint16_t qtype;
+    uint16_t qclass;
+    uint16_t id;
+    uint8_t rcode;
+    uint8_t flags; // QueryLogFlags
+    uint8_t qname_length;
+    uint8_t reserved[5];
+    uint8_t qname[query_log_name_size];
+};
+static_assert(sizeof(QueryLogRecord) == 256);
+
+// What a log file starts with, so that a reader knows what it is looking at
+struct QueryLogHeader
+{
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+/*
+    A single-producer, single-consumer ring of log records: the worker
+    fills slots in place, the log thread writes them out straight from
+    the ring. Each side owns one index and only reads the other's, so
+    neither ever waits for the other, and the indexes sit on cache lines
+    of their own. The worker keeps its last look at the log thread's index
+    and only loads it again when the ring seems full.
+*/
+class QueryLogRing
+{
+    vector<QueryLogRecord> slots_;
+    alignas(64) atomic<uint64_t> head_{0}; // slots published by the worker
+    uint64_t tail_seen_ = 0;               // the worker's copy of tail_
+    alignas(64) atomic<uint64_t> tail_{0}; // slots written out by the log thread
+
+public:
+    QueryLogRing() : slots_(query_log_ring_size) {}
+
+    // Worker side: a slot to fill, or nullptr if the ring is full. It is
+    // only seen by the log thread after publish().
+    QueryLogRecord *claim()
+    {
+        uint64_t head = head_.load(memory_order_relaxed);
+        if (head - tail_seen_ == slots_.size())
+        {
+            tail_seen_ = tail_.load(memory_order_acquire);
+            if (head - tail_seen_ == slots_.size())
+                return nullptr;
+        }
+        return &slots_[head & (slots_.size() - 1)];
+    }
+    void publish() { head_.store(head_.load(memory_order_relaxed) + 1, memory_order_release); }
+
+    // Log thread side: the published records that follow each other in
+    // memory, then release() of as many of them as were written
+    const QueryLogRecord *peek(size_t &count) const
+    {
+        uint64_t tail = tail_.load(memory_order_relaxed);
+        size_t start = tail & (slots_.size() - 1);
+        count = min<uint64_t>(head_.load(memory_order_acquire) - tail, slots_.size() - start);
+        return &slots_[start];
+    }
+    void release(size_t count) { tail_.store(tail_.load(memory_order_relaxed) + count, memory_order_release); }
+};
+
+/*
+    The query log: one ring per worker, and a thread that drains them all
+    into a file. Once the file grows past max_size it is renamed to
+    path.1 (path.1 to path.2, and so on, the oldest beyond max_files
+    going away) and a new one is started.
+
+    Workers never wait for the disk. A worker whose ring is full drops
+    the record and counts it, and records the log thread fails to write
+    are counted as lost; the metrics have both.
+*/
+class QueryLog
+{
+    string path_;
+    size_t max_size_;
+    int max_files_;
+    vector<unique_ptr<QueryLogRing>> rings_;
+    int fd_ = -1;
+    size_t file_size_ = 0;
+    bool failing_ = false; // the last write failed, and that has been reported
+    atomic<bool> running_{false};
+    atomic<uint64_t> written_{0};
+    atomic<uint64_t> lost_{0};
+    thread thread_;
+    chrono::system_clock::time_point wall_base_; // steady_clock times are turned into wall clock times from these
+    chrono::steady_clock::time_point steady_base_;
+
+    bool open_file();
+    void rotate();
+    size_t drain();
+    void run();
+
+public:
+    QueryLog(const string &path, size_t max_size, int max_files);
+    ~QueryLog();
+
+    // Opens the file and starts the log thread, with a ring for each worker
+    bool start(size_t workers);
+    // Writes out what the rings still hold, then stops the thread
+    void stop();
+
+    QueryLogRing &ring(size_t worker) { return *rings_[worker]; }
+    uint64_t wall_time_ns(chrono::steady_clock::time_point time) const
+    {
+        return chrono::duration_cast<chrono::nanoseconds>((wall_base_ + (time - steady_base_)).time_since_epoch()).count();
+    }
+
+    uint64_t written() const { return written_.load(memory_order_relaxed); }
+    uint64_t lost() const { return lost_.load(memory_order_relaxed); }
+};
@@ -0,0 +1,117 @@
+#include "ratelimit.h"
+
+#include <algorithm>
+#include <cstring>
+#include <netinet/in.h>
+
+#include "message.h"
+
+using namespace std;
+
+static uint64_t mix(uint64_t h)
+{
+    // The MurmurHash3 finalizer: every input bit ends up affecting every output bit
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+};
+
+static uint64_t lowercase(uint64_t word)
+{
+    // For every octet at once: its high bit is set in upper if it is in 'A'..'Z'
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t low = word & (0x7F * ones);
+    uint64_t upper = (low + (0x80 - 'A') * ones) & ~(low + (0x80 - 'Z' - 1) * ones) & ~word & (0x80 * ones);
+    return word | (upper >> 2);
+};
+
+static uint32_t milliseconds(RateLimiter::clock::time_point time)
+{
+    // Wraps every 49 days; only differences are ever looked at
+    return chrono::duration_cast<chrono::milliseconds>(time.time_since_epoch()).count();
+};
+
+void RateLimiter::configure(uint32_t client_rate, uint32_t response_rate, int slip, uint64_t seed)
+{
+    client_rate_ = client_rate;
+    response_rate_ = response_rate;
+    slip_ = slip;
+    seed_ = seed;
+    sets_.assign(enabled() ? rate_limit_sets : 0, Set{});
+};
+
+bool RateLimiter::take(uint64_t key, uint32_t rate, uint32_t now_ms)
+{
+    if (key == 0)
+        key = 1;
+    Entry *set = sets_[key & (sets_.size() - 1)].entries;
+    Entry *entry = nullptr;
+    Entry *oldest = set;
+    for (int i = 0; i < 4; i++)
+    {
+        if (set[i].key == key)
+        {
+            entry = &set[i];
+            break;
+        }
+        if (set[i].key == 0 || uint32_t(now_ms - set[i].stamp_ms) > uint32_t(now_ms - oldest->stamp_ms))
+            oldest = &set[i];
+    }
+
+    // A bucket seen for the first time starts full
+    int64_t full = int64_t(rate) * 1000;
+    if (entry == nullptr)
+    {
+        entry = oldest;
+        *entry = Entry{key, now_ms, int32_t(full)};
+    }
+
+    int64_t balance = entry->balance + int64_t(uint32_t(now_ms - entry->stamp_ms)) * rate;
+    entry->stamp_ms = now_ms;
+    if (balance < 1000)
+    {
+        entry->balance = balance;
+        return false;
+    }
+    entry->balance = min(balance, full) - 1000;
+    return true;
+};
+
+bool RateLimiter::allow_query(uint32_t address, clock::time_point now)
+{
+    if (client_rate_ == 0)
+        return true;
+    uint32_t prefix = ntohl(address) >> (32 - rate_limit_prefix_bits);
+    return take(mix(seed_ ^ prefix), client_rate_, milliseconds(now));
+};
+
+RateVerdict RateLimiter::check_response(uint32_t address, const uint8_t *qname, uint16_t qtype, uint16_t rcode, clock::time_point now)
+{
+    if (response_rate_ == 0)
+        return RATE_PASS;
+
+    // The name is hashed eight octets at a time, lowercased on the way.
+    // Length octets are never in 'A'..'Z', so lowercasing leaves them alone.
+    size_t length = 0;
+    while (qname[length] != 0 && length < max_name_length)
+        length += 1 + qname[length];
+    uint64_t h = seed_;
+    for (size_t i = 0; i < length; i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, qname + i, min<size_t>(8, length - i));
+        h = (h ^ lowercase(word)) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    uint32_t prefix = ntohl(address) >> (32 - rate_limit_prefix_bits);
+    uint8_t kind = rcode == 0 ? 1 : rcode == RCODE_NXDOMAIN ? 2 : 3;
+    h = mix(h ^ (uint64_t(prefix) << 24) ^ (uint64_t(qtype) << 8) ^ kind);
+
+    if (take(h, response_rate_, milliseconds(now)))
+        return RATE_PASS;
+    limited_++;
+    return slip_ > 0 && limited_ % slip_ == 0 ? RATE_SLIP : RATE_DROP;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+const size_t rate_limit_sets = 16384;    // per worker, a power of two: 1 MiB whatever the traffic
+const int rate_limit_prefix_bits = 24;   // clients are counted by /24, as a spoofer can pick any address in it
+const int default_rate_limit_slip = 2;
+
+enum RateVerdict : uint8_t
+{
+    RATE_PASS,
+    RATE_DROP,
+    RATE_SLIP, // send a truncated reply instead, so that a real client asks again over TCP
+};
+
+/*
+    Response rate limiting (RRL) for one worker, with token buckets in a
+    fixed table so that the limiter cannot be made to use more memory by
+    sending it more keys.
+
+    Two kinds of buckets share the table. One per client prefix limits the
+    queries a network may send in all; those over the limit are dropped
+    before they are even parsed. One per client prefix and response (the
+    name and type asked for, and whether the answer was positive, NXDOMAIN
+    or an error) limits the same reply going to the same place over and
+    over, which is what a reflection attack with a spoofed source looks
+    like. Of the replies over that limit, one in slip goes out truncated
+    and empty, and the rest are dropped; the victim gets far less than it
+    would, and a real client behind the prefix still gets through over TCP.
+
+    Each bucket holds a second of its rate and refills continuously. The
+    table is split in sets of four entries, one cache line each. A key is
+    only ever looked for in its own set, and when the set is full it takes
+    the entry that was used least recently, so a flood of new keys pushes
+    out idle buckets, never busy ones for long. Keys are 64-bit hashes,
+    seeded per worker, so they cannot be picked to collide.
+*/
+class RateLimiter
+{
+    struct Entry
+    {
+        uint64_t key = 0;      // 0 for a free entry
+        uint32_t stamp_ms = 0; // last refill
+        int32_t balance = 0;   // in thousandths of a reply
+    };
+    struct alignas(64) Set
+    {
+        Entry entries[4];
+    };
+
+    vector<Set> sets_;
+    uint64_t seed_ = 0;
+    uint32_t client_rate_ = 0;   // queries per second per prefix, 0 for no limit
+    uint32_t response_rate_ = 0; // identical replies per second per prefix, 0 for no limit
+    int slip_ = default_rate_limit_slip;
+    uint32_t limited_ = 0;       // replies over the limit so far, for slip
+
+    bool take(uint64_t key, uint32_t rate, uint32_t now_ms);
+
+public:
+    typedef chrono::steady_clock clock;
+
+    void configure(uint32_t client_rate, uint32_t response_rate, int slip, uint64_t seed);
+    bool enabled() const { return client_rate_ != 0 || response_rate_ != 0; }
+    bool limits_responses() const { return response_rate_ != 0; }
+
+    // address is in network order
+    bool allow_query(uint32_t address, clock::time_point now);
+    // qname is the uncompressed wire name of the reply's question, in any case
+    RateVerdict check_response(uint32_t address, const uint8_t *qname, uint16_t qtype, uint16_t rcode, clock::time_point now);
+};
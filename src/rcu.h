@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+const uint64_t rcu_offline = UINT64_MAX;
+
+/*
+    One reader thread's announcement of the last epoch it has seen. Each
+    sits on a cache line of its own, so readers never write to shared lines.
+*/
+struct alignas(64) RcuReader
+{
+    atomic<uint64_t> epoch{rcu_offline};
+};
+
+/*
+    A pointer published with quiescent-state-based RCU.
+
+    Readers (the workers) call quiescent() at the top of every event loop
+    iteration, at a point where they hold nothing from the previous
+    iteration. What they get back stays valid until their next quiescent()
+    or offline() call. That is two atomic stores and a load per iteration,
+    with no locks and no read-side counters. Before blocking in epoll_wait
+    a reader goes offline(), so that an idle worker never holds up a writer.
+
+    The writer swaps the pointer and bumps the epoch. Once every reader has
+    either announced the new epoch or gone offline, no reader can still be
+    looking at the old object, and publish() hands it back to be freed.
+    There is only ever one writer (the main thread).
+*/
+template <typename T>
+class RcuPointer
+{
+    atomic<T *> current_{nullptr};
+    atomic<uint64_t> epoch_{1};
+    vector<RcuReader *> readers_;
+
+    void synchronize(uint64_t target)
+    {
+        for (RcuReader *reader : readers_)
+        {
+            while (true)
+            {
+                uint64_t seen = reader->epoch.load();
+                if (seen == rcu_offline || seen >= target)
+                    break;
+                this_thread::sleep_for(chrono::microseconds(200));
+            }
+        }
+    }
+
+public:
+    ~RcuPointer() { delete current_.load(); }
+
+    // Readers are registered before any of them starts
+    void add_reader(RcuReader &reader) { readers_.push_back(&reader); }
+
+    T *quiescent(RcuReader &reader)
+    {
+        reader.epoch.store(epoch_.load());
+        return current_.load();
+    }
+
+    void offline(RcuReader &reader) { reader.epoch.store(rcu_offline); }
+
+    // The writer's own view; readers go through quiescent()
+    T *get() const { return current_.load(); }
+
+    // Publishes next and returns the previous object once no reader can hold it
+    unique_ptr<T> publish(unique_ptr<T> next)
+    {
+        T *old = current_.exchange(next.release());
+        synchronize(epoch_.fetch_add(1) + 1);
+        return unique_ptr<T>(old);
+    }
+};
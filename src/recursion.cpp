@@ -0,0 +1,208 @@
+#include "recursion.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include "cache.h"
+#include "zone.h"
+
+using namespace std;
+
+static size_t label_count(const uint8_t *name)
+{
+    size_t labels = 0;
+    for (size_t pos = 0; name[pos] != 0; pos += 1 + name[pos])
+        labels++;
+    return labels;
+};
+
+bool in_zone(const uint8_t *name, const uint8_t *zone)
+{
+    // Drop labels off the front of name until it is as long as zone, then compare
+    size_t name_labels = label_count(name), zone_labels = label_count(zone);
+    if (name_labels < zone_labels)
+        return false;
+    for (; name_labels > zone_labels; name_labels--)
+        name += 1 + name[0];
+    return same_name(name, zone);
+};
+
+DelegationCache::DelegationCache() : seed_((uint64_t(random_device()()) << 32) | random_device()()) {};
+
+uint64_t DelegationCache::hash(const uint8_t *zone) const
+{
+    // FNV-1a from the seed over the lowercased name, then the MurmurHash3 finalizer
+    uint64_t h = seed_;
+    for (size_t pos = 0;; pos += 1 + zone[pos])
+    {
+        h = (h ^ zone[pos]) * 0x100000001b3ULL;
+        if (zone[pos] == 0)
+            break;
+        for (size_t i = 1; i <= zone[pos]; i++)
+        {
+            uint8_t c = zone[pos + i];
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            h = (h ^ c) * 0x100000001b3ULL;
+        }
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+};
+
+DelegationCache::Zones::iterator DelegationCache::find(const uint8_t *zone)
+{
+    auto range = zones_.equal_range(hash(zone));
+    for (auto it = range.first; it != range.second; ++it)
+        if (same_name(it->second.zone.data(), zone))
+            return it;
+    return zones_.end();
+};
+
+const Delegation *DelegationCache::closest(const uint8_t *name, clock::time_point now, size_t &zone_offset)
+{
+    if (zones_.empty())
+        return nullptr;
+
+    // Every suffix of the name, itself first and the root last
+    for (size_t pos = 0;; pos += 1 + name[pos])
+    {
+        auto found = find(name + pos);
+        if (found != zones_.end() && now >= found->second.expires)
+        {
+            zones_.erase(found);
+            found = zones_.end();
+        }
+        if (found != zones_.end())
+        {
+            zone_offset = pos;
+            return &found->second;
+        }
+        if (name[pos] == 0)
+            return nullptr;
+    }
+};
+
+void DelegationCache::insert(const uint8_t *zone, Delegation &&delegation, uint32_t ttl, clock::time_point now)
+{
+    if (ttl == 0)
+        return;
+    if (zones_.size() >= max_delegations)
+    {
+        for (auto it = zones_.begin(); it != zones_.end();)
+            it = now >= it->second.expires ? zones_.erase(it) : next(it);
+        if (zones_.size() >= max_delegations)
+            zones_.erase(zones_.begin());
+    }
+    delegation.zone.assign(zone, name_length(zone));
+    delegation.expires = now + chrono::seconds(ttl);
+
+    // A zone already known is replaced; one that merely shares its hash is not
+    auto found = find(zone);
+    if (found != zones_.end())
+        found->second = std::move(delegation);
+    else
+        zones_.emplace(hash(zone), std::move(delegation));
+};
+
+void DelegationCache::resolved(const uint8_t *zone, const uint8_t *server, const sockaddr_in *addresses, size_t count)
+{
+    auto found = find(zone);
+    if (found == zones_.end())
+        return;
+    Delegation &delegation = found->second;
+    auto &names = delegation.unresolved;
+    names.erase(remove_if(names.begin(), names.end(), [&](const WireName &name) { return same_name(name.data(), server); }),
+                names.end());
+    for (size_t i = 0; i < count && delegation.servers.size() < max_zone_servers; i++)
+        delegation.servers.push_back(addresses[i]);
+};
+
+StepOutcome classify_response(const RecordSet &records, uint16_t rcode, bool authoritative, const uint8_t *name,
+                              uint16_t qtype, const uint8_t *zone, WireName &next)
+{
+    if (rcode != 0 && rcode != RCODE_NXDOMAIN)
+        return STEP_LAME;
+
+    // Follow whatever CNAMEs the server put in front of the answer
+    const uint8_t *target = name;
+    for (int hop = 0; hop <= max_cname_hops; hop++)
+    {
+        const uint8_t *alias = nullptr;
+        for (auto &record : records.records)
+        {
+            if (record.section != ANSWER_SECTION || !same_name(record.name.data(), target))
+                continue;
+            if (record.type == qtype || qtype == TYPE_ANY)
+                return STEP_ANSWER;
+            if (record.type == TYPE_CNAME)
+                alias = records.rdata(record);
+        }
+        if (alias == nullptr)
+            break;
+        target = alias;
+    }
+    if (rcode == RCODE_NXDOMAIN)
+        return STEP_ANSWER;
+    if (target != name)
+    {
+        next.assign(target, name_length(target));
+        return STEP_CNAME;
+    }
+
+    // No answer. Either the name servers of a zone below this one, which
+    // the name is in, or the name has nothing of this type (NODATA). A
+    // referral back up or sideways is a misconfigured server, not progress.
+    for (auto &record : records.records)
+    {
+        if (record.section != AUTHORITY_SECTION)
+            continue;
+        if (record.type == TYPE_SOA)
+            return STEP_ANSWER;
+        const uint8_t *child = record.name.data();
+        if (record.type == TYPE_NS && in_zone(name, child) && in_zone(child, zone) && !same_name(child, zone))
+        {
+            next = record.name;
+            return STEP_REFERRAL;
+        }
+    }
+    return authoritative ? STEP_ANSWER : STEP_LAME;
+};
+
+uint32_t read_referral(const RecordSet &records, const uint8_t *child, const uint8_t *zone, Delegation &delegation)
+{
+    uint32_t ttl = max_cache_ttl;
+    for (auto &ns : records.records)
+    {
+        if (ns.section != AUTHORITY_SECTION || ns.type != TYPE_NS || !same_name(ns.name.data(), child))
+            continue;
+        ttl = min(ttl, ns.ttl);
+
+        // Glue is only taken from a server that is authoritative for the
+        // name server's name, or anyone could point any zone anywhere
+        const uint8_t *server = records.rdata(ns);
+        bool glued = false;
+        for (auto &glue : records.records)
+        {
+            if (glue.section != ADDITIONAL_SECTION || glue.type != TYPE_A || glue.rdlength != 4 ||
+                !same_name(glue.name.data(), server) || !in_zone(server, zone) || delegation.servers.size() == max_zone_servers)
+                continue;
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            memcpy(&address.sin_addr, records.rdata(glue), 4);
+            delegation.servers.push_back(address);
+            glued = true;
+        }
+        if (!glued && delegation.unresolved.size() < max_zone_servers)
+        {
+            delegation.unresolved.emplace_back();
+            delegation.unresolved.back().assign(server, name_length(server));
+        }
+    }
+    return ttl;
+};
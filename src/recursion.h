@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+
+#include "message.h"
+#include "wire.h"
+
+using namespace std;
+
+const int default_authority_port = 53;
+const int max_resolution_steps = 16;  // referrals and CNAMEs one resolution may follow
+const int max_resolution_depth = 2;   // name server addresses looked up on the way, one inside the other
+const size_t max_delegations = 16384; // zone cuts one worker remembers
+const size_t max_zone_servers = 8;    // name server addresses, and names without one, kept per zone
+
+/*
+    A zone cut, as a referral from the parent zone describes it: the
+    addresses of the zone's name servers, from the glue, and the names of
+    those that came without glue. Those are only looked up when none of
+    the addresses answers. Addresses carry no port; every name server is
+    asked on the same one (--authority-port).
+*/
+struct Delegation
+{
+    WireName zone;
+    chrono::steady_clock::time_point expires;
+    vector<sockaddr_in> servers;
+    vector<WireName> unresolved;
+};
+
+/*
+    The zone cuts one worker has been referred to, by zone name. An
+    iterative resolution starts at the deepest cut above its name that is
+    still current, so once a zone is known, a lookup of any name in it is
+    one query to one of its servers. Without any, it starts at the root.
+
+    Referrals are rare next to lookups, and the cache is bounded; when it
+    is full, expired cuts are dropped first, then whichever come first.
+    Cuts are found by a hash computed on the name where it lies, so a
+    lookup does not allocate. The hash is seeded per worker, so names
+    cannot be picked to collide, and cuts that collide anyway are kept
+    side by side; the name kept with each one tells them apart.
+*/
+class DelegationCache
+{
+    typedef unordered_multimap<uint64_t, Delegation> Zones;
+
+    Zones zones_; // by hash() of the zone name
+    uint64_t seed_;
+
+    uint64_t hash(const uint8_t *zone) const;
+    Zones::iterator find(const uint8_t *zone);
+
+public:
+    typedef chrono::steady_clock clock;
+
+    DelegationCache();
+
+    // The deepest current cut at or above name; zone_offset is where the
+    // zone's name starts in name. nullptr if there is none.
+    const Delegation *closest(const uint8_t *name, clock::time_point now, size_t &zone_offset);
+    void insert(const uint8_t *zone, Delegation &&delegation, uint32_t ttl, clock::time_point now);
+    // The addresses of one of the zone's name servers that came without glue
+    void resolved(const uint8_t *zone, const uint8_t *server, const sockaddr_in *addresses, size_t count);
+
+    size_t size() const { return zones_.size(); }
+};
+
+enum StepOutcome : uint8_t
+{
+    STEP_ANSWER,   // the answer, NXDOMAIN or NODATA: the resolution is over
+    STEP_CNAME,    // an alias; the resolution goes on with its target
+    STEP_REFERRAL, // the name servers of a zone closer to the name
+    STEP_LAME,     // nothing that helps; another server of the zone is asked
+};
+
+// True if name is zone or below it
+bool in_zone(const uint8_t *name, const uint8_t *zone);
+
+// What a name server for zone means by its response to (name, qtype).
+// The records are the response's, as copy_records leaves them. next is
+// the alias's target for STEP_CNAME, and the closer zone for STEP_REFERRAL.
+StepOutcome classify_response(const RecordSet &records, uint16_t rcode, bool authoritative, const uint8_t *name,
+                              uint16_t qtype, const uint8_t *zone, WireName &next);
+
+// The delegation to child in a referral from a server for zone, and its TTL
+uint32_t read_referral(const RecordSet &records, const uint8_t *child, const uint8_t *zone, Delegation &delegation);
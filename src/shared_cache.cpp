@@ -0,0 +1,224 @@
+#include "shared_cache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static uint32_t seconds(chrono::steady_clock::time_point time)
+{
+    return chrono::duration_cast<chrono::seconds>(time.time_since_epoch()).count();
+};
+
+static chrono::steady_clock::time_point time_point(uint32_t seconds)
+{
+    return chrono::steady_clock::time_point(chrono::seconds(seconds));
+};
+
+SharedCache::~SharedCache()
+{
+    if (mapping_ != nullptr)
+        munmap(mapping_, mapped_size_);
+};
+
+bool SharedCache::lay_out(SharedCacheHeader &header, size_t size, size_t bucket_count)
+{
+    // The first one here lays the segment out. Anyone else waits for it,
+    // and then has to agree with what it wrote.
+    uint32_t state = 0;
+    if (header.state.compare_exchange_strong(state, 1, memory_order_acquire))
+    {
+        memcpy(header.magic, shared_cache_magic, sizeof(header.magic));
+        header.version = shared_cache_version;
+        header.slot_size = shared_slot_size;
+        header.bucket_count = bucket_count;
+        header.state.store(2, memory_order_release);
+    }
+    for (int waited = 0; header.state.load(memory_order_acquire) != 2; waited++)
+    {
+        if (waited == 100)
+        {
+            cerr << "shared cache: segment was never laid out; remove it to start over" << endl;
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    uint64_t buckets = header.bucket_count;
+    if (memcmp(header.magic, shared_cache_magic, sizeof(header.magic)) != 0 || header.version != shared_cache_version ||
+        header.slot_size != shared_slot_size || buckets == 0 || (buckets & (buckets - 1)) != 0 ||
+        shared_header_size + buckets * shared_bucket_slots * shared_slot_size > size)
+    {
+        cerr << "shared cache: segment has a layout this server does not use" << endl;
+        return false;
+    }
+    bucket_mask_ = buckets - 1;
+    return true;
+};
+
+bool SharedCache::open(const string &name, size_t size)
+{
+    // The largest power of two of buckets that fits in size
+    size_t bucket_bytes = shared_bucket_slots * shared_slot_size;
+    size_t bucket_count = 1;
+    while (bucket_count * 2 * bucket_bytes <= size)
+        bucket_count *= 2;
+
+    string path = name[0] == '/' ? name : "/" + name;
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        perror("shm_open");
+        return false;
+    }
+
+    // A new segment is sized here and comes zeroed: every slot empty. Two
+    // processes racing to create it size it the same way.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && ftruncate(fd, shared_header_size + bucket_count * bucket_bytes) == -1)
+        st.st_size = -1;
+    if (st.st_size == -1 || fstat(fd, &st) == -1)
+    {
+        perror("shared cache");
+        close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+    mapping_ = mapping;
+    mapped_size_ = st.st_size;
+    if (mapped_size_ < shared_header_size || !lay_out(*static_cast<SharedCacheHeader *>(mapping_), mapped_size_, bucket_count))
+    {
+        munmap(mapping_, mapped_size_);
+        mapping_ = nullptr;
+        return false;
+    }
+    slots_ = reinterpret_cast<SharedSlot *>(static_cast<uint8_t *>(mapping_) + shared_header_size);
+    return true;
+};
+
+uint64_t SharedCache::hash(string_view key)
+{
+    // Eight octets at a time, then the MurmurHash3 finalizer. It has to
+    // come out the same in every process, so it is ours and not std::hash.
+    uint64_t h = key.size();
+    for (size_t i = 0; i < key.size(); i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, key.data() + i, min<size_t>(8, key.size() - i));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h == 0 ? 1 : h;
+};
+
+bool SharedCache::lookup(string_view key, uint64_t hash, MessageView &view, RecordSet &answers, SharedEntry &entry,
+                         chrono::seconds keep)
+{
+    if (!enabled())
+        return false;
+    uint32_t now = seconds(clock::now());
+    SharedSlot *bucket = slots_ + (hash & bucket_mask_) * shared_bucket_slots;
+    for (size_t i = 0; i < shared_bucket_slots; i++)
+    {
+        SharedSlot &slot = bucket[i];
+        if (slot.hash.load(memory_order_relaxed) != hash)
+            continue;
+
+        // Copy the slot out, then make sure nobody wrote it meanwhile. The
+        // lengths may be torn until then, so they are only trusted as far
+        // as the payload goes.
+        uint32_t before = slot.sequence.load(memory_order_acquire);
+        if (before & 1)
+            continue;
+        uint8_t payload[sizeof(slot.payload)];
+        uint32_t expires = slot.expires.load(memory_order_relaxed);
+        uint32_t inserted = slot.inserted;
+        uint16_t rcode = slot.rcode;
+        size_t key_length = slot.key_length;
+        size_t data_length = slot.data_length;
+        size_t used = min(key_length + data_length, sizeof(payload));
+        memcpy(payload, slot.payload, used);
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.sequence.load(memory_order_relaxed) != before || key_length + data_length > sizeof(payload))
+            continue;
+
+        if (key_length != key.size() || memcmp(payload, key.data(), key_length) != 0 ||
+            now >= uint64_t(expires) + keep.count())
+            continue;
+        if (!view.parse(payload + key_length, data_length))
+            continue;
+        copy_records(view, answers);
+        entry.rcode = rcode;
+        entry.inserted = time_point(inserted);
+        entry.expires = time_point(expires);
+        return true;
+    }
+    return false;
+};
+
+bool SharedCache::insert(string_view key, uint64_t hash, const RecordSet &answers, const SharedEntry &entry)
+{
+    if (!enabled())
+        return false;
+
+    // Encode first, outside the slot, so that it is held for as short a
+    // time as possible and not at all for an entry that does not fit
+    uint8_t payload[sizeof(SharedSlot::payload)];
+    if (key.size() >= sizeof(payload))
+        return false;
+    memcpy(payload, key.data(), key.size());
+    WireWriter writer(payload + key.size(), sizeof(payload) - key.size());
+    writer.header(DNSHeader{});
+    if (!write_records(writer, answers))
+        return false;
+
+    // The slot this key is in already, else an empty or expired one,
+    // else the one closest to expiring
+    SharedSlot *bucket = slots_ + (hash & bucket_mask_) * shared_bucket_slots;
+    SharedSlot *victim = nullptr;
+    for (size_t i = 0; i < shared_bucket_slots; i++)
+    {
+        SharedSlot &slot = bucket[i];
+        uint32_t expires = slot.expires.load(memory_order_relaxed);
+        if (slot.hash.load(memory_order_relaxed) == hash)
+        {
+            victim = &slot;
+            break;
+        }
+        // An empty slot has expired at 0
+        if (victim == nullptr || expires < victim->expires.load(memory_order_relaxed))
+            victim = &slot;
+    }
+
+    uint32_t sequence = victim->sequence.load(memory_order_relaxed);
+    if ((sequence & 1) || !victim->sequence.compare_exchange_strong(sequence, sequence + 1, memory_order_acquire))
+        return false;
+    atomic_thread_fence(memory_order_release);
+    victim->hash.store(hash, memory_order_relaxed);
+    victim->expires.store(seconds(entry.expires), memory_order_relaxed);
+    victim->inserted = seconds(entry.inserted);
+    victim->rcode = entry.rcode;
+    victim->key_length = key.size();
+    victim->data_length = writer.length();
+    memcpy(victim->payload, payload, key.size() + writer.length());
+    victim->sequence.store(sequence + 2, memory_order_release);
+    return true;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "message.h"
+#include "wire.h"
+
+using namespace std;
+
+const size_t default_shared_cache_size = 64 * 1024 * 1024; // 64 MiB of slots
+const size_t shared_slot_size = 512;                        // one entry, its key and its records included
+const size_t shared_bucket_slots = 8;                       // slots a key may land in
+const size_t shared_header_size = 4096;                     // a page ahead of the slots, for the layout
+const uint32_t shared_cache_version = 1;
+
+const char shared_cache_magic[8] = {'D', 'N', 'S', 'S', 'H', 'M', 'C', '1'};
+
+/*
+    What the segment starts with. Whoever creates the segment lays it out
+    and sets state to ready; everyone else maps it, waits for that and
+    takes the layout from here, not from their own --shared-cache-size.
+*/
+struct SharedCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t bucket_count; // a power of two
+    atomic<uint32_t> state; // 0 while empty, 1 while being laid out, 2 once ready
+};
+
+/*
+    One entry. The key and the answer share the payload: the key first,
+    then a DNS message without a question, holding the records in their
+    sections. sequence is a seqlock, odd while a writer is in the slot;
+    a reader copies the slot out and only trusts the copy if sequence was
+    even and the same before and after. hash and expires are read by
+    writers choosing a slot without taking it, so they are atomic too.
+*/
+struct alignas(64) SharedSlot
+{
+    atomic<uint32_t> sequence;
+    atomic<uint32_t> expires; // seconds on the steady clock, which every process on the host shares
+    atomic<uint64_t> hash;    // of the key, 0 for a slot never written
+    uint32_t inserted;
+    uint16_t rcode;
+    uint16_t key_length;
+    uint16_t data_length;
+    uint8_t payload[shared_slot_size - 26];
+};
+static_assert(sizeof(SharedSlot) == shared_slot_size);
+static_assert(atomic<uint32_t>::is_always_lock_free && atomic<uint64_t>::is_always_lock_free);
+
+// An entry as a lookup found it
+struct SharedEntry
+{
+    uint16_t rcode = 0;
+    chrono::steady_clock::time_point inserted;
+    chrono::steady_clock::time_point expires;
+};
+
+/*
+    A second level under every worker's AnswerCache, in a POSIX shared
+    memory segment that every worker thread and every server process
+    mapping the same name shares. An answer one of them fetched is a hit
+    for all of them, and the segment outlives the processes, so a restart
+    does not start cold.
+
+    The segment is a fixed array of fixed-size slots, in buckets of eight
+    that fill one 4 KiB page. A key hashes to one bucket and may be in any
+    of its slots. Nothing is ever locked: a writer claims a slot by
+    moving its sequence from even to odd with a compare-and-swap, and
+    gives up if another writer got there first, since losing one insert
+    to a cache costs nothing. It takes the slot the key is already in, or
+    else an expired or empty one, or else the one that expires soonest.
+    Readers never write to the segment at all.
+
+    Entries that do not fit a slot, a long key with a large answer, stay
+    in the local caches only. A process killed while writing leaves its
+    slot odd, and that slot unused, until the segment is removed.
+*/
+class SharedCache
+{
+    typedef chrono::steady_clock clock;
+
+    void *mapping_ = nullptr;
+    size_t mapped_size_ = 0;
+    SharedSlot *slots_ = nullptr;
+    uint64_t bucket_mask_ = 0;
+
+    bool lay_out(SharedCacheHeader &header, size_t size, size_t bucket_count);
+
+public:
+    ~SharedCache();
+
+    // Maps the segment called name, creating it with room for size octets
+    // of slots if there is none yet
+    bool open(const string &name, size_t size);
+
+    // The hash both levels agree on; the key is lowercased already
+    static uint64_t hash(string_view key);
+
+    // A hit appends the records to answers. view is scratch space for
+    // reading them back. Entries are found until keep past their expiry.
+    bool lookup(string_view key, uint64_t hash, MessageView &view, RecordSet &answers, SharedEntry &entry,
+                chrono::seconds keep);
+    // False if the entry did not fit, or its bucket was busy
+    bool insert(string_view key, uint64_t hash, const RecordSet &answers, const SharedEntry &entry);
+
+    bool enabled() const { return slots_ != nullptr; }
+    size_t capacity() const { return enabled() ? (bucket_mask_ + 1) * shared_bucket_slots : 0; }
+};
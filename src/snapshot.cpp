@@ -0,0 +1,218 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "atomic_file.h"
+
+using namespace std;
+
+int64_t to_unix_seconds(chrono::steady_clock::time_point time)
+{
+    auto since = chrono::duration_cast<chrono::seconds>(time - chrono::steady_clock::now());
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch() + since).count();
+};
+
+chrono::steady_clock::time_point from_unix_seconds(int64_t seconds)
+{
+    auto since = chrono::seconds(seconds) - chrono::system_clock::now().time_since_epoch();
+    return chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(since);
+};
+
+static size_t padded(size_t length)
+{
+    return (length + 7) & ~size_t(7);
+};
+
+bool append_snapshot_entry(vector<uint8_t> &out, vector<uint8_t> &scratch, string_view key, const RecordSet &answers,
+                           uint16_t rcode, int64_t inserted, int64_t expires)
+{
+    // Only the message's real length is appended to out
+    scratch.resize(max_message_size);
+    WireWriter writer(scratch.data(), scratch.size());
+    writer.header(DNSHeader{});
+    if (!write_records(writer, answers))
+        return false;
+
+    SnapshotEntry entry = {inserted, expires, rcode, uint16_t(key.size()), uint32_t(writer.length())};
+    const uint8_t *header = reinterpret_cast<const uint8_t *>(&entry);
+    size_t start = out.size();
+    out.insert(out.end(), header, header + sizeof(entry));
+    out.insert(out.end(), key.begin(), key.end());
+    out.insert(out.end(), scratch.data(), scratch.data() + writer.length());
+    out.resize(start + padded(sizeof(entry) + key.size() + writer.length()), 0);
+    return true;
+};
+
+bool write_snapshot(const string &path, const vector<const vector<uint8_t> *> &parts)
+{
+    size_t total = 0;
+    for (auto *part : parts)
+        total += part->size();
+    vector<uint8_t> file(sizeof(SnapshotHeader));
+    file.reserve(sizeof(SnapshotHeader) + total);
+
+    // The entries first, one copy of every key, noting where each one went
+    vector<uint64_t> offsets;
+    SnapshotHeader header = {};
+    for (auto *part : parts)
+        for (size_t pos = 0; pos < part->size();)
+        {
+            SnapshotEntry entry;
+            memcpy(&entry, part->data() + pos, sizeof(entry));
+            size_t length = padded(sizeof(entry) + entry.key_length + entry.data_length);
+            offsets.push_back(file.size());
+            file.insert(file.end(), part->begin() + pos, part->begin() + pos + length);
+            header.latest_expiry = max(header.latest_expiry, entry.expires);
+            pos += length;
+        }
+
+    // Then the index, at most half full
+    size_t index_size = 1;
+    while (index_size < offsets.size() * 2)
+        index_size *= 2;
+    vector<SnapshotSlot> index(index_size, SnapshotSlot{0, 0});
+    size_t kept = 0, end = sizeof(SnapshotHeader);
+    for (uint64_t offset : offsets)
+    {
+        SnapshotEntry entry;
+        memcpy(&entry, file.data() + offset, sizeof(entry));
+        string_view key(reinterpret_cast<const char *>(file.data() + offset + sizeof(entry)), entry.key_length);
+        uint64_t hash = SharedCache::hash(key);
+        size_t i = hash & (index_size - 1);
+        bool duplicate = false;
+        for (; index[i].offset != 0; i = (i + 1) & (index_size - 1))
+        {
+            const uint8_t *other = file.data() + index[i].offset;
+            SnapshotEntry other_entry;
+            memcpy(&other_entry, other, sizeof(other_entry));
+            if (index[i].hash == hash && other_entry.key_length == key.size() &&
+                memcmp(other + sizeof(other_entry), key.data(), key.size()) == 0)
+            {
+                duplicate = true;
+                break;
+            }
+        }
+        if (duplicate)
+            continue;
+
+        // Entries are moved down over the duplicates left behind
+        size_t length = padded(sizeof(entry) + entry.key_length + entry.data_length);
+        memmove(file.data() + end, file.data() + offset, length);
+        index[i] = SnapshotSlot{hash, end};
+        end += length;
+        kept++;
+    }
+    file.resize(end);
+
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_version;
+    header.entry_count = kept;
+    header.index_offset = file.size();
+    header.index_size = index_size;
+    header.created = to_unix_seconds(chrono::steady_clock::now());
+    memcpy(file.data(), &header, sizeof(header));
+    const uint8_t *table = reinterpret_cast<const uint8_t *>(index.data());
+    file.insert(file.end(), table, table + index_size * sizeof(SnapshotSlot));
+    return write_file_atomically(path, file);
+};
+
+CacheSnapshot::~CacheSnapshot()
+{
+    if (mapping_ != nullptr)
+        munmap(mapping_, size_);
+};
+
+bool CacheSnapshot::open(const string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        // No snapshot yet is a cold start, not an error
+        if (errno != ENOENT)
+            cerr << "Cannot open cache snapshot " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader)))
+    {
+        cerr << "Cache snapshot " << path << " is too short" << endl;
+        ::close(fd);
+        return false;
+    }
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        cerr << "Cannot map cache snapshot " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    const SnapshotHeader *header = static_cast<const SnapshotHeader *>(mapping);
+    size_t size = st.st_size;
+    uint64_t slots = header->index_size;
+    if (memcmp(header->magic, snapshot_magic, sizeof(header->magic)) != 0 || header->version != snapshot_version ||
+        slots == 0 || (slots & (slots - 1)) != 0 || header->index_offset % 8 != 0 ||
+        header->index_offset < sizeof(SnapshotHeader) || header->index_offset > size ||
+        slots > (size - header->index_offset) / sizeof(SnapshotSlot))
+    {
+        cerr << path << " is not a cache snapshot this server can read" << endl;
+        munmap(mapping, size);
+        return false;
+    }
+
+    // Only what is read gets paged in; tell the kernel not to read ahead
+    madvise(mapping, size, MADV_RANDOM);
+    mapping_ = mapping;
+    size_ = size;
+    header_ = header;
+    index_ = reinterpret_cast<const SnapshotSlot *>(static_cast<const uint8_t *>(mapping) + header->index_offset);
+    return true;
+};
+
+bool CacheSnapshot::lookup(string_view key, uint64_t hash, MessageView &view, RecordSet &answers, SharedEntry &entry,
+                           chrono::seconds keep) const
+{
+    if (!enabled())
+        return false;
+    int64_t now = to_unix_seconds(chrono::steady_clock::now());
+    if (now >= header_->latest_expiry + keep.count())
+        return false;
+
+    // Offsets are checked against the file before anything is read at one,
+    // in case it was cut short or is not what its header says
+    const uint8_t *base = static_cast<const uint8_t *>(mapping_);
+    uint64_t mask = header_->index_size - 1;
+    for (uint64_t probes = 0, i = hash & mask; probes <= mask; probes++, i = (i + 1) & mask)
+    {
+        const SnapshotSlot &slot = index_[i];
+        if (slot.offset == 0)
+            return false;
+        if (slot.hash != hash)
+            continue;
+        if (slot.offset < sizeof(SnapshotHeader) || slot.offset + sizeof(SnapshotEntry) > header_->index_offset)
+            return false;
+        SnapshotEntry found;
+        memcpy(&found, base + slot.offset, sizeof(found));
+        const uint8_t *data = base + slot.offset + sizeof(found) + found.key_length;
+        if (slot.offset + sizeof(found) + found.key_length + found.data_length > header_->index_offset)
+            return false;
+        if (found.key_length != key.size() || memcmp(base + slot.offset + sizeof(found), key.data(), key.size()) != 0)
+            continue;
+
+        if (now >= found.expires + keep.count() || !view.parse(data, found.data_length))
+            return false;
+        copy_records(view, answers);
+        entry.rcode = found.rcode;
+        entry.inserted = from_unix_seconds(found.inserted);
+        entry.expires = from_unix_seconds(found.expires);
+        return true;
+    }
+    return false;
+};
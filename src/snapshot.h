@@ -0,0 +1,99 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "message.h"
+#include "shared_cache.h"
+#include "wire.h"
+
+using namespace std;
+
+const int default_snapshot_interval = 300; // seconds between snapshots, besides the one at shutdown
+const uint32_t snapshot_version = 1;
+
+const char snapshot_magic[8] = {'D', 'N', 'S', 'S', 'N', 'A', 'P', '1'};
+
+/*
+    A snapshot file is this header, the entries one after the other, each
+    padded to 8 octets, and then the index: a table of (hash, offset)
+    pairs, a power of two of them, with linear probing and offset 0 for an
+    empty one. Everything is in host byte order; a snapshot is for the
+    host that wrote it. Times are seconds since the Unix epoch, so that
+    they mean the same after a reboot.
+*/
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entry_count;
+    uint64_t index_offset;
+    uint64_t index_size;     // pairs in the index
+    int64_t created;
+    int64_t latest_expiry;   // once past this, nothing in the file is any use
+};
+
+// What every entry starts with, followed by the key and then a DNS
+// message without a question that holds the records in their sections
+struct SnapshotEntry
+{
+    int64_t inserted;
+    int64_t expires;
+    uint16_t rcode;
+    uint16_t key_length;
+    uint32_t data_length;
+};
+
+struct SnapshotSlot
+{
+    uint64_t hash;   // SharedCache::hash of the key
+    uint64_t offset; // of the entry, 0 for an empty slot
+};
+
+// Appends one entry to a snapshot being put together; false if it is too
+// large for a message. The records are encoded in scratch first, which the
+// caller keeps from one entry to the next.
+bool append_snapshot_entry(vector<uint8_t> &out, vector<uint8_t> &scratch, string_view key, const RecordSet &answers,
+                           uint16_t rcode, int64_t inserted, int64_t expires);
+
+// Writes the entries appended to every part to path, through a temporary
+// file that replaces it in one rename. A key in more than one part is
+// written once, from the first part that has it.
+bool write_snapshot(const string &path, const vector<const vector<uint8_t> *> &parts);
+
+/*
+    The snapshot the server started from, mapped read-only. Opening it
+    only checks the header; entries are read, and their pages faulted in,
+    by the lookups that find them, so a large snapshot costs nothing at
+    startup and the names nobody asks for again are never read at all.
+    Entries that expired in the meantime are passed over. The mapping is
+    never written, so every worker reads it without locks.
+*/
+class CacheSnapshot
+{
+    void *mapping_ = nullptr;
+    size_t size_ = 0;
+    const SnapshotHeader *header_ = nullptr;
+    const SnapshotSlot *index_ = nullptr;
+
+public:
+    ~CacheSnapshot();
+
+    bool open(const string &path);
+
+    // A hit appends the records to answers, with its times on the steady
+    // clock, as SharedCache::lookup does
+    bool lookup(string_view key, uint64_t hash, MessageView &view, RecordSet &answers, SharedEntry &entry,
+                chrono::seconds keep) const;
+
+    bool enabled() const { return header_ != nullptr; }
+    size_t entries() const { return enabled() ? header_->entry_count : 0; }
+};
+
+// Seconds since the Unix epoch of a point on the steady clock, and back
+int64_t to_unix_seconds(chrono::steady_clock::time_point time);
+chrono::steady_clock::time_point from_unix_seconds(int64_t seconds);
@@ -0,0 +1,105 @@
+#include "tcp.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+
+#include "wire.h"
+
+using namespace std;
+
+void TcpConnection::reset(int fd_, const sockaddr_in &address_, bool upstream_)
+{
+    fd = fd_;
+    address = address_;
+    upstream = upstream_;
+    eof = false;
+    active = false;
+    events = 0;
+    outstanding = 0;
+    query = 0;
+    in_start = 0;
+    in_length = 0;
+    out.clear();
+    out_sent = 0;
+};
+
+bool TcpConnection::receive()
+{
+    // The messages handed out so far have been dealt with, so their room can be reused
+    if (in_start > 0)
+    {
+        memmove(in.data(), in.data() + in_start, in_length - in_start);
+        in_length -= in_start;
+        in_start = 0;
+    }
+
+    // Room for a good chunk of the stream, and for all of the message that has started
+    size_t wanted = in_length + 4096;
+    if (in_length >= 2)
+        wanted = max(wanted, 2 + size_t(read16(in.data())));
+    if (in.size() < wanted)
+        in.resize(wanted);
+
+    while (true)
+    {
+        ssize_t received = recv(fd, in.data() + in_length, in.size() - in_length, MSG_DONTWAIT);
+        if (received > 0)
+        {
+            in_length += received;
+            return true;
+        }
+        if (received == -1 && errno == EINTR)
+            continue;
+        return received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+};
+
+bool TcpConnection::has_message() const
+{
+    return in_length - in_start >= 2 && in_length - in_start >= 2 + size_t(read16(in.data() + in_start));
+};
+
+const uint8_t *TcpConnection::next_message(size_t &length)
+{
+    if (!has_message())
+        return nullptr;
+    length = read16(in.data() + in_start);
+    const uint8_t *message = in.data() + in_start + 2;
+    in_start += 2 + length;
+    return message;
+};
+
+void TcpConnection::queue(const uint8_t *message, size_t length)
+{
+    if (out_sent == out.size())
+    {
+        out.clear();
+        out_sent = 0;
+    }
+    uint8_t prefix[2];
+    write16(prefix, length);
+    out.insert(out.end(), prefix, prefix + 2);
+    out.insert(out.end(), message, message + length);
+};
+
+bool TcpConnection::flush()
+{
+    while (backlog() > 0)
+    {
+        // MSG_NOSIGNAL: a client that has gone away must not take the process down with SIGPIPE
+        ssize_t sent = send(fd, out.data() + out_sent, backlog(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            out_sent += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        return sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    out.clear();
+    out_sent = 0;
+    return true;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+
+using namespace std;
+
+const int tcp_idle_timeout_ms = 10000;       // a client connection with nothing going on is closed after this
+const size_t max_tcp_connections = 256;      // per worker; more are turned away until some close
+const size_t max_tcp_pipeline = 64;          // queries of one connection being answered at a time
+const size_t max_tcp_backlog = 256 * 1024;   // unsent reply octets before a connection stops being read
+
+/*
+    One TCP connection of a worker, in the same epoll loop as its UDP
+    sockets. Every message on the stream is preceded by its length in two
+    octets (RFC 1035 4.2.2).
+
+    A client may send several queries without waiting for the replies
+    (RFC 7766 6.2.1.1). They are all taken in and answered as each one
+    completes, under its own ID, so a slow upstream answer does not hold
+    up the cached ones behind it. A client that sends faster than it
+    reads is no longer read from once max_tcp_pipeline of its queries are
+    outstanding, or max_tcp_backlog octets of replies are waiting for it.
+
+    The worker also opens connections of its own, upstream, to ask again
+    a question whose UDP answer came back truncated; those carry a single
+    query and are closed once it is answered.
+
+    Connections come from a per-worker pool, and keep their buffers for
+    the next one.
+*/
+struct TcpConnection
+{
+    typedef chrono::steady_clock clock;
+
+    int fd = -1;
+    sockaddr_in address;
+    bool upstream = false; // ours, not a client's
+    bool eof = false;      // the peer has sent all it will; what is due to it still goes out
+    bool active = false;   // in the worker's list of connections to look after this round
+    uint32_t events = 0;   // what epoll is watching for
+    size_t outstanding = 0; // client queries in progress
+    uint64_t query = 0;     // ours: the PendingQuery it asks again
+    clock::time_point idle_deadline;
+
+    vector<uint8_t> in; // received, from in_start to in_length
+    size_t in_start = 0;
+    size_t in_length = 0;
+    vector<uint8_t> out; // queued, from out_sent to the end
+    size_t out_sent = 0;
+
+    void reset(int fd, const sockaddr_in &address, bool upstream);
+
+    // Reads what the socket has; false once the peer has closed its end or the connection failed
+    bool receive();
+    // The next complete message, or nullptr. It stays put until the next receive().
+    const uint8_t *next_message(size_t &length);
+    bool has_message() const;
+
+    // Queues one message, with its length in front
+    void queue(const uint8_t *message, size_t length);
+    // Writes as much of the queue as the socket takes; false if the connection failed
+    bool flush();
+    size_t backlog() const { return out.size() - out_sent; }
+
+    // A client connection that is not worth reading from until it catches up
+    bool paused() const { return outstanding >= max_tcp_pipeline || backlog() > max_tcp_backlog; }
+};
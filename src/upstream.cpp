@@ -0,0 +1,218 @@
+#include "upstream.h"
+
+using namespace std;
+
+PendingTable::PendingTable() : random(random_device{}()) {};
+
+uint64_t PendingTable::make_key(uint16_t id, const sockaddr_in &upstream)
+{
+    return (static_cast<uint64_t>(upstream.sin_addr.s_addr) << 32) |
+           (static_cast<uint64_t>(upstream.sin_port) << 16) | id;
+};
+
+void PendingTable::reserve(size_t count)
+{
+    queries.reserve(count);
+    index.reserve(count);
+    waiters.reserve(count);
+    questions.reserve(count);
+    in_flight.reserve(4);
+    timers.reserve(count * 2);
+};
+
+bool PendingTable::allocate_id(const sockaddr_in &upstream, uint16_t &id)
+{
+    // Random IDs make blind spoofing of upstream replies harder than
+    // sequential ones. With at most a quarter of them taken, a draw is
+    // free three times in four, so running out of draws means the table
+    // is in a bad way, not unlucky.
+    if (in_flight.find(make_key(0, upstream)) >= max_upstream_in_flight)
+        return false;
+    for (int draw = 0; draw < max_id_draws; draw++)
+    {
+        id = random() & 0xFFFF;
+        if (index.find(make_key(id, upstream)) == 0)
+            return true;
+    }
+    return false;
+};
+
+PendingQuery &PendingTable::insert(uint16_t id, const sockaddr_in &upstream)
+{
+    PendingQuery &query = insert();
+    query.id = id;
+    add_target(query, upstream);
+    return query;
+};
+
+PendingQuery &PendingTable::insert()
+{
+    uint64_t handle = queries.acquire();
+    PendingQuery &query = *queries.get(handle);
+    query.handle = handle;
+    query.target_count = 0;
+    query.attempts = 0;
+    query.hedged = false;
+    query.waiters = 0;
+    query.tracked = false;
+    query.edns = true;
+    query.tcp = 0;
+    query.packet.clear();
+    query.truncated.clear();
+    query.iterative = false;
+    query.parent = 0;
+    query.lookup = 0;
+    query.deadline = clock::time_point::max();
+    return query;
+};
+
+bool PendingTable::retarget(PendingQuery &query, const sockaddr_in &upstream)
+{
+    // A late reply from an upstream asked before no longer matches anything
+    unlink_targets(query);
+    return allocate_id(upstream, query.id) && add_target(query, upstream) != nullptr;
+};
+
+QueryTarget *PendingTable::add_target(PendingQuery &query, const sockaddr_in &upstream)
+{
+    uint64_t upstream_key = make_key(0, upstream);
+    uint64_t count = in_flight.find(upstream_key);
+    if (query.target_count == max_query_targets || count >= max_upstream_in_flight ||
+        index.find(make_key(query.id, upstream)) != 0)
+        return nullptr;
+    index.insert(make_key(query.id, upstream), query.handle);
+    in_flight.insert(upstream_key, count + 1);
+    QueryTarget &target = query.targets[query.target_count++];
+    target = QueryTarget{};
+    target.address = upstream;
+    return &target;
+};
+
+PendingQuery *PendingTable::find(uint16_t id, const sockaddr_in &upstream)
+{
+    uint64_t handle = index.find(make_key(id, upstream));
+    if (handle == 0)
+        return nullptr;
+    return queries.get(handle);
+};
+
+void PendingTable::erase(PendingQuery &query)
+{
+    // Its timers stay in the heap and are skipped as stale once they surface
+    unlink_targets(query);
+    if (query.tracked)
+        questions.erase(query.question_key);
+
+    uint64_t chain = detach_waiters(query), client;
+    size_t question;
+    while (next_waiter(chain, client, question))
+        ;
+    queries.release(query.handle);
+};
+
+void PendingTable::park(PendingQuery &query)
+{
+    unlink_targets(query);
+    unschedule(query);
+};
+
+void PendingTable::unlink_targets(PendingQuery &query)
+{
+    for (size_t i = 0; i < query.target_count; i++)
+    {
+        const sockaddr_in &upstream = query.targets[i].address;
+        index.erase(make_key(query.id, upstream));
+        uint64_t upstream_key = make_key(0, upstream);
+        uint64_t count = in_flight.find(upstream_key);
+        if (count > 1)
+            in_flight.insert(upstream_key, count - 1);
+        else
+            in_flight.erase(upstream_key);
+    }
+    query.target_count = 0;
+};
+
+PendingQuery *PendingTable::find_question(uint64_t key)
+{
+    uint64_t handle = questions.find(key);
+    if (handle == 0)
+        return nullptr;
+    return queries.get(handle);
+};
+
+void PendingTable::track_question(PendingQuery &query, uint64_t key)
+{
+    // On a hash collision the question already in flight keeps the key
+    if (questions.find(key) != 0)
+        return;
+    questions.insert(key, query.handle);
+    query.question_key = key;
+    query.tracked = true;
+};
+
+void PendingTable::add_waiter(PendingQuery &query, uint64_t client, size_t question)
+{
+    uint64_t handle = waiters.acquire();
+    *waiters.get(handle) = Waiter{client, question, query.waiters};
+    query.waiters = handle;
+};
+
+uint64_t PendingTable::detach_waiters(PendingQuery &query)
+{
+    uint64_t chain = query.waiters;
+    query.waiters = 0;
+    return chain;
+};
+
+bool PendingTable::next_waiter(uint64_t &chain, uint64_t &client, size_t &question)
+{
+    Waiter *waiter = waiters.get(chain);
+    if (waiter == nullptr)
+        return false;
+    client = waiter->client;
+    question = waiter->question;
+    uint64_t handle = chain;
+    chain = waiter->next;
+    waiters.release(handle);
+    return true;
+};
+
+void PendingTable::schedule(PendingQuery &query, clock::time_point deadline)
+{
+    query.deadline = deadline;
+    timers.push(deadline, query.handle);
+};
+
+bool PendingTable::stale(const DeadlineHeap::Entry &timer)
+{
+    // The query is gone, or has been rescheduled since this timer was set
+    PendingQuery *query = queries.get(timer.handle);
+    return query == nullptr || query->deadline != timer.deadline;
+};
+
+void PendingTable::drop_stale_timers()
+{
+    while (!timers.empty() && stale(timers.top()))
+        timers.pop();
+};
+
+PendingQuery *PendingTable::next_expired(clock::time_point now)
+{
+    // The caller either reschedules or erases the query it gets back
+    drop_stale_timers();
+    if (timers.empty() || timers.top().deadline > now)
+        return nullptr;
+    PendingQuery *query = queries.get(timers.top().handle);
+    timers.pop();
+    query->deadline = clock::time_point::max(); // not scheduled until the caller says so
+    return query;
+};
+
+int PendingTable::next_timeout(clock::time_point now)
+{
+    // Milliseconds until the next deadline, -1 (wait forever) if there is none
+    drop_stale_timers();
+    if (timers.empty())
+        return -1;
+    return DeadlineHeap::milliseconds_until(timers.top().deadline, now);
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <vector>
+#include <netinet/in.h>
+
+#include "message.h"
+#include "pool.h"
+#include "wire.h"
+
+using namespace std;
+
+const int default_timeout_ms = 800; // first retransmit after this long, doubling on every retry
+const int default_retries = 2;      // retransmits before a query is given up on
+const int default_deadline_ms = 3000; // a client gets its reply by then, complete or not
+const size_t max_query_targets = 4; // upstreams one query may be sent to: the first, hedges, retries, probes
+const size_t max_upstream_in_flight = 16384; // queries one worker has out at one upstream, a quarter of the ID space
+const int max_id_draws = 32;                 // random IDs tried before giving up on finding a free one
+
+inline bool same_address(const sockaddr_in &a, const sockaddr_in &b)
+{
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+/*
+    A client request that is waiting on the upstream. All of its questions
+    are sent at once, and their answers are gathered per question as they
+    come back, in whatever order, then put together in question order for
+    the reply. Clients come from a per-worker pool, and reset() keeps the
+    capacity of the vectors for the next client.
+*/
+struct PendingClient
+{
+    typedef chrono::steady_clock clock;
+
+    DNSMessage request;
+    RecordSet answers[max_questions];
+    sockaddr_in address;
+    uint64_t connection = 0; // the TCP connection the request came in on, 0 for UDP
+    EdnsInfo edns;           // what the reply may look like
+    size_t outstanding = 0; // questions still waiting on the upstream
+    uint16_t rcode = 0;     // set when the upstream failed us
+    bool cached = true;     // every question was answered from the cache
+    clock::time_point received; // when the request came in, for the query log
+    clock::time_point deadline;
+
+    void reset()
+    {
+        request.questions.clear();
+        request.answers.clear();
+        for (auto &question_answers : answers)
+            question_answers.clear();
+        outstanding = 0;
+        rcode = 0;
+        cached = true;
+    }
+};
+
+// One upstream a query has been sent to
+struct QueryTarget
+{
+    sockaddr_in address;
+    chrono::steady_clock::time_point sent; // the last time it went there
+    uint8_t sends = 0;      // more than one makes its round trip time ambiguous
+    bool timed_out = false; // already blamed for the current round
+    bool hedge = false;     // sent early, because the first upstream was slow
+    bool probe = false;     // sent to a dead upstream, to see whether it is back
+};
+
+/*
+    One question forwarded upstream. The query goes out with a freshly
+    picked transaction ID, and a reply is only accepted if it comes back
+    with that ID from one of the upstream addresses and ports the query
+    was sent to. The first such reply answers it.
+
+    A question resolved iteratively (see recursion.h) is one query too,
+    through every step from the root down: each step asks step_name of a
+    server of zone, under a new ID, until one gives the answer. A query
+    with a parent looks up the address of a name server the parent needs.
+*/
+struct PendingQuery
+{
+    typedef chrono::steady_clock clock;
+
+    uint64_t handle; // this query's own handle in the table
+    uint16_t id;     // the rewritten transaction ID sent upstream
+    QueryTarget targets[max_query_targets];
+    size_t target_count = 0;
+    uint64_t client; // the PendingClient waiting for the answer
+    size_t question; // which of its questions this answers
+    uint64_t waiters = 0; // more clients asking the same question, see PendingTable
+    bool tracked = false; // in the table's question index
+    uint64_t question_key;
+    WireName qname;
+    uint16_t qtype;
+    uint16_t qclass;
+    vector<char> packet; // the serialized query, kept for retransmits
+    bool edns = true;    // the packet carries an OPT record; dropped for upstreams that choke on it
+    uint64_t tcp = 0;    // the connection asking again over TCP, the UDP answer was truncated
+    vector<uint8_t> truncated; // that UDP answer, which is all there is if TCP fails
+    int attempts = 0;    // rounds sent, hedges and probes not included
+    int timeout_ms = default_timeout_ms;
+    bool hedged = false;
+    clock::time_point retry_at; // when the current round is given up on
+    clock::time_point give_up;  // the first client's deadline: no round runs past it
+    clock::time_point deadline; // the next timer, a hedge or retry_at
+
+    bool iterative = false;
+    WireName step_name;          // the name asked at this step: qname, or where its CNAMEs led
+    WireName zone;               // the zone whose servers are being asked
+    RecordSet chain;             // CNAMEs followed so far, to go in front of the answer
+    vector<sockaddr_in> servers; // of the zone
+    vector<WireName> server_names; // of the zone, without an address yet
+    size_t next_server = 0;      // sends so far at this step; picks the server, round robin
+    int steps = 0;
+    int depth = 0;               // how many address lookups this one is inside
+    uint64_t parent = 0;
+    uint64_t lookup = 0;         // the address lookup this one is parked for, 0 if none
+
+    const WireName &asked() const { return iterative ? step_name : qname; }
+
+    QueryTarget *target(const sockaddr_in &address)
+    {
+        for (size_t i = 0; i < target_count; i++)
+            if (same_address(targets[i].address, address))
+                return &targets[i];
+        return nullptr;
+    }
+
+    bool sent_to(const sockaddr_in &address) const
+    {
+        for (size_t i = 0; i < target_count; i++)
+            if (same_address(targets[i].address, address))
+                return true;
+        return false;
+    }
+};
+
+/*
+    Outstanding upstream queries, keyed by (transaction ID, upstream address,
+    upstream port). Our side of the 5-tuple is fixed by the upstream socket.
+    A query sent to several upstreams has one key for each of them.
+
+    Queries are also indexed by question (a hash of qname, qtype and
+    qclass), so that clients asking a question that is already on its way
+    upstream wait for that answer instead of sending another query. Those
+    clients hang off the query as a chain of pooled waiters.
+
+    Queries live in a pool and are found through an open-addressing index,
+    and deadlines sit in a binary heap, so that the event loop can sleep
+    exactly until the next one is due. Rescheduled or erased queries leave
+    their old heap entries behind; those are recognised and skipped when
+    they come up. None of this allocates once the worker is warmed up.
+*/
+class PendingTable
+{
+public:
+    typedef chrono::steady_clock clock;
+
+private:
+    struct Waiter
+    {
+        uint64_t client;
+        size_t question;
+        uint64_t next; // handle of the next waiter, 0 at the end
+    };
+
+    Pool<PendingQuery> queries;
+    FlatMap index;
+    Pool<Waiter> waiters;
+    FlatMap questions; // question key -> query handle
+    FlatMap in_flight; // upstream address and port -> queries sent there, for those with any
+    DeadlineHeap timers;
+    mt19937 random;
+
+    static uint64_t make_key(uint16_t id, const sockaddr_in &upstream);
+    bool stale(const DeadlineHeap::Entry &timer);
+    void unlink_targets(PendingQuery &query);
+    void drop_stale_timers();
+
+public:
+    PendingTable();
+
+    void reserve(size_t count);
+    // A random ID that is free at the upstream; false if the upstream has
+    // max_upstream_in_flight queries out already, or no free ID turned up
+    bool allocate_id(const sockaddr_in &upstream, uint16_t &id);
+    // A pooled query with the given ID and first upstream; the caller fills in the rest
+    PendingQuery &insert(uint16_t id, const sockaddr_in &upstream);
+    // Another upstream for the query; nullptr if its ID is taken there, the
+    // upstream is at max_upstream_in_flight, or the query has no room
+    QueryTarget *add_target(PendingQuery &query, const sockaddr_in &upstream);
+    // A pooled query with no upstream yet, for retarget
+    PendingQuery &insert();
+    // Sends the query to another upstream, instead of the ones so far, under
+    // a new ID; false if allocate_id finds none, leaving it with no upstream
+    bool retarget(PendingQuery &query, const sockaddr_in &upstream);
+    PendingQuery *find(uint16_t id, const sockaddr_in &upstream);
+    PendingQuery *get(uint64_t handle) { return queries.get(handle); }
+    void erase(PendingQuery &query);
+
+    // The query already asking the question with this key, if any. Keys
+    // are hashes, so the caller checks that the question really matches.
+    PendingQuery *find_question(uint64_t key);
+    void track_question(PendingQuery &query, uint64_t key);
+    void add_waiter(PendingQuery &query, uint64_t client, size_t question);
+    // Hands the query's waiters over to the caller, who walks them with next_waiter
+    uint64_t detach_waiters(PendingQuery &query);
+    // Takes the first waiter off a detached chain; false at the end
+    bool next_waiter(uint64_t &chain, uint64_t &client, size_t &question);
+
+    void schedule(PendingQuery &query, clock::time_point deadline);
+    // Until the next schedule, no timer goes off for the query
+    void unschedule(PendingQuery &query) { query.deadline = clock::time_point::max(); }
+    // Until it is retargeted, neither a timer nor a late reply reaches the query
+    void park(PendingQuery &query);
+    PendingQuery *next_expired(clock::time_point now);
+    int next_timeout(clock::time_point now);
+
+    size_t size() const { return queries.size(); }
+};
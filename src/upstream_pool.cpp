@@ -0,0 +1,140 @@
+#include "upstream_pool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void UpstreamPool::sync(const vector<sockaddr_in> &addresses, uint64_t generation)
+{
+    if (generation == generation_)
+        return;
+    generation_ = generation;
+
+    vector<Upstream> next;
+    next.reserve(addresses.size());
+    for (const sockaddr_in &address : addresses)
+    {
+        Upstream *known = find(address);
+        if (known != nullptr)
+            next.push_back(*known);
+        else
+        {
+            next.emplace_back();
+            next.back().address = address;
+        }
+    }
+    upstreams_ = std::move(next);
+};
+
+Upstream *UpstreamPool::find(const sockaddr_in &address)
+{
+    for (Upstream &upstream : upstreams_)
+        if (same_address(upstream.address, address))
+            return &upstream;
+    return nullptr;
+};
+
+Upstream *UpstreamPool::select(const PendingQuery *query)
+{
+    Upstream *best = nullptr;
+    for (Upstream &upstream : upstreams_)
+    {
+        if (upstream.dead || (query != nullptr && query->sent_to(upstream.address)))
+            continue;
+        if (best == nullptr || upstream.srtt_us < best->srtt_us)
+            best = &upstream;
+    }
+
+    if (best == nullptr)
+    {
+        if (query != nullptr || upstreams_.empty())
+            return nullptr;
+        // Everything is dead. The query still has to go somewhere.
+        best = &upstreams_.front();
+        for (Upstream &upstream : upstreams_)
+            if (upstream.next_probe < best->next_probe)
+                best = &upstream;
+        return best;
+    }
+
+    // Those passed over look a little faster every time, until one gets another chance
+    for (Upstream &upstream : upstreams_)
+        if (&upstream != best && !upstream.dead)
+            upstream.srtt_us -= upstream.srtt_us >> 7;
+    return best;
+};
+
+Upstream *UpstreamPool::probe_due(clock::time_point now)
+{
+    for (Upstream &upstream : upstreams_)
+    {
+        if (!upstream.dead || upstream.next_probe > now)
+            continue;
+        upstream.next_probe = now + chrono::milliseconds(upstream.probe_ms);
+        upstream.probe_ms = min(upstream.probe_ms * 2, max_probe_ms);
+        upstream.probes++;
+        return &upstream;
+    }
+    return nullptr;
+};
+
+void UpstreamPool::add_sample(Upstream &upstream, uint32_t rtt_us)
+{
+    if (upstream.srtt_us == 0)
+    {
+        upstream.srtt_us = rtt_us;
+        upstream.rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        uint32_t delta = rtt_us > upstream.srtt_us ? rtt_us - upstream.srtt_us : upstream.srtt_us - rtt_us;
+        upstream.rttvar_us = (3 * uint64_t(upstream.rttvar_us) + delta) / 4;
+        upstream.srtt_us = (7 * uint64_t(upstream.srtt_us) + rtt_us) / 8;
+    }
+
+    upstream.samples[upstream.sample_total % rtt_sample_count] = rtt_us;
+    upstream.sample_total++;
+
+    // The percentile is worked out again every few samples, on a copy
+    if (hedge_percentile_ == 0 || upstream.sample_total < 8 || upstream.sample_total % 8 != 0)
+        return;
+    uint32_t sorted[rtt_sample_count];
+    size_t count = min(upstream.sample_total, rtt_sample_count);
+    copy(upstream.samples, upstream.samples + count, sorted);
+    size_t rank = min(count - 1, count * hedge_percentile_ / 100);
+    nth_element(sorted, sorted + rank, sorted + count);
+    upstream.hedge_delay_us = max(sorted[rank], min_hedge_delay_us);
+};
+
+bool UpstreamPool::answered(Upstream &upstream, clock::time_point now, uint32_t rtt_us, bool sample)
+{
+    upstream.answered++;
+    upstream.failures = 0;
+    upstream.last_answer = now;
+
+    bool revived = upstream.dead;
+    if (revived)
+    {
+        // What it earned while it was down says nothing about it now
+        upstream.dead = false;
+        upstream.probe_ms = first_probe_ms;
+        upstream.srtt_us = 0;
+    }
+    if (sample)
+        add_sample(upstream, rtt_us);
+    return revived;
+};
+
+bool UpstreamPool::timed_out(Upstream &upstream, clock::time_point now, uint32_t timeout_us)
+{
+    // A round that went unanswered counts as a sample as long as the whole timeout
+    upstream.timeouts++;
+    upstream.srtt_us = (7 * uint64_t(upstream.srtt_us) + timeout_us) / 8;
+
+    // A busy upstream drops a few queries now and then; a dead one answers nothing at all
+    if (upstream.dead || ++upstream.failures < dead_after_failures || now - upstream.last_answer < chrono::microseconds(timeout_us))
+        return false;
+    upstream.dead = true;
+    upstream.next_probe = now + chrono::milliseconds(upstream.probe_ms);
+    return true;
+};
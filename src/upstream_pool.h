@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+
+#include "upstream.h"
+
+using namespace std;
+
+const int dead_after_failures = 3;      // rounds in a row without an answer
+const int first_probe_ms = 500;         // a dead upstream is probed this soon...
+const int max_probe_ms = 30000;         // ...then ever less often, down to this
+const size_t rtt_sample_count = 64;     // recent round trips the hedge deadline is taken from
+const uint32_t min_hedge_delay_us = 2000;
+
+/*
+    What one worker knows about one upstream resolver. Round trip times are
+    in microseconds. srtt and rttvar are smoothed as in RFC 6298; the last
+    rtt_sample_count samples are kept as they are, for the percentile that
+    decides when a slow query is hedged.
+*/
+struct Upstream
+{
+    typedef chrono::steady_clock clock;
+
+    sockaddr_in address;
+    uint32_t srtt_us = 0; // 0 until the first answer, so new upstreams are tried first
+    uint32_t rttvar_us = 0;
+    uint32_t samples[rtt_sample_count];
+    size_t sample_total = 0;
+    uint32_t hedge_delay_us = 0; // the configured percentile of samples, 0 if too few
+    int failures = 0;            // rounds in a row it let pass without answering
+    clock::time_point last_answer;
+    bool dead = false;
+    int probe_ms = first_probe_ms;
+    clock::time_point next_probe;
+
+    uint64_t sent = 0;
+    uint64_t answered = 0;
+    uint64_t timeouts = 0;
+    uint64_t hedges = 0;     // queries it got as the second choice
+    uint64_t hedge_wins = 0; // of those, the ones it answered first
+    uint64_t probes = 0;
+};
+
+/*
+    The upstream resolvers as one worker sees them. Each query goes to the
+    healthy upstream with the lowest smoothed round trip time. Upstreams
+    that are not chosen have their estimate decayed a little every time, so
+    that one which was slow once gets retried eventually and can prove it
+    has recovered.
+
+    An upstream that lets dead_after_failures rounds pass, and has not
+    answered anything for as long as a round lasts, is taken out of
+    rotation. From then on it only gets copies of real queries as probes,
+    at growing intervals, and it is back in rotation as soon as it answers
+    one of them.
+
+    Every worker keeps its own pool, so none of this is shared between
+    threads. The list of upstreams comes from the current Dataset, and
+    what is known about an upstream survives reloads that keep it.
+*/
+class UpstreamPool
+{
+    vector<Upstream> upstreams_;
+    uint64_t generation_ = 0;
+    int hedge_percentile_ = 0;
+
+    void add_sample(Upstream &upstream, uint32_t rtt_us);
+
+public:
+    typedef chrono::steady_clock clock;
+
+    // 0 turns hedging off
+    void set_hedge_percentile(int percentile) { hedge_percentile_ = percentile; }
+    int hedge_percentile() const { return hedge_percentile_; }
+
+    // Follows the resolver list of the dataset with this generation
+    void sync(const vector<sockaddr_in> &addresses, uint64_t generation);
+
+    Upstream *find(const sockaddr_in &address);
+    // The fastest healthy upstream the query has not been sent to yet, or
+    // nullptr if there is none. With no query, the fastest healthy one, or
+    // the least recently failed one if they are all dead.
+    Upstream *select(const PendingQuery *query = nullptr);
+    // A dead upstream whose next probe is due, if any; the probe counts as done
+    Upstream *probe_due(clock::time_point now);
+
+    // True if the upstream was dead until now
+    bool answered(Upstream &upstream, clock::time_point now, uint32_t rtt_us, bool sample);
+    // True if the upstream has just been declared dead
+    bool timed_out(Upstream &upstream, clock::time_point now, uint32_t timeout_us);
+
+    const vector<Upstream> &upstreams() const { return upstreams_; }
+};
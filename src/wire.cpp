@@ -0,0 +1,524 @@
+#include "wire.h"
+
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+// Every name has at most 127 labels, so this is plenty for any legal chain of pointers
+const int max_pointer_hops = 128;
+
+static inline uint8_t lower(uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/*
+    Steps to the next label of a validated name: follows any compression
+    pointers at pos and leaves pos on a length octet. Returns that octet,
+    0 at the end of the name.
+*/
+static inline uint8_t next_label(const uint8_t *packet, size_t &pos)
+{
+    int hops = 0;
+    while ((packet[pos] & 0xC0) == 0xC0 && hops++ < max_pointer_hops)
+        pos = ((packet[pos] & 0x3F) << 8) | packet[pos + 1];
+    return packet[pos];
+}
+
+size_t NameView::length() const
+{
+    size_t pos = offset, total = 1;
+    uint8_t len;
+    while ((len = next_label(packet, pos)) != 0)
+    {
+        total += len + 1;
+        pos += len + 1;
+    }
+    return total;
+};
+
+size_t NameView::copy_to(uint8_t *out, bool lowercase) const
+{
+    size_t pos = offset, total = 0;
+    uint8_t len;
+    while ((len = next_label(packet, pos)) != 0)
+    {
+        out[total++] = len;
+        for (size_t i = 1; i <= len; i++)
+            out[total++] = lowercase ? lower(packet[pos + i]) : packet[pos + i];
+        pos += len + 1;
+    }
+    out[total++] = 0;
+    return total;
+};
+
+bool NameView::equals(const NameView &other) const
+{
+    size_t a = offset, b = other.offset;
+    while (true)
+    {
+        uint8_t len = next_label(packet, a);
+        if (len != next_label(other.packet, b))
+            return false;
+        if (len == 0)
+            return true;
+        for (size_t i = 1; i <= len; i++)
+            if (lower(packet[a + i]) != lower(other.packet[b + i]))
+                return false;
+        a += len + 1;
+        b += len + 1;
+    }
+};
+
+bool NameView::equals(const uint8_t *wire) const
+{
+    size_t pos = offset, w = 0;
+    while (true)
+    {
+        uint8_t len = next_label(packet, pos);
+        if (len != wire[w])
+            return false;
+        if (len == 0)
+            return true;
+        for (size_t i = 1; i <= len; i++)
+            if (lower(packet[pos + i]) != lower(wire[w + i]))
+                return false;
+        pos += len + 1;
+        w += len + 1;
+    }
+};
+
+string NameView::to_string() const
+{
+    uint8_t wire[max_name_length];
+    copy_to(wire);
+    return name_to_string(wire);
+};
+
+bool rdata_names(uint16_t type, RdataNames &names)
+{
+    switch (type)
+    {
+    case TYPE_NS:
+    case TYPE_MD:
+    case TYPE_MF:
+    case TYPE_CNAME:
+    case TYPE_MB:
+    case TYPE_MG:
+    case TYPE_MR:
+    case TYPE_PTR:
+        names = RdataNames{0, 1, true};
+        return true;
+    case TYPE_SOA:
+    case TYPE_MINFO:
+        names = RdataNames{0, 2, true};
+        return true;
+    case TYPE_MX:
+        names = RdataNames{2, 1, true};
+        return true;
+    case TYPE_RP:
+        names = RdataNames{0, 2, false};
+        return true;
+    case TYPE_AFSDB:
+    case TYPE_RT:
+        names = RdataNames{2, 1, false};
+        return true;
+    case TYPE_SRV:
+        names = RdataNames{6, 1, false};
+        return true;
+    case TYPE_DNAME:
+        names = RdataNames{0, 1, false};
+        return true;
+    default:
+        return false;
+    }
+};
+
+bool MessageView::copy_rdata(const RRView &record, uint8_t *out, size_t &length) const
+{
+    const uint8_t *rdata = record.rdata();
+    size_t end = record.rdata_offset + record.rdlength;
+    RdataNames names;
+    if (!rdata_names(record.type, names))
+    {
+        memcpy(out, rdata, record.rdlength);
+        length = record.rdlength;
+        return true;
+    }
+    if (names.offset > record.rdlength)
+        return false;
+
+    memcpy(out, rdata, names.offset);
+    length = names.offset;
+    size_t pos = record.rdata_offset + names.offset;
+    for (int i = 0; i < names.count; i++)
+    {
+        NameView name;
+        if (!parse_name(pos, name) || pos > end)
+            return false;
+        length += name.copy_to(out + length);
+    }
+    memcpy(out + length, packet_ + pos, end - pos);
+    length += end - pos;
+    return true;
+};
+
+bool MessageView::parse_name(size_t &pos, NameView &name) const
+{
+    /*
+        Walk the name once to make sure it is sane, so that nobody has to
+        check again later. A compression pointer has to point backwards,
+        before the pointer itself, and the whole name may not be longer
+        than 255 octets; together with the hop limit this rules out loops.
+    */
+    name.packet = packet_;
+    name.packet_length = length_;
+    name.offset = pos;
+
+    size_t cursor = pos, total = 1, end = 0;
+    int hops = 0;
+    while (true)
+    {
+        if (cursor >= length_)
+            return false;
+        uint8_t len = packet_[cursor];
+        if ((len & 0xC0) == 0xC0)
+        {
+            if (cursor + 1 >= length_ || ++hops > max_pointer_hops)
+                return false;
+            size_t target = ((len & 0x3F) << 8) | packet_[cursor + 1];
+            if (target >= cursor)
+                return false;
+            if (end == 0)
+                end = cursor + 2; // the name ends at its first pointer
+            cursor = target;
+            continue;
+        }
+        if ((len & 0xC0) != 0)
+            return false; // the 0x40 and 0x80 label types are obsolete or unassigned
+        if (len == 0)
+        {
+            if (end == 0)
+                end = cursor + 1;
+            break;
+        }
+        total += len + 1;
+        if (total > max_name_length || cursor + 1 + len > length_)
+            return false;
+        cursor += len + 1;
+    }
+    pos = end;
+    return true;
+};
+
+bool MessageView::parse(const uint8_t *packet, size_t length, bool includeRecords)
+{
+    packet_ = packet;
+    length_ = length;
+    question_count_ = 0;
+    record_count_ = 0;
+    records_truncated_ = false;
+    edns_ = EdnsInfo();
+
+    if (length < 12)
+        return false;
+
+    header_.id = read16(packet);
+    header_.flags = read16(packet + 2);
+    header_.qdcount = read16(packet + 4);
+    header_.ancount = read16(packet + 6);
+    header_.nscount = read16(packet + 8);
+    header_.arcount = read16(packet + 10);
+
+    if (header_.qdcount > max_questions)
+        return false;
+
+    size_t pos = 12;
+    for (size_t i = 0; i < header_.qdcount; i++)
+    {
+        QuestionView &question = questions_[question_count_];
+        if (!parse_name(pos, question.name) || pos + 4 > length)
+            return false;
+        question.qtype = read16(packet + pos);
+        question.qclass = read16(packet + pos + 2);
+        pos += 4;
+        question_count_++;
+    }
+
+    if (!includeRecords)
+        return true;
+
+    const uint16_t counts[] = {header_.ancount, header_.nscount, header_.arcount};
+    for (int section = ANSWER_SECTION; section <= ADDITIONAL_SECTION; section++)
+    {
+        for (size_t i = 0; i < counts[section]; i++)
+        {
+            RRView record;
+            if (!parse_name(pos, record.name) || pos + 10 > length)
+                return false;
+            record.type = read16(packet + pos);
+            record.class_ = read16(packet + pos + 2);
+            record.ttl = read32(packet + pos + 4);
+            record.rdlength = read16(packet + pos + 8);
+            record.rdata_offset = pos + 10;
+            record.section = static_cast<Section>(section);
+            pos += 10 + record.rdlength;
+            if (pos > length)
+                return false;
+
+            // The OPT pseudo-record is about the message, not about a name (RFC 6891 6.1.2)
+            if (record.type == TYPE_OPT && section == ADDITIONAL_SECTION && !edns_.present && packet[record.name.offset] == 0)
+            {
+                edns_.present = true;
+                edns_.udp_size = max<uint16_t>(record.class_, classic_udp_size);
+                edns_.extended_rcode = record.ttl >> 24;
+                edns_.version = (record.ttl >> 16) & 0xFF;
+                edns_.dnssec_ok = record.ttl & 0x8000;
+            }
+
+            if (record_count_ == max_records)
+            {
+                records_truncated_ = true;
+                continue;
+            }
+            records_[record_count_++] = record;
+        }
+    }
+    return true;
+};
+
+bool same_name(const uint8_t *a, const uint8_t *b)
+{
+    size_t pos = 0;
+    while (true)
+    {
+        uint8_t len = a[pos];
+        if (len != b[pos])
+            return false;
+        if (len == 0)
+            return true;
+        for (size_t i = 1; i <= len; i++)
+            if (lower(a[pos + i]) != lower(b[pos + i]))
+                return false;
+        pos += len + 1;
+    }
+};
+
+size_t name_length(const uint8_t *wire)
+{
+    size_t pos = 0;
+    while (wire[pos] != 0)
+        pos += wire[pos] + 1;
+    return pos + 1;
+};
+
+string name_to_string(const uint8_t *wire)
+{
+    string dotted;
+    size_t pos = 0;
+    while (wire[pos] != 0)
+    {
+        dotted.append(reinterpret_cast<const char *>(wire + pos + 1), wire[pos]);
+        dotted += '.';
+        pos += wire[pos] + 1;
+    }
+    return dotted.empty() ? "." : dotted;
+};
+
+WireWriter::WireWriter(uint8_t *buffer, size_t capacity) : buffer_(buffer), capacity_(capacity) {};
+
+bool WireWriter::room(size_t n)
+{
+    if (overflowed_ || length_ + n > capacity_)
+    {
+        overflowed_ = true;
+        return false;
+    }
+    return true;
+};
+
+void WireWriter::header(const DNSHeader &header)
+{
+    u16(header.id);
+    u16(header.flags);
+    u16(header.qdcount);
+    u16(header.ancount);
+    u16(header.nscount);
+    u16(header.arcount);
+};
+
+void WireWriter::u16(uint16_t value)
+{
+    if (!room(2))
+        return;
+    write16(buffer_ + length_, value);
+    length_ += 2;
+};
+
+void WireWriter::u32(uint32_t value)
+{
+    if (!room(4))
+        return;
+    write32(buffer_ + length_, value);
+    length_ += 4;
+};
+
+void WireWriter::bytes(const uint8_t *data, size_t size)
+{
+    if (size == 0 || !room(size))
+        return;
+    memcpy(buffer_ + length_, data, size);
+    length_ += size;
+};
+
+size_t WireWriter::find_suffix(const uint8_t *wire) const
+{
+    // Offset of an earlier name equal to wire, 0 if there is none (0 is the header, never a name)
+    for (size_t i = 0; i < target_count_; i++)
+    {
+        NameView earlier{buffer_, length_, targets_[i]};
+        if (earlier.equals(wire))
+            return targets_[i];
+    }
+    return 0;
+};
+
+void WireWriter::name(const uint8_t *wire)
+{
+    size_t pos = 0;
+    while (wire[pos] != 0)
+    {
+        size_t target = find_suffix(wire + pos);
+        if (target != 0)
+        {
+            u16(0xC000 | target);
+            return;
+        }
+
+        // Pointers only have 14 bits, so names further in cannot be pointed at
+        if (length_ < 0x4000 && target_count_ < max_compression_targets)
+            targets_[target_count_++] = length_;
+        bytes(wire + pos, wire[pos] + 1);
+        if (overflowed_)
+            return;
+        pos += wire[pos] + 1;
+    }
+    bytes(wire + pos, 1);
+};
+
+void WireWriter::rdata(uint16_t type, const uint8_t *rdata, size_t length)
+{
+    size_t rdlength_at = placeholder16();
+    size_t start = length_;
+    RdataNames names;
+    if (!rdata_names(type, names) || !names.compressible)
+        bytes(rdata, length);
+    else
+    {
+        // The names were stored uncompressed, so they can be walked directly
+        size_t pos = names.offset;
+        bytes(rdata, pos);
+        for (int i = 0; i < names.count; i++)
+        {
+            name(rdata + pos);
+            pos += name_length(rdata + pos);
+        }
+        bytes(rdata + pos, length - pos);
+    }
+    patch16(rdlength_at, length_ - start);
+};
+
+void WireWriter::opt(uint16_t udp_size, uint16_t rcode, bool dnssec_ok)
+{
+    // The class carries the payload size and the TTL the extended RCODE, version 0 and flags
+    const uint8_t root = 0;
+    bytes(&root, 1);
+    u16(TYPE_OPT);
+    u16(udp_size);
+    u32((uint32_t(rcode >> 4) << 24) | (dnssec_ok ? 0x8000 : 0));
+    u16(0);
+};
+
+size_t WireWriter::placeholder16()
+{
+    size_t offset = length_;
+    u16(0);
+    return offset;
+};
+
+void WireWriter::patch16(size_t offset, uint16_t value)
+{
+    if (offset + 2 <= length_)
+        write16(buffer_ + offset, value);
+};
+
+void WireWriter::rollback(size_t length)
+{
+    // Forget the names that were written past the new end
+    length_ = length;
+    overflowed_ = false;
+    while (target_count_ > 0 && targets_[target_count_ - 1] >= length)
+        target_count_--;
+};
+
+void copy_records(const MessageView &message, RecordSet &records)
+{
+    // The OPT pseudo-record only concerns the hop it came over
+    for (size_t i = 0; i < message.record_count(); i++)
+    {
+        const RRView &record = message.record(i);
+        if (record.type == TYPE_OPT)
+            continue;
+
+        // The RDATA goes straight into the set, with the names in it uncompressed
+        size_t offset = records.data.size(), length;
+        records.data.resize(offset + record.rdlength + MessageView::max_rdata_growth);
+        if (!message.copy_rdata(record, records.data.data() + offset, length))
+        {
+            records.data.resize(offset);
+            continue;
+        }
+        records.data.resize(offset + length);
+
+        DNSAnswer &answer = records.records.emplace_back();
+        answer.name.length = record.name.copy_to(answer.name.bytes);
+        answer.type = record.type;
+        answer.class_ = record.class_;
+        answer.ttl = record.ttl;
+        answer.rdlength = length;
+        answer.rdata = offset;
+        answer.section = record.section;
+    }
+};
+
+bool write_records(WireWriter &writer, const RecordSet &records)
+{
+    for (int section = ANSWER_SECTION; section <= ADDITIONAL_SECTION; section++)
+    {
+        uint16_t count = 0;
+        for (auto &record : records.records)
+        {
+            if (record.section != section)
+                continue;
+            size_t record_start = writer.length();
+            writer.name(record.name.data());
+            writer.u16(record.type);
+            writer.u16(record.class_);
+            writer.u32(record.ttl);
+            writer.rdata(record.type, records.rdata(record), record.rdlength);
+
+            // Additional records are a courtesy: those that do not fit are left out, without TC (RFC 2181 9)
+            if (writer.overflowed() && section == ADDITIONAL_SECTION)
+            {
+                writer.rollback(record_start);
+                break;
+            }
+            count++;
+        }
+        if (writer.overflowed())
+            return false;
+        writer.patch16(6 + 2 * section, count);
+    }
+    return true;
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "message.h"
+
+using namespace std;
+
+const size_t max_label_length = 63;
+const size_t max_questions = 8;
+const size_t max_records = 256;
+const size_t max_compression_targets = 64; // names a WireWriter remembers for compression
+const size_t opt_record_size = 11;          // an OPT record without options: root name, 10 fixed octets
+
+inline uint16_t read16(const uint8_t *p)
+{
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+inline uint32_t read32(const uint8_t *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+inline void write16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+inline void write32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF;
+    p[3] = value & 0xFF;
+}
+
+enum Section : uint8_t
+{
+    ANSWER_SECTION,
+    AUTHORITY_SECTION,
+    ADDITIONAL_SECTION,
+};
+
+/*
+    Where the domain names sit in the RDATA of a type: offset fixed octets
+    first, then count names back to back, then whatever follows (the SOA's
+    counters). Only types with names in their RDATA are described; the
+    RDATA of any other type is copied as it is. Names of the types that
+    are not compressible may be compressed by a sender we read from, but
+    we never compress them ourselves (RFC 3597 4).
+*/
+struct RdataNames
+{
+    uint8_t offset;
+    uint8_t count;
+    bool compressible;
+};
+
+// False for types without names in their RDATA
+bool rdata_names(uint16_t type, RdataNames &names);
+
+/*
+    A domain name as it sits in a packet, possibly compressed. Nothing is
+    copied: the labels are walked in place, following compression pointers.
+    Names are only handed out by MessageView::parse, which has already
+    checked that every label and pointer stays inside the packet.
+*/
+struct NameView
+{
+    const uint8_t *packet = nullptr;
+    size_t packet_length = 0;
+    size_t offset = 0;
+
+    // Uncompressed length in wire format, including the root label
+    size_t length() const;
+    // Writes the uncompressed wire form to out, which must hold max_name_length bytes
+    size_t copy_to(uint8_t *out, bool lowercase = false) const;
+    // Case-insensitive comparisons
+    bool equals(const NameView &other) const;
+    bool equals(const uint8_t *wire) const;
+    // Dotted form, for logs only
+    string to_string() const;
+};
+
+struct QuestionView
+{
+    NameView name;
+    uint16_t qtype;
+    uint16_t qclass;
+};
+
+struct RRView
+{
+    NameView name;
+    uint16_t type;
+    uint16_t class_;
+    uint32_t ttl;
+    uint16_t rdlength;
+    size_t rdata_offset;
+    Section section;
+
+    const uint8_t *rdata() const { return name.packet + rdata_offset; }
+};
+
+/*
+    What a message said about its sender in its OPT record (RFC 6891): the
+    largest UDP reply it takes, the EDNS version it speaks, and the DO bit.
+    Without an OPT record, replies to it are limited to 512 octets and may
+    not carry an OPT record of their own.
+*/
+struct EdnsInfo
+{
+    bool present = false;
+    uint16_t udp_size = classic_udp_size; // never less than 512, as RFC 6891 6.2.5 asks
+    uint8_t version = 0;
+    uint8_t extended_rcode = 0; // the upper 8 bits of the RCODE, in replies
+    bool dnssec_ok = false;
+};
+
+/*
+    A parsed DNS message: the header plus views of every question and
+    resource record, all pointing into the receive buffer. The buffer has
+    to outlive the view. Parsing does not allocate, so a MessageView can be
+    reused for every packet.
+*/
+class MessageView
+{
+    const uint8_t *packet_ = nullptr;
+    size_t length_ = 0;
+    DNSHeader header_ = {};
+    QuestionView questions_[max_questions];
+    size_t question_count_ = 0;
+    RRView records_[max_records];
+    size_t record_count_ = 0;
+    bool records_truncated_ = false;
+    EdnsInfo edns_;
+
+    bool parse_name(size_t &pos, NameView &name) const;
+
+public:
+    // Octets copy_rdata may need: names can grow when their pointers are expanded
+    static const size_t max_rdata_growth = 2 * max_name_length;
+
+    // False if the packet is malformed: short, a name or record running
+    // past its end, a compression loop, or more questions than we take
+    bool parse(const uint8_t *packet, size_t length, bool includeRecords = true);
+
+    const uint8_t *packet() const { return packet_; }
+    size_t length() const { return length_; }
+    const DNSHeader &header() const { return header_; }
+
+    size_t question_count() const { return question_count_; }
+    const QuestionView &question(size_t i) const { return questions_[i]; }
+
+    size_t record_count() const { return record_count_; }
+    const RRView &record(size_t i) const { return records_[i]; }
+    // Set when the message had more records than max_records; only the first ones are kept
+    bool records_truncated() const { return records_truncated_; }
+    // From the first OPT record of the additional section, if records were parsed
+    const EdnsInfo &edns() const { return edns_; }
+
+    // Copies the RDATA of a record to out, which must hold rdlength +
+    // max_rdata_growth octets, with the names in it uncompressed so that
+    // it means the same outside this packet. False if the RDATA is malformed.
+    bool copy_rdata(const RRView &record, uint8_t *out, size_t &length) const;
+};
+
+/*
+    Encodes a message straight into an output buffer, in one pass and in
+    network byte order. Names are compressed (RFC 1035 4.1.4): every name
+    written is remembered, and a later name that ends in one of them is
+    written as its leading labels plus a pointer.
+
+    Running out of room sets overflowed() instead of writing past the end;
+    rollback() returns to an earlier length() so that the caller can drop
+    records that do not fit.
+*/
+class WireWriter
+{
+    uint8_t *buffer_;
+    size_t capacity_;
+    size_t length_ = 0;
+    bool overflowed_ = false;
+    uint16_t targets_[max_compression_targets]; // offsets of names and their suffixes
+    size_t target_count_ = 0;
+
+    bool room(size_t n);
+    size_t find_suffix(const uint8_t *wire) const;
+
+public:
+    WireWriter(uint8_t *buffer, size_t capacity);
+
+    // The header fields are in host order
+    void header(const DNSHeader &header);
+    void u16(uint16_t value);
+    void u32(uint32_t value);
+    void bytes(const uint8_t *data, size_t size);
+    void name(const uint8_t *wire);
+    // RDLENGTH and RDATA, with the names in RDATA compressed where that is allowed
+    void rdata(uint16_t type, const uint8_t *rdata, size_t length);
+    // An OPT record offering udp_size, with the upper RCODE bits and the DO bit
+    void opt(uint16_t udp_size, uint16_t rcode, bool dnssec_ok);
+
+    // Writes 0 and hands back its offset, for an RDLENGTH only known later
+    size_t placeholder16();
+    void patch16(size_t offset, uint16_t value);
+
+    size_t length() const { return length_; }
+    bool overflowed() const { return overflowed_; }
+    void rollback(size_t length);
+    // Moves the end of the buffer, which must stay within the real one: a
+    // record that has to come last (OPT) can have its room kept back
+    void set_capacity(size_t capacity) { capacity_ = capacity; }
+};
+
+// Appends every record of a message except OPT, with the names in its RDATA uncompressed
+void copy_records(const MessageView &message, RecordSet &records);
+// Writes the records grouped by section and patches the section counts
+// into the header. Additional records that do not fit are left out; false
+// if the answer or authority section does not fit.
+bool write_records(WireWriter &writer, const RecordSet &records);
+
+// The same comparison for two uncompressed wire names
+bool same_name(const uint8_t *a, const uint8_t *b);
+// Length of an uncompressed wire name, including the root label
+size_t name_length(const uint8_t *wire);
+// Dotted form of an uncompressed wire name, for logs only
+string name_to_string(const uint8_t *wire);
@@ -0,0 +1,437 @@
+#include "zone.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+uint32_t zone_hash(const uint8_t *wire)
+{
+    // FNV-1a over the lowercased name. The image stores these, so this must never change.
+    uint32_t hash = 2166136261u;
+    size_t pos = 0;
+    while (true)
+    {
+        uint8_t len = wire[pos];
+        hash = (hash ^ len) * 16777619u;
+        if (len == 0)
+            return hash;
+        for (size_t i = 1; i <= len; i++)
+        {
+            uint8_t c = wire[pos + i];
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            hash = (hash ^ c) * 16777619u;
+        }
+        pos += len + 1;
+    }
+};
+
+void ZoneAnswer::add(Section section, const uint8_t *owner, const ZoneRRset *rrset, uint32_t ttl)
+{
+    for (size_t i = 0; i < counts[section]; i++)
+        if (sections[section][i].rrset == rrset && sections[section][i].owner == owner)
+            return;
+    if (counts[section] < max_zone_rrsets)
+        sections[section][counts[section]++] = ZoneRecordSet{owner, rrset, ttl};
+};
+
+uint16_t ZoneAnswer::record_count(Section section) const
+{
+    uint16_t count = 0;
+    for (size_t i = 0; i < counts[section]; i++)
+        count += sections[section][i].rrset->count;
+    return count;
+};
+
+ZoneIndex::~ZoneIndex()
+{
+    close();
+};
+
+// Length of the uncompressed name at name if it ends within room octets, else 0
+static size_t name_within(const uint8_t *name, size_t room)
+{
+    size_t pos = 0;
+    while (pos < room && pos < max_name_length && name[pos] != 0)
+    {
+        if (name[pos] > 63)
+            return 0;
+        pos += 1 + name[pos];
+    }
+    return pos < room && pos < max_name_length ? pos + 1 : 0;
+};
+
+// True if the RRset at offset, and every record and RDATA name in it, lies within size octets
+static bool rrset_within(const uint8_t *rrsets, size_t size, uint64_t offset)
+{
+    if (offset % 4 != 0 || offset + sizeof(ZoneRRset) > size)
+        return false;
+    const ZoneRRset *rrset = reinterpret_cast<const ZoneRRset *>(rrsets + offset);
+    if (rrset->length > size - offset - sizeof(ZoneRRset))
+        return false;
+
+    RdataNames names;
+    bool named = rdata_names(rrset->type, names);
+    const uint8_t *record = rrset->records();
+    size_t left = rrset->length;
+    for (uint16_t i = 0; i < rrset->count; i++)
+    {
+        if (left < 2 || read16(record) > left - 2)
+            return false;
+        size_t rdlength = read16(record);
+        const uint8_t *rdata = record + 2;
+        size_t pos = named ? names.offset : 0;
+        for (int n = 0; named && n < names.count; n++)
+        {
+            size_t length = pos <= rdlength ? name_within(rdata + pos, rdlength - pos) : 0;
+            if (length == 0)
+                return false;
+            pos += length;
+        }
+        // The negative TTL is read from the last four octets of an SOA
+        if (rrset->type == TYPE_SOA && rdlength < pos + 20)
+            return false;
+        record += 2 + rdlength;
+        left -= 2 + rdlength;
+    }
+    return true;
+};
+
+bool ZoneIndex::valid(const uint8_t *base, size_t size)
+{
+    // Everything is checked up front, so that lookups and writes can trust
+    // every offset, count and length. A mapped image may come from anywhere,
+    // so every node, RRset, record and name inside one is walked.
+    if (size < sizeof(ZoneImageHeader))
+        return false;
+    const ZoneImageHeader *header = reinterpret_cast<const ZoneImageHeader *>(base);
+    if (memcmp(header->magic, zone_image_magic, sizeof(zone_image_magic)) != 0 ||
+        header->version != zone_image_version || header->size != size)
+        return false;
+    if (header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 ||
+        header->node_count >= header->slot_count ||
+        header->zones_offset + uint64_t(header->zone_count) * sizeof(ZoneEntry) > header->slots_offset ||
+        header->slots_offset + uint64_t(header->slot_count) * sizeof(ZoneSlot) > header->nodes_offset ||
+        header->nodes_offset + uint64_t(header->node_count) * sizeof(ZoneNode) > header->names_offset ||
+        header->names_offset > header->rrsets_offset || header->rrsets_offset > header->size ||
+        header->zones_offset % 8 || header->slots_offset % 8 || header->nodes_offset % 8 || header->rrsets_offset % 8)
+        return false;
+
+    size_t names_size = header->rrsets_offset - header->names_offset;
+    size_t rrsets_size = header->size - header->rrsets_offset;
+    const uint8_t *names = base + header->names_offset;
+    const uint8_t *rrsets = base + header->rrsets_offset;
+    const ZoneSlot *slots = reinterpret_cast<const ZoneSlot *>(base + header->slots_offset);
+    for (uint32_t i = 0; i < header->slot_count; i++)
+        if (slots[i].node > header->node_count)
+            return false;
+
+    // A delegation has to have its NS RRset, which a referral is made of
+    const ZoneNode *nodes = reinterpret_cast<const ZoneNode *>(base + header->nodes_offset);
+    for (uint32_t i = 0; i < header->node_count; i++)
+    {
+        const ZoneNode &node = nodes[i];
+        if (node.name >= names_size || name_within(names + node.name, names_size - node.name) == 0 ||
+            node.zone >= header->zone_count)
+            return false;
+        bool has_ns = false;
+        uint64_t offset = node.rrsets;
+        for (uint16_t j = 0; j < node.rrset_count; j++)
+        {
+            if (!rrset_within(rrsets, rrsets_size, offset))
+                return false;
+            const ZoneRRset *rrset = reinterpret_cast<const ZoneRRset *>(rrsets + offset);
+            has_ns |= rrset->type == TYPE_NS;
+            offset += zone_rrset_size(rrset->length);
+        }
+        if ((node.flags & NODE_DELEGATION) && !has_ns)
+            return false;
+    }
+
+    // Every zone's SOA is one of its apex's RRsets, all of them checked above
+    const ZoneEntry *zones = reinterpret_cast<const ZoneEntry *>(base + header->zones_offset);
+    for (uint32_t i = 0; i < header->zone_count; i++)
+    {
+        if (zones[i].apex >= header->node_count)
+            return false;
+        const ZoneNode &apex = nodes[zones[i].apex];
+        uint64_t offset = apex.rrsets;
+        bool found = false;
+        for (uint16_t j = 0; j < apex.rrset_count && !found; j++)
+        {
+            const ZoneRRset *rrset = reinterpret_cast<const ZoneRRset *>(rrsets + offset);
+            found = offset == zones[i].soa && rrset->type == TYPE_SOA && rrset->count > 0;
+            offset += zone_rrset_size(rrset->length);
+        }
+        if (!found)
+            return false;
+    }
+    return true;
+};
+
+void ZoneIndex::attach(const uint8_t *base)
+{
+    base_ = base;
+    header_ = reinterpret_cast<const ZoneImageHeader *>(base_);
+    zones_ = reinterpret_cast<const ZoneEntry *>(base_ + header_->zones_offset);
+    slots_ = reinterpret_cast<const ZoneSlot *>(base_ + header_->slots_offset);
+    nodes_ = reinterpret_cast<const ZoneNode *>(base_ + header_->nodes_offset);
+    names_ = base_ + header_->names_offset;
+    rrsets_ = base_ + header_->rrsets_offset;
+};
+
+void ZoneIndex::close()
+{
+    if (mapping_ != nullptr)
+        munmap(mapping_, mapping_size_);
+    mapping_ = nullptr;
+    mapping_size_ = 0;
+    storage_.clear();
+    base_ = nullptr;
+    header_ = nullptr;
+};
+
+bool ZoneIndex::open(vector<uint8_t> &&image)
+{
+    if (!valid(image.data(), image.size()))
+        return false;
+    close();
+    storage_ = std::move(image);
+    attach(storage_.data());
+    return true;
+};
+
+bool ZoneIndex::map(const string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        cerr << "Cannot open zone image " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(ZoneImageHeader)))
+    {
+        cerr << "Zone image " << path << " is too short" << endl;
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping keeps the file alive, so the descriptor is not needed past this point
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        cerr << "Cannot map zone image " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    if (!valid(static_cast<const uint8_t *>(mapping), st.st_size))
+    {
+        cerr << path << " is not a valid zone image (built by another version of zonec?)" << endl;
+        munmap(mapping, st.st_size);
+        return false;
+    }
+
+    close();
+    mapping_ = mapping;
+    mapping_size_ = st.st_size;
+    attach(static_cast<const uint8_t *>(mapping));
+    return true;
+};
+
+const ZoneNode *ZoneIndex::find(const uint8_t *wire) const
+{
+    uint32_t hash = zone_hash(wire);
+    size_t mask = header_->slot_count - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        const ZoneSlot &slot = slots_[i];
+        if (slot.node == 0)
+            return nullptr;
+        if (slot.hash == hash && same_name(node_name(nodes_[slot.node - 1]), wire))
+            return &nodes_[slot.node - 1];
+    }
+};
+
+const ZoneRRset *ZoneIndex::find_rrset(const ZoneNode &node, uint16_t type) const
+{
+    uint32_t offset = node.rrsets;
+    for (uint16_t i = 0; i < node.rrset_count; i++)
+    {
+        const ZoneRRset *rrset = rrset_at(offset);
+        if (rrset->type == type)
+            return rrset;
+        offset += zone_rrset_size(rrset->length);
+    }
+    return nullptr;
+};
+
+void ZoneIndex::add_negative(ZoneAnswer &answer, const ZoneNode &node) const
+{
+    // NXDOMAIN and NODATA carry the zone's SOA, with the negative TTL of
+    // RFC 2308: the smaller of the SOA's own TTL and its MINIMUM field
+    const ZoneEntry &zone = zones_[node.zone];
+    const ZoneRRset *soa = rrset_at(zone.soa);
+    const uint8_t *rdata = soa->records() + 2;
+    uint32_t minimum = read32(rdata + read16(soa->records()) - 4);
+    answer.add(AUTHORITY_SECTION, node_name(nodes_[zone.apex]), soa, min(soa->ttl, minimum));
+};
+
+void ZoneIndex::add_additional(ZoneAnswer &answer, const ZoneRRset *rrset) const
+{
+    // Addresses of name servers and mail exchangers we know about, glue included
+    if (rrset->type != TYPE_NS && rrset->type != TYPE_MX)
+        return;
+    const uint8_t *record = rrset->records();
+    for (uint16_t i = 0; i < rrset->count; i++)
+    {
+        const uint8_t *target = record + 2 + (rrset->type == TYPE_MX ? 2 : 0);
+        const ZoneNode *node = find(target);
+        if (node != nullptr)
+        {
+            if (const ZoneRRset *a = find_rrset(*node, TYPE_A))
+                answer.add(ADDITIONAL_SECTION, target, a, a->ttl);
+            if (const ZoneRRset *aaaa = find_rrset(*node, TYPE_AAAA))
+                answer.add(ADDITIONAL_SECTION, target, aaaa, aaaa->ttl);
+        }
+        record += 2 + read16(record);
+    }
+};
+
+bool ZoneIndex::lookup(const uint8_t *qname, uint16_t qtype, ZoneAnswer &answer) const
+{
+    if (empty())
+        return false;
+
+    const uint8_t *name = qname;
+    for (int hop = 0; hop <= max_cname_hops; hop++)
+    {
+        // Where each label starts, so that every ancestor can be probed in turn
+        size_t offsets[max_name_length / 2 + 1];
+        size_t labels = 0, pos = 0;
+        while (name[pos] != 0)
+        {
+            offsets[labels++] = pos;
+            pos += name[pos] + 1;
+        }
+        offsets[labels] = pos;
+
+        // The closest encloser: the longest suffix of the name that exists.
+        // Empty non-terminals are nodes too, so every ancestor of a node up
+        // to its apex exists.
+        const ZoneNode *encloser = nullptr;
+        size_t depth = 0;
+        for (; depth <= labels; depth++)
+            if ((encloser = find(name + offsets[depth])) != nullptr)
+                break;
+        if (encloser == nullptr)
+            return hop > 0; // a CNAME led out of our zones; the client follows it from here
+
+        // A delegation between the apex and the encloser means the name
+        // belongs to a child zone; the topmost cut is the one that counts
+        const ZoneNode *cut = nullptr;
+        size_t cut_depth = 0;
+        for (size_t d = depth; d <= labels; d++)
+        {
+            const ZoneNode *ancestor = d == depth ? encloser : find(name + offsets[d]);
+            if (ancestor == nullptr || (ancestor->flags & NODE_APEX))
+                break;
+            if (ancestor->flags & NODE_DELEGATION)
+            {
+                cut = ancestor;
+                cut_depth = d;
+            }
+        }
+        if (cut != nullptr)
+        {
+            // Referral: the child's name servers and their glue, not authoritative
+            const ZoneRRset *ns = find_rrset(*cut, TYPE_NS);
+            answer.add(AUTHORITY_SECTION, name + offsets[cut_depth], ns, ns->ttl);
+            add_additional(answer, ns);
+            return true;
+        }
+        if (hop == 0)
+            answer.authoritative = true;
+
+        const ZoneNode *match = depth == 0 ? encloser : nullptr;
+        if (match == nullptr)
+        {
+            // The name does not exist, but *.<closest encloser> may stand in for it (RFC 4592)
+            uint8_t wildcard[max_name_length];
+            size_t encloser_length = pos + 1 - offsets[depth];
+            if (encloser_length + 2 <= max_name_length)
+            {
+                wildcard[0] = 1;
+                wildcard[1] = '*';
+                memcpy(wildcard + 2, name + offsets[depth], encloser_length);
+                match = find(wildcard);
+            }
+        }
+        if (match == nullptr)
+        {
+            answer.rcode = RCODE_NXDOMAIN;
+            add_negative(answer, *encloser);
+            return true;
+        }
+
+        // Records are written under the name that was asked for, which is
+        // also what makes wildcard answers look like any other
+        if (qtype == TYPE_ANY && match->rrset_count > 0)
+        {
+            uint32_t offset = match->rrsets;
+            for (uint16_t i = 0; i < match->rrset_count; i++)
+            {
+                const ZoneRRset *rrset = rrset_at(offset);
+                answer.add(ANSWER_SECTION, name, rrset, rrset->ttl);
+                offset += zone_rrset_size(rrset->length);
+            }
+            return true;
+        }
+
+        if (const ZoneRRset *rrset = find_rrset(*match, qtype))
+        {
+            answer.add(ANSWER_SECTION, name, rrset, rrset->ttl);
+            add_additional(answer, rrset);
+            return true;
+        }
+
+        const ZoneRRset *cname = find_rrset(*match, TYPE_CNAME);
+        if (cname != nullptr && qtype != TYPE_CNAME)
+        {
+            // Follow the alias; the answer for its target goes in the same reply
+            answer.add(ANSWER_SECTION, name, cname, cname->ttl);
+            name = cname->records() + 2;
+            continue;
+        }
+
+        add_negative(answer, *match); // NODATA: the name exists, the type does not
+        return true;
+    }
+    return true;
+};
+
+void ZoneIndex::write(WireWriter &writer, const ZoneRecordSet &set) const
+{
+    const ZoneRRset *rrset = set.rrset;
+    const uint8_t *record = rrset->records();
+    for (uint16_t i = 0; i < rrset->count; i++)
+    {
+        uint16_t rdlength = read16(record);
+        const uint8_t *rdata = record + 2;
+
+        writer.name(set.owner);
+        writer.u16(rrset->type);
+        writer.u16(CLASS_IN);
+        writer.u32(set.ttl);
+        writer.rdata(rrset->type, rdata, rdlength);
+
+        record += 2 + rdlength;
+    }
+};
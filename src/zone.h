@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "message.h"
+#include "wire.h"
+
+using namespace std;
+
+const size_t max_zone_rrsets = 32; // RRsets per section of one reply
+const int max_cname_hops = 8;      // CNAME chains are followed this far inside our zones
+
+/*
+    The zone index is one flat, position-independent block of memory: every
+    reference inside it is an offset, never a pointer. It is built once by
+    ZoneBuilder and only ever read afterwards, so all workers share it.
+
+        ZoneImageHeader
+        ZoneEntry[zone_count]     one per zone: apex node and SOA RRset
+        ZoneSlot[slot_count]      open-addressing hash table over owner names
+        ZoneNode[node_count]      one per owner name, empty non-terminals included
+        names                     lowercased owner names in wire format
+        rrsets                    each node's RRsets back to back, records pre-encoded
+
+    A lookup hashes the name, probes the slots and compares names, so it is
+    O(name length) and never allocates. Integers in the structs are in host
+    byte order; RDATA is stored exactly as it goes on the wire.
+
+    The same image is what zonec writes to disk, and what the server maps
+    read-only with --zone-image: it is used in place, without parsing.
+*/
+const char zone_image_magic[8] = {'D', 'N', 'S', 'Z', 'O', 'N', 'E', '1'};
+const uint32_t zone_image_version = 1;
+
+struct ZoneImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t zone_count;
+    uint32_t node_count;
+    uint32_t slot_count; // a power of two
+    uint32_t record_count;
+    uint32_t zones_offset;
+    uint32_t slots_offset;
+    uint32_t nodes_offset;
+    uint32_t names_offset;
+    uint32_t rrsets_offset;
+    uint64_t size; // of the whole image
+};
+
+struct ZoneEntry
+{
+    uint32_t apex; // node index
+    uint32_t soa;  // offset of the SOA RRset in the rrsets block
+};
+
+struct ZoneSlot
+{
+    uint32_t hash;
+    uint32_t node; // node index + 1, 0 for an empty slot
+};
+
+enum ZoneNodeFlags : uint16_t
+{
+    NODE_APEX = 1,       // the origin of a zone
+    NODE_DELEGATION = 2, // NS records below the apex: a zone cut
+};
+
+struct ZoneNode
+{
+    uint32_t name;   // offset in the names block
+    uint32_t rrsets; // offset of the first RRset in the rrsets block
+    uint16_t rrset_count; // 0 for an empty non-terminal
+    uint16_t flags;
+    uint32_t zone;
+};
+
+/*
+    An RRset header, followed by count records of (RDLENGTH, RDATA) with
+    RDLENGTH in network byte order. The next RRset starts at the next
+    4-byte boundary. The class is always IN.
+*/
+struct ZoneRRset
+{
+    uint16_t type;
+    uint16_t count;
+    uint32_t ttl;
+    uint32_t length; // bytes of record data that follow
+
+    const uint8_t *records() const { return reinterpret_cast<const uint8_t *>(this + 1); }
+};
+
+// Owner names are hashed case-insensitively, so the index can be probed with a name as the client sent it
+uint32_t zone_hash(const uint8_t *wire);
+
+// Bytes taken by an RRset header plus its records, padded to the next RRset
+inline size_t zone_rrset_size(uint32_t length)
+{
+    return (sizeof(ZoneRRset) + length + 3) & ~size_t(3);
+}
+
+// One RRset picked for a reply, with the owner name and TTL to write it with
+struct ZoneRecordSet
+{
+    const uint8_t *owner; // uncompressed wire name
+    const ZoneRRset *rrset;
+    uint32_t ttl;
+};
+
+/*
+    The outcome of looking up the questions of one request: the RRsets for
+    each section, ready to be written, and the header bits that go with them.
+    It holds pointers only (into the zone index and the caller's question
+    names), so it lives on the stack.
+*/
+struct ZoneAnswer
+{
+    uint16_t rcode = 0;
+    bool authoritative = false;
+    ZoneRecordSet sections[3][max_zone_rrsets];
+    size_t counts[3] = {};
+
+    // Adding the same RRset under the same owner twice is a no-op
+    void add(Section section, const uint8_t *owner, const ZoneRRset *rrset, uint32_t ttl);
+    uint16_t record_count(Section section) const;
+};
+
+class ZoneIndex
+{
+    vector<uint8_t> storage_; // an image built in memory...
+    void *mapping_ = nullptr; // ...or one mapped from a file
+    size_t mapping_size_ = 0;
+    const uint8_t *base_ = nullptr;
+    const ZoneImageHeader *header_ = nullptr;
+    const ZoneEntry *zones_ = nullptr;
+    const ZoneSlot *slots_ = nullptr;
+    const ZoneNode *nodes_ = nullptr;
+    const uint8_t *names_ = nullptr;
+    const uint8_t *rrsets_ = nullptr;
+
+    const uint8_t *node_name(const ZoneNode &node) const { return names_ + node.name; }
+    const ZoneRRset *rrset_at(uint32_t offset) const { return reinterpret_cast<const ZoneRRset *>(rrsets_ + offset); }
+    const ZoneRRset *find_rrset(const ZoneNode &node, uint16_t type) const;
+    void add_negative(ZoneAnswer &answer, const ZoneNode &node) const;
+    void add_additional(ZoneAnswer &answer, const ZoneRRset *rrset) const;
+    static bool valid(const uint8_t *base, size_t size);
+    void attach(const uint8_t *base);
+    void close();
+
+public:
+    ZoneIndex() = default;
+    ZoneIndex(const ZoneIndex &) = delete;
+    ZoneIndex &operator=(const ZoneIndex &) = delete;
+    ~ZoneIndex();
+
+    // Takes over an image built by ZoneBuilder; false if it is not a valid image
+    bool open(vector<uint8_t> &&image);
+    // Maps an image written by zonec. The pages are shared with every other
+    // process mapping the same file, and are only read as lookups touch them.
+    bool map(const string &path);
+
+    bool empty() const { return header_ == nullptr || header_->zone_count == 0; }
+    size_t zone_count() const { return header_ ? header_->zone_count : 0; }
+    size_t node_count() const { return header_ ? header_->node_count : 0; }
+    size_t record_count() const { return header_ ? header_->record_count : 0; }
+    size_t size() const { return header_ ? header_->size : 0; }
+
+    // The node owning exactly this name, nullptr if there is none
+    const ZoneNode *find(const uint8_t *wire) const;
+
+    // Adds the answer to one question. False if the name is in none of our
+    // zones; the caller then has to get the answer elsewhere.
+    bool lookup(const uint8_t *qname, uint16_t qtype, ZoneAnswer &answer) const;
+
+    // Writes every record of the set, compressing the names inside RDATA too
+    void write(WireWriter &writer, const ZoneRecordSet &set) const;
+};
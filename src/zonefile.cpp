@@ -0,0 +1,803 @@
+#include "zonefile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <arpa/inet.h>
+
+using namespace std;
+
+namespace
+{
+
+struct Token
+{
+    const char *text;
+    size_t length;
+    bool quoted;
+
+    bool is(const char *word) const { return strlen(word) == length && strncasecmp(text, word, length) == 0; }
+};
+
+/*
+    Splits a master file into entries: one line, or several when the line
+    opens parentheses, with comments stripped. Tokens point into the file
+    text, so nothing is copied.
+*/
+class MasterFile
+{
+    const char *p;
+    const char *end;
+    size_t line = 1;
+
+public:
+    MasterFile(const string &text) : p(text.data()), end(text.data() + text.size()) {}
+
+    // owner_blank is set when the entry starts with whitespace, i.e. reuses the previous owner
+    bool next(vector<Token> &tokens, bool &owner_blank, size_t &entry_line)
+    {
+        tokens.clear();
+        int depth = 0;
+        bool line_start = true;
+        while (p < end)
+        {
+            char c = *p;
+            if (c == '\n')
+            {
+                line++;
+                p++;
+                if (depth == 0 && !tokens.empty())
+                    return true;
+                line_start = depth == 0;
+                continue;
+            }
+            if (line_start)
+            {
+                line_start = false;
+                owner_blank = c == ' ' || c == '\t';
+                entry_line = line;
+            }
+            if (c == ' ' || c == '\t' || c == '\r')
+                p++;
+            else if (c == ';')
+            {
+                while (p < end && *p != '\n')
+                    p++;
+            }
+            else if (c == '(')
+            {
+                depth++;
+                p++;
+            }
+            else if (c == ')')
+            {
+                depth = max(0, depth - 1);
+                p++;
+            }
+            else if (c == '"')
+            {
+                const char *start = ++p;
+                while (p < end && *p != '"')
+                {
+                    if (*p == '\\' && p + 1 < end)
+                        p++;
+                    if (*p == '\n')
+                        line++;
+                    p++;
+                }
+                tokens.push_back(Token{start, size_t(p - start), true});
+                if (p < end)
+                    p++;
+            }
+            else
+            {
+                const char *start = p;
+                while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != ';' && *p != '(' && *p != ')' && *p != '"')
+                {
+                    if (*p == '\\' && p + 1 < end)
+                        p++;
+                    p++;
+                }
+                tokens.push_back(Token{start, size_t(p - start), false});
+            }
+        }
+        return !tokens.empty();
+    }
+};
+
+uint8_t lower(uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// One character of a name or string, with \X and \DDD escapes decoded
+bool unescape(const char *&s, const char *end, uint8_t &c)
+{
+    if (*s != '\\')
+    {
+        c = *s++;
+        return true;
+    }
+    s++;
+    if (s == end)
+        return false;
+    if (isdigit(*s))
+    {
+        if (end - s < 3 || !isdigit(s[1]) || !isdigit(s[2]))
+            return false;
+        int value = (s[0] - '0') * 100 + (s[1] - '0') * 10 + (s[2] - '0');
+        if (value > 255)
+            return false;
+        c = value;
+        s += 3;
+        return true;
+    }
+    c = *s++;
+    return true;
+}
+
+// A name in wire format; relative names get the origin appended
+bool parse_name(const Token &token, const vector<uint8_t> &origin, uint8_t *out, size_t &length)
+{
+    const char *s = token.text, *end = token.text + token.length;
+    if (token.length == 1 && *s == '@')
+    {
+        if (origin.empty())
+            return false;
+        memcpy(out, origin.data(), origin.size());
+        length = origin.size();
+        return true;
+    }
+    if (token.length == 1 && *s == '.')
+    {
+        out[0] = 0;
+        length = 1;
+        return true;
+    }
+
+    size_t pos = 0, w = 1;
+    bool absolute = false;
+    while (s < end)
+    {
+        if (*s == '.')
+        {
+            if (w == pos + 1)
+                return false; // empty label
+            out[pos] = w - pos - 1;
+            pos = w++;
+            s++;
+            absolute = s == end;
+            continue;
+        }
+        uint8_t c;
+        if (!unescape(s, end, c) || w - pos - 1 == max_label_length || w + 1 >= max_name_length)
+            return false;
+        out[w++] = c;
+    }
+
+    if (absolute)
+    {
+        out[pos] = 0;
+        length = pos + 1;
+        return true;
+    }
+    if (w == pos + 1 || origin.empty() || w + origin.size() > max_name_length)
+        return false;
+    out[pos] = w - pos - 1;
+    memcpy(out + w, origin.data(), origin.size());
+    length = w + origin.size();
+    return true;
+}
+
+bool parse_number(const Token &token, uint32_t &value)
+{
+    uint64_t n = 0;
+    if (token.length == 0 || token.length > 10)
+        return false;
+    for (size_t i = 0; i < token.length; i++)
+    {
+        if (!isdigit(token.text[i]))
+            return false;
+        n = n * 10 + (token.text[i] - '0');
+    }
+    if (n > 0xFFFFFFFFull)
+        return false;
+    value = n;
+    return true;
+}
+
+// A TTL or SOA timer: plain seconds, or BIND-style units such as 1h30m or 2w
+bool parse_ttl(const Token &token, uint32_t &ttl)
+{
+    uint64_t total = 0, value = 0;
+    bool digits = false;
+    for (size_t i = 0; i < token.length; i++)
+    {
+        char c = token.text[i];
+        if (isdigit(c))
+        {
+            value = value * 10 + (c - '0');
+            digits = true;
+            if (value > 0xFFFFFFFFull)
+                return false;
+            continue;
+        }
+        if (!digits)
+            return false;
+        switch (tolower(c))
+        {
+        case 's':
+            break;
+        case 'm':
+            value *= 60;
+            break;
+        case 'h':
+            value *= 3600;
+            break;
+        case 'd':
+            value *= 86400;
+            break;
+        case 'w':
+            value *= 604800;
+            break;
+        default:
+            return false;
+        }
+        total += value;
+        value = 0;
+        digits = false;
+    }
+    total += value;
+    if (token.length == 0 || total > 0x7FFFFFFF) // RFC 2181 8
+        return false;
+    ttl = total;
+    return true;
+}
+
+bool parse_type(const Token &token, uint16_t &type)
+{
+    static const struct
+    {
+        const char *name;
+        uint16_t type;
+    } types[] = {{"A", TYPE_A}, {"NS", TYPE_NS}, {"CNAME", TYPE_CNAME}, {"SOA", TYPE_SOA}, {"MX", TYPE_MX}, {"TXT", TYPE_TXT}, {"AAAA", TYPE_AAAA}};
+    for (auto &known : types)
+        if (token.is(known.name))
+        {
+            type = known.type;
+            return true;
+        }
+    return false;
+}
+
+// Whether a token could be a record type at all, so that unknown types can be told from junk
+bool looks_like_type(const Token &token)
+{
+    if (token.quoted || token.length == 0 || !isalpha(token.text[0]))
+        return false;
+    for (size_t i = 0; i < token.length; i++)
+        if (!isalnum(token.text[i]) && token.text[i] != '-')
+            return false;
+    return true;
+}
+
+void put16(vector<uint8_t> &out, uint16_t value)
+{
+    out.push_back(value >> 8);
+    out.push_back(value & 0xFF);
+}
+
+void put32(vector<uint8_t> &out, uint32_t value)
+{
+    put16(out, value >> 16);
+    put16(out, value & 0xFFFF);
+}
+
+bool put_name(vector<uint8_t> &out, const Token &token, const vector<uint8_t> &origin)
+{
+    uint8_t name[max_name_length];
+    size_t length;
+    if (!parse_name(token, origin, name, length))
+        return false;
+    out.insert(out.end(), name, name + length);
+    return true;
+}
+
+// Appends the RDATA of one record in wire format; false if the fields do not fit the type
+bool parse_rdata(uint16_t type, const Token *fields, size_t count, const vector<uint8_t> &origin, vector<uint8_t> &out)
+{
+    char text[64];
+    uint32_t value;
+    switch (type)
+    {
+    case TYPE_A:
+    case TYPE_AAAA:
+    {
+        if (count != 1 || fields[0].length >= sizeof(text))
+            return false;
+        memcpy(text, fields[0].text, fields[0].length);
+        text[fields[0].length] = 0;
+        uint8_t address[16];
+        if (inet_pton(type == TYPE_A ? AF_INET : AF_INET6, text, address) != 1)
+            return false;
+        out.insert(out.end(), address, address + (type == TYPE_A ? 4 : 16));
+        return true;
+    }
+    case TYPE_NS:
+    case TYPE_CNAME:
+        return count == 1 && put_name(out, fields[0], origin);
+    case TYPE_MX:
+        if (count != 2 || !parse_number(fields[0], value) || value > 0xFFFF)
+            return false;
+        put16(out, value);
+        return put_name(out, fields[1], origin);
+    case TYPE_SOA:
+        if (count != 7 || !put_name(out, fields[0], origin) || !put_name(out, fields[1], origin))
+            return false;
+        if (!parse_number(fields[2], value))
+            return false;
+        put32(out, value); // serial
+        for (size_t i = 3; i < 7; i++)
+        {
+            if (!parse_ttl(fields[i], value))
+                return false;
+            put32(out, value); // refresh, retry, expire, minimum
+        }
+        return true;
+    case TYPE_TXT:
+        if (count == 0)
+            return false;
+        for (size_t i = 0; i < count; i++)
+        {
+            // Each field becomes one <character-string> of up to 255 octets
+            size_t length_at = out.size();
+            out.push_back(0);
+            const char *s = fields[i].text, *end = s + fields[i].length;
+            while (s < end)
+            {
+                uint8_t c;
+                if (!unescape(s, end, c) || out.size() - length_at > 255)
+                    return false;
+                out.push_back(c);
+            }
+            out[length_at] = out.size() - length_at - 1;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Whether name is origin or below it, on a label boundary
+bool in_zone(const uint8_t *name, size_t length, const vector<uint8_t> &origin)
+{
+    size_t pos = 0;
+    while (length - pos > origin.size())
+        pos += name[pos] + 1;
+    return length - pos == origin.size() && memcmp(name + pos, origin.data(), origin.size()) == 0;
+}
+
+bool read_file(const string &path, string &text)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+    in.seekg(0, ios::end);
+    text.resize(in.tellg());
+    in.seekg(0);
+    in.read(text.data(), text.size());
+    return bool(in);
+}
+
+} // namespace
+
+bool ZoneBuilder::load(const string &path, const string &origin)
+{
+    string text;
+    if (!read_file(path, text))
+    {
+        cerr << "Cannot read zone file " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    Zone zone;
+    zone.path = path;
+    vector<uint8_t> current_origin;
+    if (!origin.empty())
+    {
+        // The origin on the command line is absolute whether or not it ends in a dot
+        string absolute = origin.back() == '.' ? origin : origin + ".";
+        uint8_t name[max_name_length];
+        size_t length;
+        if (!parse_name(Token{absolute.data(), absolute.size(), false}, {}, name, length))
+        {
+            cerr << "Invalid zone origin " << origin << endl;
+            return false;
+        }
+        current_origin.assign(name, name + length);
+        for (auto &c : current_origin)
+            c = lower(c);
+        zone.origin = current_origin;
+    }
+    if (zones_.size() > 0xFFFF)
+    {
+        cerr << "Too many zones" << endl;
+        return false;
+    }
+    uint16_t zone_index = zones_.size();
+    zones_.push_back(zone);
+    size_t first_record = records_.size();
+
+    MasterFile file(text);
+    vector<Token> tokens;
+    bool owner_blank = false;
+    size_t line = 0;
+    uint32_t default_ttl = 0, last_ttl = 0;
+    bool has_default_ttl = false, has_last_ttl = false;
+    bool has_owner = false;
+    Record last = {};
+    size_t unknown_types = 0;
+
+    auto fail = [&](const char *message)
+    {
+        cerr << path << ":" << line << ": " << message << endl;
+        records_.resize(first_record);
+        zones_.pop_back();
+        return false;
+    };
+
+    while (file.next(tokens, owner_blank, line))
+    {
+        if (!owner_blank && tokens[0].text[0] == '$')
+        {
+            if (tokens[0].is("$ORIGIN") && tokens.size() == 2)
+            {
+                uint8_t name[max_name_length];
+                size_t length;
+                if (!parse_name(tokens[1], current_origin, name, length))
+                    return fail("invalid $ORIGIN");
+                current_origin.assign(name, name + length);
+            }
+            else if (tokens[0].is("$TTL") && tokens.size() == 2)
+            {
+                if (!parse_ttl(tokens[1], default_ttl))
+                    return fail("invalid $TTL");
+                has_default_ttl = true;
+            }
+            else
+                return fail("unsupported directive");
+            continue;
+        }
+
+        Record record = {};
+        record.zone = zone_index;
+        size_t i = 0;
+        if (owner_blank)
+        {
+            if (!has_owner)
+                return fail("no previous owner name");
+            record.owner = last.owner;
+            record.owner_length = last.owner_length;
+        }
+        else
+        {
+            uint8_t name[max_name_length];
+            size_t length;
+            if (!parse_name(tokens[i++], current_origin, name, length))
+                return fail(current_origin.empty() ? "relative owner name without an origin, use $ORIGIN or --zone origin=file"
+                                                   : "invalid owner name");
+            for (size_t j = 0; j < length; j++)
+                name[j] = lower(name[j]);
+
+            // Consecutive records mostly share their owner; store it once
+            if (has_owner && length == last.owner_length && memcmp(names_.data() + last.owner, name, length) == 0)
+                record.owner = last.owner;
+            else
+            {
+                record.owner = names_.size();
+                names_.insert(names_.end(), name, name + length);
+            }
+            record.owner_length = length;
+            has_owner = true;
+        }
+        last = record;
+
+        // TTL and class come in either order, and both are optional
+        bool has_ttl = false;
+        for (int field = 0; field < 2 && i < tokens.size(); field++)
+        {
+            if (!tokens[i].quoted && isdigit(tokens[i].text[0]))
+            {
+                if (!parse_ttl(tokens[i++], record.ttl))
+                    return fail("invalid TTL");
+                has_ttl = true;
+            }
+            else if (tokens[i].is("IN"))
+                i++;
+            else if (tokens[i].is("CH") || tokens[i].is("HS") || tokens[i].is("CS"))
+                return fail("only class IN is supported");
+        }
+        if (has_ttl)
+        {
+            last_ttl = record.ttl;
+            has_last_ttl = true;
+        }
+        else if (has_default_ttl)
+            record.ttl = default_ttl;
+        else if (has_last_ttl)
+            record.ttl = last_ttl;
+        else
+            return fail("no TTL and no $TTL");
+
+        if (i == tokens.size())
+            return fail("missing record type");
+        if (!parse_type(tokens[i], record.type))
+        {
+            if (!looks_like_type(tokens[i]))
+                return fail("invalid record type");
+            if (unknown_types++ < 10)
+                cerr << path << ":" << line << ": skipping record of unsupported type " << string(tokens[i].text, tokens[i].length) << endl;
+            skipped_++;
+            continue;
+        }
+        i++;
+
+        record.rdata = rdata_.size();
+        if (!parse_rdata(record.type, tokens.data() + i, tokens.size() - i, current_origin, rdata_))
+            return fail("invalid record data");
+        if (rdata_.size() - record.rdata > 0xFFFF)
+            return fail("record data too long");
+        record.rdata_length = rdata_.size() - record.rdata;
+
+        // Without an origin given, the zone is whatever the SOA says it is
+        if (record.type == TYPE_SOA && zones_.back().origin.empty())
+            zones_.back().origin.assign(names_.data() + record.owner, names_.data() + record.owner + record.owner_length);
+
+        records_.push_back(record);
+    }
+
+    if (!check_zone(first_record))
+    {
+        records_.resize(first_record);
+        zones_.pop_back();
+        return false;
+    }
+    return true;
+};
+
+bool ZoneBuilder::check_zone(size_t first_record)
+{
+    Zone &zone = zones_.back();
+    if (zone.origin.empty())
+    {
+        cerr << zone.path << ": no SOA record" << endl;
+        return false;
+    }
+    for (size_t i = 0; i + 1 < zones_.size(); i++)
+        if (zones_[i].origin == zone.origin)
+        {
+            cerr << zone.path << ": zone " << name_to_string(zone.origin.data()) << " is already loaded from " << zones_[i].path << endl;
+            return false;
+        }
+
+    // Exactly one SOA, at the apex; records outside the zone are dropped
+    size_t soa_count = 0, outside = 0, kept = first_record;
+    for (size_t i = first_record; i < records_.size(); i++)
+    {
+        const Record &record = records_[i];
+        const uint8_t *owner = names_.data() + record.owner;
+        if (!in_zone(owner, record.owner_length, zone.origin))
+        {
+            outside++;
+            continue;
+        }
+        if (record.type == TYPE_SOA)
+        {
+            if (record.owner_length != zone.origin.size() || memcmp(owner, zone.origin.data(), zone.origin.size()) != 0)
+            {
+                cerr << zone.path << ": SOA record for " << name_to_string(owner) << " outside the zone apex" << endl;
+                return false;
+            }
+            soa_count++;
+        }
+        records_[kept++] = record;
+    }
+    records_.resize(kept);
+    if (soa_count != 1)
+    {
+        cerr << zone.path << ": expected one SOA record at the apex, found " << soa_count << endl;
+        return false;
+    }
+    if (outside > 0)
+    {
+        cerr << zone.path << ": ignored " << outside << " records outside " << name_to_string(zone.origin.data()) << endl;
+        skipped_ += outside;
+    }
+    return true;
+};
+
+bool ZoneBuilder::build(vector<uint8_t> &image)
+{
+    const uint8_t *names = names_.data();
+    const uint8_t *rdata = rdata_.data();
+    auto compare_owner = [&](const Record &a, const Record &b)
+    {
+        int c = memcmp(names + a.owner, names + b.owner, min(a.owner_length, b.owner_length));
+        return c != 0 ? c : int(a.owner_length) - int(b.owner_length);
+    };
+    auto compare_rdata = [&](const Record &a, const Record &b)
+    {
+        int c = memcmp(rdata + a.rdata, rdata + b.rdata, min(a.rdata_length, b.rdata_length));
+        return c != 0 ? c : int(a.rdata_length) - int(b.rdata_length);
+    };
+
+    // Bring every owner's records together, grouped by type. RDATA is in the
+    // key too, so that duplicate records end up next to each other.
+    sort(records_.begin(), records_.end(), [&](const Record &a, const Record &b)
+         {
+        int c = compare_owner(a, b);
+        if (c != 0)
+            return c < 0;
+        if (a.type != b.type)
+            return a.type < b.type;
+        return compare_rdata(a, b) < 0; });
+
+    vector<ZoneEntry> zones(zones_.size(), ZoneEntry{0, 0});
+    vector<ZoneNode> nodes;
+    vector<uint8_t> node_names;
+    vector<uint8_t> rrsets;
+    uint32_t record_count = 0;
+
+    for (size_t i = 0; i < records_.size();)
+    {
+        size_t group_end = i;
+        while (group_end < records_.size() && compare_owner(records_[i], records_[group_end]) == 0)
+            group_end++;
+
+        // A name in two zones (a delegation in the parent and the apex of
+        // the child, both loaded) belongs to the deeper zone
+        uint16_t zone = records_[i].zone;
+        for (size_t j = i; j < group_end; j++)
+            if (zones_[records_[j].zone].origin.size() > zones_[zone].origin.size())
+                zone = records_[j].zone;
+
+        ZoneNode node = {};
+        node.name = node_names.size();
+        node.rrsets = rrsets.size();
+        node.zone = zone;
+        const uint8_t *owner = names + records_[i].owner;
+        node_names.insert(node_names.end(), owner, owner + records_[i].owner_length);
+        if (zones_[zone].origin.size() == records_[i].owner_length)
+            node.flags |= NODE_APEX;
+
+        for (size_t j = i; j < group_end;)
+        {
+            size_t type_end = j;
+            while (type_end < group_end && records_[type_end].type == records_[j].type)
+                type_end++;
+
+            size_t header_at = rrsets.size();
+            rrsets.resize(header_at + sizeof(ZoneRRset));
+            ZoneRRset header = {records_[j].type, 0, 0xFFFFFFFF, 0};
+            for (size_t k = j; k < type_end; k++)
+            {
+                const Record &record = records_[k];
+                if (record.zone != zone || (k > j && compare_rdata(record, records_[k - 1]) == 0))
+                    continue;
+                if (header.count == 0xFFFF)
+                    break;
+                // The records of an RRset share one TTL (RFC 2181 5.2); take the smallest
+                header.ttl = min(header.ttl, record.ttl);
+                rrsets.push_back(record.rdata_length >> 8);
+                rrsets.push_back(record.rdata_length & 0xFF);
+                rrsets.insert(rrsets.end(), rdata + record.rdata, rdata + record.rdata + record.rdata_length);
+                header.count++;
+            }
+            if (header.count == 0)
+                rrsets.resize(header_at);
+            else
+            {
+                header.length = rrsets.size() - header_at - sizeof(ZoneRRset);
+                memcpy(rrsets.data() + header_at, &header, sizeof(header));
+                rrsets.resize(header_at + zone_rrset_size(header.length));
+                node.rrset_count++;
+                record_count += header.count;
+
+                if (header.type == TYPE_SOA && (node.flags & NODE_APEX))
+                {
+                    zones[zone].apex = nodes.size();
+                    zones[zone].soa = header_at;
+                }
+                if (header.type == TYPE_NS && !(node.flags & NODE_APEX))
+                    node.flags |= NODE_DELEGATION;
+            }
+            j = type_end;
+        }
+        nodes.push_back(node);
+        i = group_end;
+    }
+
+    if (node_names.size() > 0xFFFFFFFF || rrsets.size() > 0xFFFFFFFF)
+    {
+        cerr << "Zones too big for one index" << endl;
+        return false;
+    }
+
+    // Hash every owner name. Then add the empty non-terminals: every
+    // missing ancestor of a node, up to its zone's apex, so that lookups can
+    // tell "no such name" from "a name with nothing of its own". An
+    // ancestor's name is a suffix of its descendant's, so it takes no space.
+    vector<ZoneSlot> slots;
+    auto find_slot = [&](const uint8_t *name, uint32_t hash) -> ZoneSlot &
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t s = hash & mask;; s = (s + 1) & mask)
+            if (slots[s].node == 0 || (slots[s].hash == hash && same_name(node_names.data() + nodes[slots[s].node - 1].name, name)))
+                return slots[s];
+    };
+    auto rehash = [&](size_t count)
+    {
+        size_t size = 16;
+        while (size < count * 2)
+            size *= 2;
+        slots.assign(size, ZoneSlot{0, 0});
+        for (size_t n = 0; n < nodes.size(); n++)
+        {
+            const uint8_t *name = node_names.data() + nodes[n].name;
+            uint32_t hash = zone_hash(name);
+            find_slot(name, hash) = ZoneSlot{hash, uint32_t(n + 1)};
+        }
+    };
+    rehash(nodes.size());
+
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        const uint8_t *name = node_names.data() + nodes[n].name;
+        if ((nodes[n].flags & NODE_APEX) || name[0] == 0)
+            continue;
+        uint32_t parent = nodes[n].name + name[0] + 1;
+        uint32_t hash = zone_hash(node_names.data() + parent);
+        if (find_slot(node_names.data() + parent, hash).node != 0)
+            continue;
+
+        nodes.push_back(ZoneNode{parent, 0, 0, 0, nodes[n].zone});
+        if (nodes.size() * 2 > slots.size())
+            rehash(nodes.size() * 2);
+        else
+            find_slot(node_names.data() + parent, hash) = ZoneSlot{hash, uint32_t(nodes.size())};
+    }
+
+    // Lay it all out in one block
+    auto align = [](size_t offset)
+    { return (offset + 7) & ~size_t(7); };
+    ZoneImageHeader header = {};
+    memcpy(header.magic, zone_image_magic, sizeof(header.magic));
+    header.version = zone_image_version;
+    header.zone_count = zones.size();
+    header.node_count = nodes.size();
+    header.slot_count = slots.size();
+    header.record_count = record_count;
+    header.zones_offset = align(sizeof(ZoneImageHeader));
+    header.slots_offset = align(header.zones_offset + zones.size() * sizeof(ZoneEntry));
+    header.nodes_offset = align(header.slots_offset + slots.size() * sizeof(ZoneSlot));
+    header.names_offset = align(header.nodes_offset + nodes.size() * sizeof(ZoneNode));
+    size_t rrsets_offset = align(header.names_offset + node_names.size());
+    size_t size = rrsets_offset + rrsets.size();
+    if (size > 0xFFFFFFFF)
+    {
+        cerr << "Zones too big for one index" << endl;
+        return false;
+    }
+    header.rrsets_offset = rrsets_offset;
+    header.size = size;
+
+    image.assign(size, 0);
+    memcpy(image.data(), &header, sizeof(header));
+    memcpy(image.data() + header.zones_offset, zones.data(), zones.size() * sizeof(ZoneEntry));
+    memcpy(image.data() + header.slots_offset, slots.data(), slots.size() * sizeof(ZoneSlot));
+    memcpy(image.data() + header.nodes_offset, nodes.data(), nodes.size() * sizeof(ZoneNode));
+    memcpy(image.data() + header.names_offset, node_names.data(), node_names.size());
+    memcpy(image.data() + header.rrsets_offset, rrsets.data(), rrsets.size());
+    return true;
+};
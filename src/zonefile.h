@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "zone.h"
+
+using namespace std;
+
+/*
+    Reads zones in RFC 1035 master file format and lays them out as a zone
+    index image (see zone.h).
+
+    Understood: $ORIGIN and $TTL, @, relative names, blank owners, TTLs
+    with units (1h30m), parentheses, comments, quoted strings and \X / \DDD
+    escapes. Records of type A, AAAA, CNAME, NS, SOA, MX and TXT in class IN
+    are loaded; any other type is skipped with a warning.
+*/
+class ZoneBuilder
+{
+    struct Record
+    {
+        uint32_t owner; // offset in names_, lowercased wire name
+        uint32_t rdata; // offset in rdata_
+        uint16_t owner_length;
+        uint16_t rdata_length;
+        uint16_t type;
+        uint16_t zone;
+        uint32_t ttl;
+    };
+
+    struct Zone
+    {
+        vector<uint8_t> origin; // lowercased wire name
+        string path;
+    };
+
+    vector<uint8_t> names_;
+    vector<uint8_t> rdata_;
+    vector<Record> records_;
+    vector<Zone> zones_;
+    size_t skipped_ = 0;
+
+    bool check_zone(size_t first_record);
+
+public:
+    // origin may be empty, the zone's origin is then the owner of its SOA
+    bool load(const string &path, const string &origin = "");
+    // Lays out every zone loaded so far; false if the result is too big
+    bool build(vector<uint8_t> &image);
+
+    size_t zone_count() const { return zones_.size(); }
+    size_t record_count() const { return records_.size(); }
+    size_t skipped() const { return skipped_; }
+};
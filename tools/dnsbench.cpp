@@ -0,0 +1,610 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "wire.h"
+
+using namespace std;
+
+/*
+    dnsbench: a load generator for the server, with a mock upstream for it
+    to forward to, so that forwarding can be measured without a network.
+
+        dnsbench --zipf 100000 --duration 10 --concurrency 200
+        dnsbench --queries mix.txt --qps 50000
+        dnsbench --mock 5300 --mock-only      # then: server --resolver 127.0.0.1:5300
+
+    Queries go to --server (127.0.0.1:2053) over UDP. The names come from a
+    query file, one "name [type]" per line, replayed in a loop, or from N
+    made-up names drawn with a Zipf distribution (exponent --zipf-s, 1.0
+    by default). Resolver traffic looks like the latter: a few names take
+    most of the queries and a long tail is asked for now and then, which
+    is what decides the cache hit rate.
+
+    By default the load is a closed loop, --concurrency queries outstanding
+    at all times. With --qps it is an open loop: queries go out on schedule
+    whether answers keep up or not, and latency is counted from when a
+    query was due rather than from when it could be sent, so that a server
+    falling behind shows in the tail instead of slowing the benchmark down.
+*/
+
+typedef chrono::steady_clock bench_clock;
+
+const size_t max_in_flight = 65536; // one per transaction ID
+
+/*
+    Latencies in microseconds, in log-linear buckets: every power of two is
+    split in 16, so any percentile is off by at most 1/16 of its value.
+*/
+class LatencyHistogram
+{
+    static const int sub_buckets = 16;
+    vector<uint64_t> counts = vector<uint64_t>(64 * sub_buckets, 0);
+    uint64_t total = 0;
+    uint64_t largest = 0;
+
+    static size_t bucket(uint64_t us)
+    {
+        if (us < sub_buckets)
+            return us;
+        int octave = 63 - __builtin_clzll(us); // at least 4
+        size_t fraction = (us >> (octave - 4)) & (sub_buckets - 1);
+        return (octave - 3) * sub_buckets + fraction;
+    }
+
+    // The largest value that falls into a bucket
+    static uint64_t upper(size_t index)
+    {
+        if (index < sub_buckets)
+            return index;
+        int octave = index / sub_buckets + 3;
+        uint64_t fraction = index % sub_buckets;
+        return ((sub_buckets + fraction + 1) << (octave - 4)) - 1;
+    }
+
+public:
+    void add(uint64_t us)
+    {
+        counts[bucket(us)]++;
+        total++;
+        largest = max(largest, us);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max_value() const { return largest; }
+
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = ceil(total * p / 100.0), seen = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank && seen > 0)
+                return min(upper(i), largest);
+        }
+        return largest;
+    }
+
+    // Queries per power of two, for the shape of the distribution
+    void print(ostream &out) const
+    {
+        uint64_t octave_counts[64] = {};
+        for (size_t i = 0; i < counts.size(); i++)
+            octave_counts[63 - __builtin_clzll(upper(i) | 1)] += counts[i];
+        for (int octave = 0; octave < 64; octave++)
+        {
+            if (octave_counts[octave] == 0)
+                continue;
+            double share = 100.0 * octave_counts[octave] / total;
+            out << "  " << setw(8) << (octave == 0 ? 0 : 1ULL << octave) << " - " << setw(8) << (2ULL << octave) - 1 << " us "
+                << setw(10) << octave_counts[octave] << " " << fixed << setprecision(2) << setw(6) << share << "% "
+                << string(size_t(share / 2), '#') << endl;
+        }
+    }
+};
+
+struct Options
+{
+    sockaddr_in server = {};
+    string queries_path;
+    size_t zipf_names = 0;
+    double zipf_s = 1.0;
+    string zipf_domain = "bench.test";
+    double duration_s = 10;
+    size_t concurrency = 100;
+    double qps = 0;
+    int timeout_ms = 1000;
+    uint16_t edns_size = 0; // 0 sends queries without an OPT record
+    int mock_port = 0;
+    bool mock_only = false;
+    uint32_t mock_ttl = 300;
+    int mock_delay_us = 0;
+};
+
+bool parse_address(const string &text, sockaddr_in &address)
+{
+    size_t colon = text.find(':');
+    address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(colon == string::npos ? default_port : atoi(text.c_str() + colon + 1));
+    return inet_pton(AF_INET, text.substr(0, colon).c_str(), &address.sin_addr) == 1;
+}
+
+bool parse_type(const string &text, uint16_t &type)
+{
+    static const struct
+    {
+        const char *name;
+        uint16_t type;
+    } types[] = {{"A", TYPE_A}, {"NS", TYPE_NS}, {"CNAME", TYPE_CNAME}, {"SOA", TYPE_SOA}, {"PTR", TYPE_PTR}, {"MX", TYPE_MX},
+                 {"TXT", TYPE_TXT}, {"AAAA", TYPE_AAAA}, {"SRV", TYPE_SRV}, {"ANY", TYPE_ANY}};
+    for (auto &known : types)
+        if (strcasecmp(text.c_str(), known.name) == 0)
+        {
+            type = known.type;
+            return true;
+        }
+    if (text.empty() || text.find_first_not_of("0123456789") != string::npos)
+        return false;
+    type = atoi(text.c_str());
+    return true;
+}
+
+// A query without its ID, which is filled in when it is sent
+bool make_query(const string &dotted, uint16_t type, uint16_t edns_size, vector<uint8_t> &packet)
+{
+    uint8_t wire[max_name_length];
+    size_t length = 0;
+    stringstream labels(dotted);
+    string label;
+    while (getline(labels, label, '.'))
+    {
+        if (label.empty())
+            continue;
+        if (label.size() > max_label_length || length + label.size() + 2 > max_name_length)
+            return false;
+        wire[length++] = label.size();
+        memcpy(wire + length, label.data(), label.size());
+        length += label.size();
+    }
+    wire[length++] = 0;
+
+    packet.resize(12 + length + 4 + opt_record_size);
+    WireWriter writer(packet.data(), packet.size());
+    writer.header(DNSHeader{0, 0x0100, 1, 0, 0, uint16_t(edns_size != 0)}); // RD
+    writer.name(wire);
+    writer.u16(type);
+    writer.u16(CLASS_IN);
+    if (edns_size != 0)
+        writer.opt(edns_size, 0, false);
+    packet.resize(writer.length());
+    return true;
+}
+
+bool load_queries(const string &path, uint16_t edns_size, vector<vector<uint8_t>> &queries)
+{
+    ifstream in(path);
+    if (!in)
+    {
+        cerr << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    string line;
+    size_t number = 0;
+    while (getline(in, line))
+    {
+        number++;
+        line = line.substr(0, line.find('#'));
+        stringstream fields(line);
+        string name, type_text = "A";
+        if (!(fields >> name))
+            continue;
+        fields >> type_text;
+        uint16_t type;
+        queries.emplace_back();
+        if (!parse_type(type_text, type) || !make_query(name, type, edns_size, queries.back()))
+        {
+            cerr << path << ":" << number << ": cannot make a query of \"" << line << "\"" << endl;
+            return false;
+        }
+    }
+    if (queries.empty())
+        cerr << path << ": no queries" << endl;
+    return !queries.empty();
+}
+
+/*
+    The mock upstream answers A and AAAA queries with an address made up
+    from the name, names starting with "nx" with NXDOMAIN, and anything
+    else with an empty NOERROR. Negative answers carry an SOA for the
+    root, as a real resolver's would, so that they can be cached. With
+    --mock-delay every answer is held back that long, to stand in for a
+    resolver that is further away.
+*/
+void run_mock(const Options &options, atomic<bool> &running, atomic<uint64_t> &answered)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.mock_port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd == -1 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        cerr << "mock upstream: cannot bind 127.0.0.1:" << options.mock_port << ": " << strerror(errno) << endl;
+        running = false;
+        return;
+    }
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct Delayed
+    {
+        bench_clock::time_point due;
+        sockaddr_in to;
+        vector<uint8_t> packet;
+    };
+    deque<Delayed> delayed;
+    MessageView query;
+    uint8_t in[max_edns_size], out[max_edns_size], qname[max_name_length];
+
+    while (running)
+    {
+        int wait_ms = 100;
+        if (!delayed.empty())
+            wait_ms = DeadlineHeap::milliseconds_until(delayed.front().due, bench_clock::now());
+        pollfd poller = {fd, POLLIN, 0};
+        poll(&poller, 1, wait_ms);
+
+        while (!delayed.empty() && delayed.front().due <= bench_clock::now())
+        {
+            Delayed &reply = delayed.front();
+            sendto(fd, reply.packet.data(), reply.packet.size(), 0, reinterpret_cast<sockaddr *>(&reply.to), sizeof(reply.to));
+            delayed.pop_front();
+        }
+
+        while (true)
+        {
+            sockaddr_in from;
+            socklen_t from_length = sizeof(from);
+            ssize_t length = recvfrom(fd, in, sizeof(in), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&from), &from_length);
+            if (length < 0)
+                break;
+            if (!query.parse(in, length) || query.question_count() != 1)
+                continue;
+
+            const QuestionView &question = query.question(0);
+            question.name.copy_to(qname);
+            uint64_t hash = 1469598103934665603ULL; // FNV-1a, so a name always gets the same address
+            for (size_t i = 0; i < name_length(qname); i++)
+                hash = (hash ^ qname[i]) * 1099511628211ULL;
+            bool nxdomain = qname[0] >= 2 && strncasecmp(reinterpret_cast<char *>(qname + 1), "nx", 2) == 0;
+            bool address_type = question.qtype == TYPE_A || question.qtype == TYPE_AAAA;
+
+            WireWriter writer(out, sizeof(out));
+            bool positive = !nxdomain && address_type;
+            writer.header(DNSHeader{query.header().id, uint16_t(0x8180 | (nxdomain ? RCODE_NXDOMAIN : 0)), 1,
+                                    uint16_t(positive), uint16_t(!positive), 0});
+            writer.name(qname);
+            writer.u16(question.qtype);
+            writer.u16(question.qclass);
+            if (!positive)
+            {
+                // mock. hostmaster.mock. with serial 1, and the TTL as the MINIMUM too
+                static const uint8_t names[] = "\4mock\0\12hostmaster\4mock";
+                uint8_t soa[sizeof(names) + 20];
+                memcpy(soa, names, sizeof(names));
+                uint32_t fields[5] = {htonl(1), htonl(3600), htonl(600), htonl(86400), htonl(options.mock_ttl)};
+                memcpy(soa + sizeof(names), fields, sizeof(fields));
+                const uint8_t root = 0;
+                writer.name(&root);
+                writer.u16(TYPE_SOA);
+                writer.u16(CLASS_IN);
+                writer.u32(options.mock_ttl);
+                writer.rdata(TYPE_SOA, soa, sizeof(soa));
+            }
+            else
+            {
+                uint8_t rdata[16] = {10};
+                memcpy(rdata + 1, &hash, 8);
+                writer.name(qname);
+                writer.u16(question.qtype);
+                writer.u16(CLASS_IN);
+                writer.u32(options.mock_ttl);
+                writer.rdata(question.qtype, rdata, question.qtype == TYPE_A ? 4 : 16);
+            }
+            answered++;
+
+            if (options.mock_delay_us == 0)
+                sendto(fd, out, writer.length(), 0, reinterpret_cast<sockaddr *>(&from), sizeof(from));
+            else
+                delayed.push_back(Delayed{bench_clock::now() + chrono::microseconds(options.mock_delay_us), from,
+                                          vector<uint8_t>(out, out + writer.length())});
+        }
+    }
+    close(fd);
+}
+
+/*
+    Drives the server: one UDP socket, transaction IDs as the key of the
+    queries in flight, and a FIFO of them in the order they went out to
+    find the ones that timed out (the timeout is the same for all).
+*/
+int run_load(const Options &options, const vector<vector<uint8_t>> &queries, const vector<double> &zipf_cdf)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1 || connect(fd, reinterpret_cast<const sockaddr *>(&options.server), sizeof(options.server)) != 0)
+    {
+        cerr << "cannot reach the server: " << strerror(errno) << endl;
+        return 1;
+    }
+    int buffer_size = 8 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    struct InFlight
+    {
+        bench_clock::time_point due; // when it was meant to go out
+        uint32_t sequence = 0;
+        bool busy = false;
+    };
+    vector<InFlight> in_flight(max_in_flight);
+    deque<pair<uint16_t, uint32_t>> order; // ID and sequence, oldest first
+    size_t outstanding = 0;
+    size_t concurrency = options.qps > 0 ? max_in_flight : min(options.concurrency, max_in_flight);
+
+    mt19937_64 random(42);
+    uniform_real_distribution<double> uniform(0, 1);
+    size_t replay = 0;
+    uint16_t next_id = 0;
+    uint32_t sequence = 0;
+
+    uint64_t sent = 0, answered = 0, lost = 0, unsent = 0, truncated = 0;
+    uint64_t rcodes[16] = {};
+    LatencyHistogram latency;
+    uint8_t packet[max_message_size], reply[max_message_size];
+
+    auto start = bench_clock::now();
+    auto stop = start + chrono::duration_cast<bench_clock::duration>(chrono::duration<double>(options.duration_s));
+    auto interval = options.qps > 0 ? chrono::duration_cast<bench_clock::duration>(chrono::duration<double>(1.0 / options.qps))
+                                    : bench_clock::duration::zero();
+    auto next_send = start;
+    auto timeout = chrono::milliseconds(options.timeout_ms);
+    auto now = start;
+
+    while (now < stop || (outstanding > 0 && now < stop + timeout))
+    {
+        // Send whatever is due: up to the concurrency in a closed loop, on schedule in an open one
+        while (now < stop && outstanding < concurrency && (options.qps == 0 || next_send <= now))
+        {
+            const vector<uint8_t> &query = zipf_cdf.empty()
+                                               ? queries[replay++ % queries.size()]
+                                               : queries[lower_bound(zipf_cdf.begin(), zipf_cdf.end(), uniform(random)) - zipf_cdf.begin()];
+            while (in_flight[next_id].busy)
+                next_id++;
+            uint16_t id = next_id++;
+            memcpy(packet, query.data(), query.size());
+            write16(packet, id);
+            if (send(fd, packet, query.size(), MSG_DONTWAIT) == -1)
+            {
+                unsent++;
+                break; // the socket buffer is full; try again once some answers are in
+            }
+            InFlight &slot = in_flight[id];
+            slot.due = options.qps > 0 ? next_send : now;
+            slot.sequence = ++sequence;
+            slot.busy = true;
+            order.emplace_back(id, slot.sequence);
+            outstanding++;
+            sent++;
+            next_send += interval;
+        }
+        // An open loop that cannot keep up does not get to send a burst later
+        if (options.qps > 0 && outstanding >= concurrency && next_send < now)
+            next_send = now;
+
+        int wait_ms = 1;
+        if (options.qps > 0 && outstanding < concurrency && next_send > now)
+            wait_ms = DeadlineHeap::milliseconds_until(next_send, now) - 1;
+        pollfd poller = {fd, POLLIN, 0};
+        if (wait_ms > 0 || outstanding > 0)
+            poll(&poller, 1, max(wait_ms, 0));
+
+        now = bench_clock::now();
+        while (true)
+        {
+            ssize_t length = recv(fd, reply, sizeof(reply), MSG_DONTWAIT);
+            if (length < 0)
+                break;
+            if (length < 12)
+                continue;
+            InFlight &slot = in_flight[read16(reply)];
+            if (!slot.busy)
+                continue; // late, its query was counted as lost
+            slot.busy = false;
+            outstanding--;
+            answered++;
+            uint16_t flags = read16(reply + 2);
+            rcodes[flags & 0xF]++;
+            if (flags & 0x0200)
+                truncated++;
+            latency.add(chrono::duration_cast<chrono::microseconds>(now - slot.due).count());
+        }
+
+        while (!order.empty())
+        {
+            auto [id, slot_sequence] = order.front();
+            InFlight &slot = in_flight[id];
+            if (slot.busy && slot.sequence == slot_sequence && now - slot.due < timeout)
+                break;
+            if (slot.busy && slot.sequence == slot_sequence)
+            {
+                slot.busy = false;
+                outstanding--;
+                lost++;
+            }
+            order.pop_front();
+        }
+    }
+    close(fd);
+
+    double elapsed = chrono::duration<double>(min(now, stop) - start).count();
+    static const char *rcode_names[16] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+    cout << "queries: sent " << sent << ", answered " << answered << ", lost " << lost;
+    if (sent > 0)
+        cout << " (" << fixed << setprecision(3) << 100.0 * lost / sent << "%)";
+    if (truncated > 0)
+        cout << ", truncated " << truncated;
+    if (unsent > 0)
+        cout << ", send buffer full " << unsent << " times";
+    cout << endl;
+    cout << "rcodes:";
+    for (int rcode = 0; rcode < 16; rcode++)
+        if (rcodes[rcode] > 0)
+            cout << " " << (rcode_names[rcode] ? rcode_names[rcode] : to_string(rcode).c_str()) << " " << rcodes[rcode];
+    cout << endl;
+    cout << "throughput: " << fixed << setprecision(1) << answered / elapsed << " answers/s over " << elapsed << " s";
+    if (options.qps > 0)
+        cout << " (" << options.qps << " queries/s offered)";
+    cout << endl;
+    if (latency.count() > 0)
+    {
+        cout << "latency: p50 " << latency.percentile(50) << " us, p90 " << latency.percentile(90) << " us, p99 "
+             << latency.percentile(99) << " us, p99.9 " << latency.percentile(99.9) << " us, max " << latency.max_value() << " us" << endl;
+        latency.print(cout);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    parse_address(default_addr, options.server);
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (option == "--server" && has_value)
+        {
+            if (!parse_address(argv[++i], options.server))
+            {
+                cerr << "bad --server " << argv[i] << ", expected ip[:port]" << endl;
+                return 2;
+            }
+        }
+        else if (option == "--queries" && has_value)
+            options.queries_path = argv[++i];
+        else if (option == "--zipf" && has_value)
+            options.zipf_names = strtoull(argv[++i], nullptr, 10);
+        else if (option == "--zipf-s" && has_value)
+            options.zipf_s = atof(argv[++i]);
+        else if (option == "--domain" && has_value)
+            options.zipf_domain = argv[++i];
+        else if (option == "--duration" && has_value)
+            options.duration_s = atof(argv[++i]);
+        else if (option == "--concurrency" && has_value)
+            options.concurrency = max(1, atoi(argv[++i]));
+        else if (option == "--qps" && has_value)
+            options.qps = atof(argv[++i]);
+        else if (option == "--timeout" && has_value)
+            options.timeout_ms = max(1, atoi(argv[++i]));
+        else if (option == "--edns" && has_value)
+            options.edns_size = min(max(atoi(argv[++i]), 512), 65535);
+        else if (option == "--mock" && has_value)
+            options.mock_port = atoi(argv[++i]);
+        else if (option == "--mock-only")
+            options.mock_only = true;
+        else if (option == "--mock-ttl" && has_value)
+            options.mock_ttl = strtoul(argv[++i], nullptr, 10);
+        else if (option == "--mock-delay" && has_value)
+            options.mock_delay_us = max(0, atoi(argv[++i]));
+        else
+        {
+            cerr << "usage: dnsbench [--server ip[:port]] (--queries <file> | --zipf <names> [--zipf-s 1.0] [--domain bench.test])\n"
+                    "                [--duration 10] [--concurrency 100 | --qps <rate>] [--timeout 1000] [--edns <size>]\n"
+                    "                [--mock <port> [--mock-only] [--mock-ttl 300] [--mock-delay <us>]]"
+                 << endl;
+            return 2;
+        }
+    }
+
+    atomic<bool> running{true};
+    atomic<uint64_t> mock_answered{0};
+    thread mock;
+    if (options.mock_port != 0)
+    {
+        cout << "mock upstream: 127.0.0.1:" << options.mock_port << ", ttl " << options.mock_ttl << " s, delay "
+             << options.mock_delay_us << " us" << endl;
+        if (options.mock_only)
+        {
+            run_mock(options, running, mock_answered);
+            return 1; // only returns if it could not start
+        }
+        mock = thread(run_mock, cref(options), ref(running), ref(mock_answered));
+    }
+
+    vector<vector<uint8_t>> queries;
+    vector<double> zipf_cdf;
+    int result = 2;
+    if (!options.queries_path.empty())
+    {
+        if (load_queries(options.queries_path, options.edns_size, queries))
+            result = 0;
+    }
+    else if (options.zipf_names > 0)
+    {
+        // Rank k is drawn with probability proportional to 1 / k^s
+        double total = 0;
+        zipf_cdf.reserve(options.zipf_names);
+        queries.resize(options.zipf_names);
+        for (size_t rank = 1; rank <= options.zipf_names; rank++)
+        {
+            total += 1.0 / pow(double(rank), options.zipf_s);
+            zipf_cdf.push_back(total);
+            make_query("n" + to_string(rank) + "." + options.zipf_domain, TYPE_A, options.edns_size, queries[rank - 1]);
+        }
+        for (double &share : zipf_cdf)
+            share /= total;
+        zipf_cdf.back() = 1.0;
+        result = 0;
+    }
+    else
+        cerr << "nothing to send: give --queries <file> or --zipf <names>" << endl;
+
+    if (result == 0)
+    {
+        char server[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &options.server.sin_addr, server, sizeof(server));
+        cout << "server: " << server << ":" << ntohs(options.server.sin_port) << ", ";
+        if (options.qps > 0)
+            cout << "open loop at " << options.qps << " queries/s";
+        else
+            cout << "closed loop with " << options.concurrency << " outstanding";
+        cout << " for " << options.duration_s << " s, " << queries.size() << " distinct queries" << endl;
+        result = run_load(options, queries, zipf_cdf);
+    }
+
+    running = false;
+    if (mock.joinable())
+    {
+        mock.join();
+        cout << "mock upstream: answered " << mock_answered << " queries" << endl;
+    }
+    return result;
+}
@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "cache.h"
+#include "ratelimit.h"
+#include "wire.h"
+
+using namespace std;
+
+/*
+    microbench: the CPU cost of the per-packet code, without sockets, for
+    catching regressions from one change to the next.
+
+        microbench                      # everything
+        microbench parse                # benchmarks whose name contains "parse"
+        microbench --save before.txt    # ...change something, rebuild...
+        microbench --compare before.txt
+
+    Every benchmark runs over a corpus of realistic packets: queries as dig
+    sends them, and answers with compressed names, CNAME chains, glue and
+    many records. The steps are the ones a worker takes for every packet:
+    parsing in place, copying an upstream answer out, looking it up in the
+    cache, and writing the reply. Each step is reported in ns per packet
+    and heap allocations per packet; the latter should be 0 everywhere once
+    the buffers are warm. This target always counts allocations, whatever
+    the build type. Time is only meaningful in an optimized build
+    (-DCMAKE_BUILD_TYPE=Release).
+*/
+
+typedef chrono::steady_clock bench_clock;
+
+// Keeps the compiler from proving a result unused and dropping the work
+template <typename T>
+inline void keep(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+vector<uint8_t> wire_name(const string &dotted)
+{
+    vector<uint8_t> wire;
+    stringstream labels(dotted);
+    string label;
+    while (getline(labels, label, '.'))
+    {
+        wire.push_back(label.size());
+        wire.insert(wire.end(), label.begin(), label.end());
+    }
+    wire.push_back(0);
+    return wire;
+}
+
+/*
+    Builds corpus packets the way a real server lays them out, with every
+    name compressed against the ones before it.
+*/
+struct PacketBuilder
+{
+    uint8_t buffer[max_message_size];
+    WireWriter writer{buffer, sizeof(buffer)};
+    uint16_t counts[4] = {};
+
+    PacketBuilder(uint16_t flags) { writer.header(DNSHeader{0x1234, flags, 0, 0, 0, 0}); }
+
+    PacketBuilder &question(const string &name, uint16_t type)
+    {
+        writer.name(wire_name(name).data());
+        writer.u16(type);
+        writer.u16(CLASS_IN);
+        counts[0]++;
+        return *this;
+    }
+
+    PacketBuilder &record(Section section, const string &name, uint16_t type, uint32_t ttl, const vector<uint8_t> &rdata)
+    {
+        writer.name(wire_name(name).data());
+        writer.u16(type);
+        writer.u16(CLASS_IN);
+        writer.u32(ttl);
+        writer.rdata(type, rdata.data(), rdata.size());
+        counts[1 + section]++;
+        return *this;
+    }
+
+    PacketBuilder &opt()
+    {
+        writer.opt(default_edns_size, 0, false);
+        counts[3]++;
+        return *this;
+    }
+
+    vector<uint8_t> bytes()
+    {
+        for (int i = 0; i < 4; i++)
+            writer.patch16(4 + 2 * i, counts[i]);
+        return vector<uint8_t>(buffer, buffer + writer.length());
+    }
+};
+
+vector<uint8_t> a(uint8_t last) { return {192, 0, 2, last}; }
+vector<uint8_t> aaaa(uint8_t last) { return {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, last}; }
+vector<uint8_t> with_name(vector<uint8_t> prefix, const string &name)
+{
+    vector<uint8_t> wire = wire_name(name);
+    prefix.insert(prefix.end(), wire.begin(), wire.end());
+    return prefix;
+}
+
+struct CorpusPacket
+{
+    string name;
+    vector<uint8_t> bytes;
+    bool response;
+};
+
+vector<CorpusPacket> make_corpus()
+{
+    vector<CorpusPacket> corpus;
+    corpus.push_back({"query-a", PacketBuilder(0x0120).question("www.example.com", TYPE_A).opt().bytes(), false});
+    corpus.push_back({"query-2q", PacketBuilder(0x0100).question("www.example.com", TYPE_A).question("mail.example.com", TYPE_AAAA).bytes(), false});
+
+    corpus.push_back({"answer-a", PacketBuilder(0x8180).question("www.example.com", TYPE_A).record(ANSWER_SECTION, "www.example.com", TYPE_A, 300, a(80)).opt().bytes(), true});
+
+    PacketBuilder cname(0x8180);
+    cname.question("www.shop.example.com", TYPE_A)
+        .record(ANSWER_SECTION, "www.shop.example.com", TYPE_CNAME, 3600, wire_name("shop.edge.cdn-provider.net"))
+        .record(ANSWER_SECTION, "shop.edge.cdn-provider.net", TYPE_CNAME, 60, wire_name("e1234.a.cdn-provider.net"));
+    for (uint8_t i = 1; i <= 4; i++)
+        cname.record(ANSWER_SECTION, "e1234.a.cdn-provider.net", TYPE_A, 20, a(i));
+    corpus.push_back({"answer-cname-4a", cname.opt().bytes(), true});
+
+    PacketBuilder mx(0x8180);
+    mx.question("example.com", TYPE_MX);
+    for (int i = 1; i <= 3; i++)
+        mx.record(ANSWER_SECTION, "example.com", TYPE_MX, 3600, with_name({0, uint8_t(10 * i)}, "mail" + to_string(i) + ".example.com"));
+    mx.record(AUTHORITY_SECTION, "example.com", TYPE_NS, 86400, wire_name("ns1.example.com"))
+        .record(AUTHORITY_SECTION, "example.com", TYPE_NS, 86400, wire_name("ns2.example.com"));
+    for (int i = 1; i <= 3; i++)
+        mx.record(ADDITIONAL_SECTION, "mail" + to_string(i) + ".example.com", TYPE_A, 3600, a(20 + i))
+            .record(ADDITIONAL_SECTION, "mail" + to_string(i) + ".example.com", TYPE_AAAA, 3600, aaaa(20 + i));
+    corpus.push_back({"answer-mx-glue", mx.opt().bytes(), true});
+
+    vector<uint8_t> soa = with_name(wire_name("ns1.example.com"), "hostmaster.example.com");
+    for (uint32_t field : {2024010101u, 7200u, 1800u, 1209600u, 300u})
+        soa.insert(soa.end(), {uint8_t(field >> 24), uint8_t(field >> 16), uint8_t(field >> 8), uint8_t(field)});
+    corpus.push_back({"nxdomain-soa", PacketBuilder(0x8183).question("nope.example.com", TYPE_A).record(AUTHORITY_SECTION, "example.com", TYPE_SOA, 300, soa).opt().bytes(), true});
+
+    PacketBuilder many(0x8180);
+    many.question("pool.ntp.example.org", TYPE_AAAA);
+    for (uint8_t i = 1; i <= 16; i++)
+        many.record(ANSWER_SECTION, "pool.ntp.example.org", TYPE_AAAA, 150, aaaa(i));
+    corpus.push_back({"answer-16aaaa", many.opt().bytes(), true});
+    return corpus;
+}
+
+struct Result
+{
+    string name;
+    double ns;
+    double allocations;
+};
+
+class Harness
+{
+    string filter_;
+    double min_time_s_;
+
+public:
+    vector<Result> results;
+
+    Harness(const string &filter, double min_time_s) : filter_(filter), min_time_s_(min_time_s) {}
+
+    /*
+        Runs op in batches sized to take about 10 ms each, until min_time
+        has passed, and keeps the median batch. Allocations are counted
+        over every batch after the first, which warms up the buffers.
+    */
+    template <typename Op>
+    void run(const string &name, Op &&op)
+    {
+        if (name.find(filter_) == string::npos)
+            return;
+
+        size_t batch = 1;
+        while (true)
+        {
+            auto start = bench_clock::now();
+            for (size_t i = 0; i < batch; i++)
+                op();
+            if (bench_clock::now() - start > chrono::milliseconds(10) || batch >= (size_t(1) << 30))
+                break;
+            batch *= 2;
+        }
+
+        vector<double> per_op;
+        uint64_t allocations_before = thread_allocations();
+        auto deadline = bench_clock::now() + chrono::duration_cast<bench_clock::duration>(chrono::duration<double>(min_time_s_));
+        do
+        {
+            auto start = bench_clock::now();
+            for (size_t i = 0; i < batch; i++)
+                op();
+            per_op.push_back(chrono::duration<double, nano>(bench_clock::now() - start).count() / batch);
+        } while (bench_clock::now() < deadline || per_op.size() < 3);
+        double allocations = double(thread_allocations() - allocations_before) / (batch * per_op.size());
+
+        nth_element(per_op.begin(), per_op.begin() + per_op.size() / 2, per_op.end());
+        results.push_back({name, per_op[per_op.size() / 2], allocations});
+    }
+};
+
+int main(int argc, char **argv)
+{
+    string filter, save_path, compare_path;
+    double min_time_s = 0.3;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+            save_path = argv[++i];
+        else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+            compare_path = argv[++i];
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+            min_time_s = atof(argv[++i]);
+        else if (argv[i][0] != '-')
+            filter = argv[i];
+        else
+        {
+            cerr << "usage: microbench [filter] [--min-time 0.3] [--save <file>] [--compare <file>]" << endl;
+            return 2;
+        }
+    }
+
+    vector<CorpusPacket> corpus = make_corpus();
+    Harness harness(filter, min_time_s);
+    MessageView view;
+    uint8_t out[max_message_size];
+
+    // Parsing in place, with every record, as upstream answers are parsed
+    for (auto &packet : corpus)
+        harness.run("parse/" + packet.name, [&] {
+            keep(view.parse(packet.bytes.data(), packet.bytes.size()));
+        });
+
+    // Uncompressing every name of a packet, as the questions of a client are copied out
+    for (auto &packet : corpus)
+    {
+        view.parse(packet.bytes.data(), packet.bytes.size());
+        MessageView parsed = view;
+        harness.run("names/" + packet.name, [&] {
+            uint8_t name[max_name_length];
+            for (size_t i = 0; i < parsed.question_count(); i++)
+                keep(parsed.question(i).name.copy_to(name));
+            for (size_t i = 0; i < parsed.record_count(); i++)
+                keep(parsed.record(i).name.copy_to(name));
+        });
+    }
+
+    // Copying an upstream answer out of its packet, and writing a reply of it
+    // for a client, with the names compressed again
+    for (auto &packet : corpus)
+    {
+        if (!packet.response)
+            continue;
+        view.parse(packet.bytes.data(), packet.bytes.size());
+        MessageView parsed = view;
+        RecordSet records;
+        harness.run("copy_records/" + packet.name, [&] {
+            records.clear();
+            copy_records(parsed, records);
+            keep(records.size());
+        });
+
+        WireName qname;
+        qname.length = parsed.question(0).name.copy_to(qname.bytes);
+        uint16_t qtype = parsed.question(0).qtype;
+        harness.run("write_reply/" + packet.name, [&] {
+            WireWriter writer(out, default_edns_size - opt_record_size);
+            writer.header(DNSHeader{0x1234, 0x8180, 1, 0, 0, 0});
+            writer.name(qname.data());
+            writer.u16(qtype);
+            writer.u16(CLASS_IN);
+            write_records(writer, records);
+            writer.set_capacity(default_edns_size);
+            writer.opt(default_edns_size, 0, false);
+            keep(writer.length());
+        });
+
+        // A cache hit: the key is built from the question, the answer appended with its TTLs counted down
+        AnswerCache cache(1024 * 1024);
+        cache.insert(CacheKey(qname.data(), qtype, CLASS_IN), records);
+        RecordSet hit;
+        harness.run("cache_hit/" + packet.name, [&] {
+            hit.clear();
+            keep(cache.lookup(CacheKey(qname.data(), qtype, CLASS_IN), hit).found);
+        });
+    }
+
+    // A client query answered from the cache, minus the syscalls: parse,
+    // look up, write the reply
+    {
+        const CorpusPacket &query = corpus[0];
+        const CorpusPacket &answer = corpus[3];
+        view.parse(answer.bytes.data(), answer.bytes.size());
+        RecordSet records;
+        copy_records(view, records);
+        AnswerCache cache(1024 * 1024);
+        view.parse(query.bytes.data(), query.bytes.size());
+        cache.insert(CacheKey(view.question(0).name, TYPE_A, CLASS_IN), records);
+
+        RecordSet hit;
+        harness.run("end_to_end/query-a-cache-hit", [&] {
+            view.parse(query.bytes.data(), query.bytes.size());
+            const QuestionView &question = view.question(0);
+            hit.clear();
+            cache.lookup(CacheKey(question.name, question.qtype, question.qclass), hit);
+
+            uint8_t qname[max_name_length];
+            question.name.copy_to(qname);
+            WireWriter writer(out, view.edns().udp_size - opt_record_size);
+            writer.header(DNSHeader{view.header().id, 0x8180, 1, 0, 0, 0});
+            writer.name(qname);
+            writer.u16(question.qtype);
+            writer.u16(question.qclass);
+            write_records(writer, hit);
+            writer.set_capacity(view.edns().udp_size);
+            writer.opt(default_edns_size, 0, false);
+            keep(writer.length());
+        });
+    }
+
+    // The rate limiter on every packet: a client's bucket on arrival, the
+    // reply's bucket on the way out. Clients come from a million addresses,
+    // so the buckets mostly miss the CPU caches, as under a real flood.
+    {
+        RateLimiter limiter;
+        limiter.configure(1000, 100, 2, 12345);
+        auto now = RateLimiter::clock::now();
+        const uint8_t *qname = corpus[0].bytes.data() + sizeof(DNSHeader);
+        uint32_t client = 0;
+        harness.run("rate_limit/query", [&] {
+            client = client * 1103515245 + 12345;
+            keep(limiter.allow_query(htonl(0x0A000000 | (client >> 12)), now));
+        });
+        harness.run("rate_limit/response", [&] {
+            client = client * 1103515245 + 12345;
+            keep(limiter.check_response(htonl(0x0A000000 | (client >> 12)), qname, TYPE_A, 0, now));
+        });
+    }
+
+    map<string, Result> baseline;
+    if (!compare_path.empty())
+    {
+        ifstream in(compare_path);
+        if (!in)
+        {
+            cerr << compare_path << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        Result result;
+        while (in >> result.name >> result.ns >> result.allocations)
+            baseline[result.name] = result;
+    }
+
+    cout << left << setw(34) << "benchmark" << right << setw(12) << "ns/packet" << setw(15) << "allocs/packet" << setw(14) << "packets/s";
+    if (!baseline.empty())
+        cout << setw(12) << "vs saved";
+    cout << endl;
+    for (auto &result : harness.results)
+    {
+        cout << left << setw(34) << result.name << right << fixed << setprecision(1) << setw(12) << result.ns
+             << setprecision(2) << setw(15) << result.allocations << setw(13) << setprecision(2) << 1000.0 / result.ns << "M";
+        auto saved = baseline.find(result.name);
+        if (saved != baseline.end())
+            cout << setw(11) << showpos << setprecision(1) << 100.0 * (result.ns - saved->second.ns) / saved->second.ns << "%" << noshowpos;
+        cout << endl;
+    }
+
+    if (!save_path.empty())
+    {
+        ofstream saved(save_path);
+        for (auto &result : harness.results)
+            saved << result.name << " " << result.ns << " " << result.allocations << "\n";
+        cout << "saved to " << save_path << endl;
+    }
+    return 0;
+}
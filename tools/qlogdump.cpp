@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "querylog.h"
+#include "wire.h"
+
+using namespace std;
+
+/*
+    qlogdump: prints the binary query log the server writes with
+    --query-log, one query per line.
+
+        qlogdump /var/log/dns/queries.log /var/log/dns/queries.log.1
+
+        2024-05-01T12:00:00.123456Z 192.0.2.1:53122 www.example.com. A NOERROR 12us cached
+*/
+
+static string type_name(uint16_t type)
+{
+    switch (type)
+    {
+    case TYPE_A:
+        return "A";
+    case TYPE_NS:
+        return "NS";
+    case TYPE_CNAME:
+        return "CNAME";
+    case TYPE_SOA:
+        return "SOA";
+    case TYPE_PTR:
+        return "PTR";
+    case TYPE_MX:
+        return "MX";
+    case TYPE_TXT:
+        return "TXT";
+    case TYPE_AAAA:
+        return "AAAA";
+    case TYPE_SRV:
+        return "SRV";
+    case TYPE_ANY:
+        return "ANY";
+    default:
+        return "TYPE" + to_string(type);
+    }
+}
+
+static string rcode_name(uint8_t rcode)
+{
+    static const char *names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+    return rcode < 6 ? names[rcode] : "RCODE" + to_string(rcode);
+}
+
+static void print(const QueryLogRecord &record)
+{
+    time_t seconds = record.time_ns / 1000000000;
+    tm utc;
+    gmtime_r(&seconds, &utc);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &utc);
+
+    char address[INET_ADDRSTRLEN];
+    in_addr client = {record.client_address};
+    inet_ntop(AF_INET, &client, address, sizeof(address));
+
+    // The labels have to end inside the record, whatever the file says
+    size_t length = min<size_t>(record.qname_length, query_log_name_size);
+    size_t end = 0;
+    while (end < length && record.qname[end] != 0)
+        end += 1 + record.qname[end];
+    string name = length == 0 || end >= length ? "-" : name_to_string(record.qname);
+    if (record.flags & QUERYLOG_NAME_CUT)
+        name += "...";
+
+    cout << when << "." << setw(6) << setfill('0') << record.time_ns / 1000 % 1000000 << setfill(' ') << "Z "
+         << address << ":" << ntohs(record.client_port) << " " << name << " " << type_name(record.qtype) << " "
+         << rcode_name(record.rcode) << " " << record.latency_us << "us";
+    if (record.flags & QUERYLOG_CACHED)
+        cout << " cached";
+    if (record.flags & QUERYLOG_ZONE)
+        cout << " zone";
+    if (record.flags & QUERYLOG_TCP)
+        cout << " tcp";
+    if (record.flags & QUERYLOG_TRUNCATED)
+        cout << " tc";
+    // A rate-limited reply that went out anyway, truncated, was slipped
+    if (record.flags & QUERYLOG_RATE_LIMITED)
+        cout << (record.flags & QUERYLOG_TRUNCATED ? " rate-limited slipped" : " rate-limited");
+    cout << "\n";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cerr << "usage: qlogdump <query log>..." << endl;
+        return 2;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        ifstream in(argv[i], ios::binary);
+        QueryLogHeader header;
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            memcmp(header.magic, query_log_magic, sizeof(header.magic)) != 0 || header.record_size != sizeof(QueryLogRecord))
+        {
+            cerr << argv[i] << ": not a query log" << endl;
+            return 1;
+        }
+
+        QueryLogRecord record;
+        while (in.read(reinterpret_cast<char *>(&record), sizeof(record)))
+            print(record);
+    }
+    return 0;
+}
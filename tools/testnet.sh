@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Starts a stand-in DNS hierarchy on loopback addresses, to try out
+# resolving from the root (--root-hints) without the real root:
+#
+#   127.0.0.2  .               the root, delegating test.
+#   127.0.0.3  test.           delegating example.test (with glue) and other.test (without)
+#   127.0.0.4  example.test.
+#   127.0.0.5  other.test.
+#
+# Each is the server itself, authoritative for one zone from tools/testnet.
+# Glue carries no port, so they all listen on the same one, and the
+# resolver is told to ask name servers there:
+#
+#   tools/testnet.sh start 5300
+#   ./build/server --root-hints tools/testnet/root.hints --authority-port 5300
+#   dig @127.0.0.1 -p 2053 chain.other.test
+#   tools/testnet.sh stop
+
+set -e
+
+cd "$(dirname "$0")/.."
+SERVER=${SERVER:-./build/server}
+PORT=${2:-5300}
+RUN=${TMPDIR:-/tmp}/dns-testnet
+
+case "$1" in
+start)
+    mkdir -p "$RUN"
+    for server in 127.0.0.2=.=root.zone 127.0.0.3=test.=test.zone \
+                  127.0.0.4=example.test.=example.test.zone 127.0.0.5=other.test.=other.test.zone; do
+        address=${server%%=*}
+        zone=${server#*=}
+        "$SERVER" --listen "$address:$PORT" --zone "${zone%%=*}=tools/testnet/${zone#*=}" > "$RUN/$address.log" 2>&1 &
+        echo $! > "$RUN/$address.pid"
+    done
+    echo "name servers on 127.0.0.2-5 port $PORT, logs in $RUN"
+    ;;
+stop)
+    for pid in "$RUN"/*.pid; do
+        [ -f "$pid" ] && kill "$(cat "$pid")" 2>/dev/null || true
+        rm -f "$pid"
+    done
+    ;;
+*)
+    echo "usage: $0 start|stop [port]" >&2
+    exit 2
+    ;;
+esac
@@ -0,0 +1,72 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "atomic_file.h"
+#include "zone.h"
+#include "zonefile.h"
+
+using namespace std;
+
+/*
+    zonec: compiles zone files into the image the server maps with
+    --zone-image, so that it starts without parsing anything.
+
+        zonec -o zones.img example.com=example.com.zone internal.zone
+
+    Zones are given like the server's --zone option, as origin=file or as
+    a file whose SOA says what its origin is.
+*/
+int main(int argc, char **argv)
+{
+    string output;
+    vector<string> zones;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else
+            zones.push_back(argv[i]);
+    }
+    if (output.empty() || zones.empty())
+    {
+        cerr << "usage: zonec -o <image> [origin=]<zone file>..." << endl;
+        return 2;
+    }
+
+    auto start = chrono::steady_clock::now();
+    ZoneBuilder builder;
+    for (auto &argument : zones)
+    {
+        size_t equals = argument.find('=');
+        string origin = equals == string::npos ? "" : argument.substr(0, equals);
+        string path = equals == string::npos ? argument : argument.substr(equals + 1);
+        if (!builder.load(path, origin))
+            return 1;
+    }
+
+    vector<uint8_t> image;
+    if (!builder.build(image))
+        return 1;
+
+    // Check that the server will take it before replacing anything
+    vector<uint8_t> copy = image;
+    ZoneIndex index;
+    if (!index.open(std::move(copy)))
+    {
+        cerr << "Built an invalid image" << endl;
+        return 1;
+    }
+    if (!write_file_atomically(output, image))
+        return 1;
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << output << ": " << index.zone_count() << " zones, " << index.record_count() << " records, "
+         << index.node_count() << " names, " << image.size() << " bytes";
+    if (builder.skipped() > 0)
+        cout << ", " << builder.skipped() << " records skipped";
+    cout << ", compiled in " << elapsed << " ms" << endl;
+    return 0;
+}